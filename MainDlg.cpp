@@ -2,7 +2,6 @@
 #include "resource.h"
 
 #include "MainDlg.h"
-#include "RarFile.h"
 
 BOOL CMainDlg::OnInitDialog(CWindow wndFocus, LPARAM lInitParam)
 {
@@ -15,27 +14,42 @@ BOOL CMainDlg::OnInitDialog(CWindow wndFocus, LPARAM lInitParam)
 	HICON hIconSmall = AtlLoadIconImage(IDR_MAINFRAME, LR_DEFAULTCOLOR, ::GetSystemMetrics(SM_CXSMICON), ::GetSystemMetrics(SM_CYSMICON));
 	SetIcon(hIconSmall, FALSE);
 
+	// Completions run on the dialog thread, from the message loop.
+	HWND hWnd = m_hWnd;
+	m_async.reset(new RarAsync([hWnd](std::function<void()> completion) {
+		auto completionPtr = new std::function<void()>(std::move(completion));
+		if(!::PostMessage(hWnd, UWM_ASYNC_COMPLETION, 0, reinterpret_cast<LPARAM>(completionPtr))) {
+			delete completionPtr;
+		}
+	}, 1));
+
 	const WCHAR* archivePath = reinterpret_cast<const WCHAR*>(lInitParam);
 	if(archivePath) {
-		const WCHAR* errorMsg;
-		if(!LoadArchive(archivePath, errorMsg)) {
-			MessageBox(errorMsg, L"Error", MB_ICONERROR);
-		}
+		LoadArchive(archivePath);
 	}
 
 	return TRUE;
 }
 
+void CMainDlg::OnDestroy()
+{
+	// Wait for a running operation, and drop the completions which weren't
+	// run yet.
+	m_async.reset();
+
+	MSG msg;
+	while(::PeekMessage(&msg, m_hWnd, UWM_ASYNC_COMPLETION, UWM_ASYNC_COMPLETION, PM_REMOVE)) {
+		delete reinterpret_cast<std::function<void()>*>(msg.lParam);
+	}
+}
+
 void CMainDlg::OnDropFiles(HDROP hDropInfo)
 {
 	if(DragQueryFile(hDropInfo, 0xFFFFFFFF, NULL, 0) == 1) {
 		WCHAR fileName[MAX_PATH];
 		DragQueryFile(hDropInfo, 0, fileName, MAX_PATH);
 
-		const WCHAR* errorMsg;
-		if(!LoadArchive(fileName, errorMsg)) {
-			MessageBox(errorMsg, L"Error", MB_ICONERROR);
-		}
+		LoadArchive(fileName);
 	} else {
 		MessageBox(L"Please drop one file at a time", L"Unsupported", MB_ICONINFORMATION);
 	}
@@ -43,6 +57,14 @@ void CMainDlg::OnDropFiles(HDROP hDropInfo)
 	DragFinish(hDropInfo);
 }
 
+LRESULT CMainDlg::OnAsyncCompletion(UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+	std::unique_ptr<std::function<void()>> completion(
+		reinterpret_cast<std::function<void()>*>(lParam));
+	(*completion)();
+	return 0;
+}
+
 void CMainDlg::OnBrowse(UINT uNotifyCode, int nID, CWindow wndCtl)
 {
 	const WCHAR* filter =
@@ -62,10 +84,7 @@ void CMainDlg::OnBrowse(UINT uNotifyCode, int nID, CWindow wndCtl)
 		return;
 	}
 
-	const WCHAR* errorMsg;
-	if(!LoadArchive(fileDlg.m_szFileName, errorMsg)) {
-		MessageBox(errorMsg, L"Error", MB_ICONERROR);
-	}
+	LoadArchive(fileDlg.m_szFileName);
 }
 
 void CMainDlg::OnAppAbout(UINT uNotifyCode, int nID, CWindow wndCtl)
@@ -78,13 +97,7 @@ void CMainDlg::OnOK(UINT uNotifyCode, int nID, CWindow wndCtl)
 {
 	assert(m_canModifyArchive);
 
-	CString archivePath;
-	GetDlgItemText(IDC_PATH, archivePath);
-
-	const WCHAR* errorMsg;
-	if(!ModifyArchive(archivePath, errorMsg)) {
-		MessageBox(errorMsg, L"Error", MB_ICONERROR);
-	}
+	ModifyArchive();
 }
 
 void CMainDlg::OnCancel(UINT uNotifyCode, int nID, CWindow wndCtl)
@@ -92,10 +105,29 @@ void CMainDlg::OnCancel(UINT uNotifyCode, int nID, CWindow wndCtl)
 	EndDialog(nID);
 }
 
-bool CMainDlg::LoadArchive(const WCHAR* archivePath, const WCHAR*& errorMsg)
+void CMainDlg::LoadArchive(const WCHAR* archivePath)
+{
+	if(m_busy) {
+		return;
+	}
+
+	SetBusy(true);
+
+	CString path = archivePath;
+	m_async->LoadAsync(archivePath, [this, path](RarFile::error err, std::shared_ptr<RarSession> session) {
+		SetBusy(false);
+
+		const WCHAR* errorMsg;
+		if(!OnArchiveLoaded(path, err, session, errorMsg)) {
+			MessageBox(errorMsg, L"Error", MB_ICONERROR);
+		}
+	});
+}
+
+// On failure, the previously loaded archive stays loaded.
+bool CMainDlg::OnArchiveLoaded(const WCHAR* archivePath, RarFile::error err,
+	std::shared_ptr<RarSession> session, const WCHAR*& errorMsg)
 {
-	RarFile file;
-	RarFile::error err = file.Open(archivePath);
 	switch(err) {
 	case RarFile::error::success:
 		// Very good, continue.
@@ -114,10 +146,12 @@ bool CMainDlg::LoadArchive(const WCHAR* archivePath, const WCHAR*& errorMsg)
 		return false;
 	}
 
+	m_session = session;
+
 	bool encrypted = false;
 
 	DWORD flags;
-	err = file.GetFlags(flags);
+	err = m_session->GetFlags(flags);
 	switch(err) {
 	case RarFile::error::success:
 		// OK.
@@ -136,7 +170,7 @@ bool CMainDlg::LoadArchive(const WCHAR* archivePath, const WCHAR*& errorMsg)
 		return false;
 	}
 
-	SetInfoToGui(archivePath, file.GetRarVersion(), file.IsSFX(), encrypted, flags);
+	SetInfoToGui(archivePath, m_session->GetRarVersion(), m_session->IsSFX(), encrypted, flags);
 
 	if(encrypted) {
 		m_canModifyArchive = false;
@@ -153,58 +187,42 @@ bool CMainDlg::LoadArchive(const WCHAR* archivePath, const WCHAR*& errorMsg)
 	return true;
 }
 
-bool CMainDlg::ModifyArchive(const WCHAR* archivePath, const WCHAR*& errorMsg)
+void CMainDlg::ModifyArchive()
 {
-	RarFile file;
-	RarFile::error err = file.Open(archivePath, true);
-	switch(err) {
-	case RarFile::error::success:
-		// Very good, continue.
-		break;
+	if(m_busy) {
+		return;
+	}
 
-	case RarFile::error::open_failed:
-		errorMsg = L"Could not open file for writing";
-		return false;
+	SetBusy(true);
 
-	case RarFile::error::invalid_file:
-		errorMsg = L"The file is not a valid RAR archive, perhaps the file was modified";
-		return false;
+	m_async->SetLockedAsync(m_session, !m_archiveLocked, [this](RarFile::error err) {
+		SetBusy(false);
 
-	default:
-		errorMsg = L"An unknown error occurred";
-		return false;
-	}
+		const WCHAR* errorMsg;
+		if(!OnArchiveModified(err, errorMsg)) {
+			MessageBox(errorMsg, L"Error", MB_ICONERROR);
+		}
+	});
+}
 
-	DWORD flags;
-	err = file.GetFlags(flags);
+bool CMainDlg::OnArchiveModified(RarFile::error err, const WCHAR*& errorMsg)
+{
 	switch(err) {
 	case RarFile::error::success:
 		// OK.
 		break;
 
-	case RarFile::error::encrypted_archive:
-		errorMsg = L"The file has encrypted headers, cannot modify";
+	case RarFile::error::open_failed:
+		errorMsg = L"Could not open file for writing";
 		return false;
 
-	case RarFile::error::invalid_file:
-		errorMsg = L"The file is not a valid RAR archive, perhaps the file was modified";
+	case RarFile::error::file_changed:
+		errorMsg = L"The file was modified since it was loaded, please load it again";
 		return false;
 
-	default:
-		errorMsg = L"An unknown error occurred while getting flags";
+	case RarFile::error::write_failed:
+		errorMsg = L"Could not write to file";
 		return false;
-	}
-
-	if(m_archiveLocked) {
-		err = file.SetLocked(false);
-	} else {
-		err = file.SetLocked(true);
-	}
-
-	switch(err) {
-	case RarFile::error::success:
-		// OK.
-		break;
 
 	case RarFile::error::encrypted_archive:
 		errorMsg = L"The file has encrypted headers, cannot modify";
@@ -220,17 +238,29 @@ bool CMainDlg::ModifyArchive(const WCHAR* archivePath, const WCHAR*& errorMsg)
 	}
 
 	m_archiveLocked = !m_archiveLocked;
-	if(m_archiveLocked) {
-		flags |= RarFile::locked;
-	} else {
-		flags &= ~RarFile::locked;
-	}
 
-	SetInfoToGui(nullptr, file.GetRarVersion(), file.IsSFX(), false, flags);
+	DWORD flags;
+	m_session->GetFlags(flags);
+
+	SetInfoToGui(nullptr, m_session->GetRarVersion(), m_session->IsSFX(), false, flags);
+
+	if(flags & RarFile::recovery_record) {
+		MessageBox(L"The archive has a recovery record, which was not updated. "
+			L"Repairing the archive may report the main header as damaged.",
+			L"Warning", MB_ICONWARNING);
+	}
 
 	return true;
 }
 
+void CMainDlg::SetBusy(bool busy)
+{
+	m_busy = busy;
+
+	CButton(GetDlgItem(IDC_BROWSE)).EnableWindow(!busy);
+	CButton(GetDlgItem(IDOK)).EnableWindow(!busy && m_canModifyArchive);
+}
+
 void CMainDlg::SetInfoToGui(const WCHAR* archivePath, int rarVersion,
 	bool sfx, bool encrypted, DWORD flags)
 {
@@ -1,13 +1,20 @@
 #pragma once
 
+#include "RarAsync.h"
+
 class CMainDlg : public CDialogImpl<CMainDlg>
 {
 public:
 	enum { IDD = IDD_MAINDLG };
 
+	// Posted by the RarAsync executor, lParam is a heap allocated completion.
+	enum { UWM_ASYNC_COMPLETION = WM_APP + 1 };
+
 	BEGIN_MSG_MAP_EX(CMainDlg)
 		MSG_WM_INITDIALOG(OnInitDialog)
+		MSG_WM_DESTROY(OnDestroy)
 		MSG_WM_DROPFILES(OnDropFiles)
+		MESSAGE_HANDLER_EX(UWM_ASYNC_COMPLETION, OnAsyncCompletion)
 		COMMAND_HANDLER_EX(IDC_BROWSE, BN_CLICKED, OnBrowse)
 		COMMAND_ID_HANDLER_EX(IDOK, OnOK)
 		COMMAND_ID_HANDLER_EX(ID_APP_ABOUT, OnAppAbout)
@@ -15,18 +22,29 @@ public:
 	END_MSG_MAP()
 
 	BOOL OnInitDialog(CWindow wndFocus, LPARAM lInitParam);
+	void OnDestroy();
 	void OnDropFiles(HDROP hDropInfo);
+	LRESULT OnAsyncCompletion(UINT uMsg, WPARAM wParam, LPARAM lParam);
 	void OnBrowse(UINT uNotifyCode, int nID, CWindow wndCtl);
 	void OnOK(UINT uNotifyCode, int nID, CWindow wndCtl);
 	void OnAppAbout(UINT uNotifyCode, int nID, CWindow wndCtl);
 	void OnCancel(UINT uNotifyCode, int nID, CWindow wndCtl);
 
 private:
-	bool LoadArchive(const WCHAR* archivePath, const WCHAR*& errorMsg);
-	bool ModifyArchive(const WCHAR* archivePath, const WCHAR*& errorMsg);
+	void LoadArchive(const WCHAR* archivePath);
+	bool OnArchiveLoaded(const WCHAR* archivePath, RarFile::error err,
+		std::shared_ptr<RarSession> session, const WCHAR*& errorMsg);
+	void ModifyArchive();
+	bool OnArchiveModified(RarFile::error err, const WCHAR*& errorMsg);
+	void SetBusy(bool busy);
 	void SetInfoToGui(const WCHAR* archivePath, int rarVersion,
 		bool sfx, bool encrypted, DWORD flags);
 
+	// Archives are loaded and modified on the thread pool, so that a slow
+	// disk doesn't block the dialog. One operation runs at a time.
+	std::unique_ptr<RarAsync> m_async;
+	bool m_busy = false;
+	std::shared_ptr<RarSession> m_session;
 	bool m_canModifyArchive = false;
 	bool m_archiveLocked;
 };
@@ -1,7 +1,24 @@
 #include "stdafx.h"
 #include "resource.h"
 #include "MainDlg.h"
-#include "RarFile.h"
+#include "RarArena.h"
+#include "RarBatch.h"
+#include "RarCheckpoint.h"
+#include "RarClassifier.h"
+#include "RarContentHash.h"
+#include "RarHeap.h"
+#include "RarIndex.h"
+#include "RarJournal.h"
+#include "RarListing.h"
+#include "RarNameIndex.h"
+#include "RarManifest.h"
+#include "RarReport.h"
+#include "RarScheduler.h"
+#include "RarServer.h"
+#include "RarSession.h"
+#include "RarStats.h"
+#include "RarStatsReport.h"
+#include "RarTarStream.h"
 
 CAppModule _Module;
 
@@ -12,11 +29,50 @@ namespace
 		HELP,
 		UNLOCK,
 		LOCK,
+		ROLLBACK,
+		SERVER,
+		MERGE,
+		INDEX_BUILD,
+		INDEX_QUERY,
+		NAME_INDEX_BUILD,
+		NAME_INDEX_QUERY,
+		LIST,
+		STATS_REPORT,
+		CONTENT_HASH,
+		TAR,
 	};
 
+	struct BatchOptions {
+		const WCHAR* journal;
+		const WCHAR* checkpoint;
+		const WCHAR* report;
+		bool fastReject;
+		bool adaptive;
+	};
+
+	// Upper bound of the archives in flight per processor in an adaptive
+	// batch, most of the time is spent waiting for the disk.
+	const unsigned int adaptiveThreadsPerProcessor = 4;
+	const unsigned int maxAdaptiveThreads = 64;
+
 	int Default(HINSTANCE hInstance, const WCHAR* archive);
 	int Help(HINSTANCE hInstance, const WCHAR* archive);
-	int SetLock(HINSTANCE hInstance, const WCHAR* archive, bool lock);
+	int SetLock(HINSTANCE hInstance, const WCHAR* archive, bool lock, const WCHAR* output);
+	int Batch(HINSTANCE hInstance, std::vector<CString> archives, Action action, const BatchOptions& options);
+	int Rollback(HINSTANCE hInstance, const WCHAR* journal);
+	int Server(HINSTANCE hInstance, const WCHAR* pipeName);
+	int Merge(HINSTANCE hInstance, const std::vector<CString>& reports, const WCHAR* output);
+	int BuildIndex(HINSTANCE hInstance, const std::vector<CString>& archives, const WCHAR* index, bool fastReject);
+	int QueryIndex(HINSTANCE hInstance, const WCHAR* index, const WCHAR* where, const WCHAR* output);
+	int UpdateNameIndex(HINSTANCE hInstance, const std::vector<CString>& archives, const WCHAR* index);
+	int QueryNameIndex(HINSTANCE hInstance, const WCHAR* index, const WCHAR* name, const WCHAR* output);
+	int List(HINSTANCE hInstance, const WCHAR* archive, const WCHAR* output);
+	int StatsReport(HINSTANCE hInstance, const std::vector<CString>& archives, const WCHAR* report,
+		bool fastReject, bool extentOrder);
+	int ContentHash(HINSTANCE hInstance, const std::vector<CString>& archives, const WCHAR* hashes,
+		bool extentOrder);
+	int Tar(HINSTANCE hInstance, const WCHAR* tar, Action tarAction, const WCHAR* output, const WCHAR* report);
+	const WCHAR* GetErrorMessage(RarFile::error err);
 }
 
 int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPTSTR /*lpstrCmdLine*/, int /*nCmdShow*/)
@@ -36,7 +92,26 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPTSTR /*
 	ATLASSERT(SUCCEEDED(hRes));
 
 	Action action = Action::DEFAULT;
-	const WCHAR* archive = nullptr;
+	std::vector<CString> archives;
+	const WCHAR* output = nullptr;
+	const WCHAR* journal = nullptr;
+	const WCHAR* manifest = nullptr;
+	unsigned int shardIndex = 0;
+	unsigned int shardCount = 1;
+	const WCHAR* checkpoint = nullptr;
+	const WCHAR* report = nullptr;
+	const WCHAR* index = nullptr;
+	const WCHAR* statsReport = nullptr;
+	const WCHAR* hashes = nullptr;
+	const WCHAR* tar = nullptr;
+	const WCHAR* where = L"";
+	const WCHAR* name = L"";
+	const WCHAR* pipeName = L"\\\\.\\pipe\\rar_unlocker";
+	bool fastReject = false;
+	bool cachePolite = false;
+	bool extentOrder = false;
+	bool adaptive = false;
+	bool stats = false;
 	for(int i = 1; i < __argc; i++) {
 		if(_wcsicmp(__wargv[i], L"--help") == 0 ||
 			_wcsicmp(__wargv[i], L"-h") == 0) {
@@ -47,8 +122,75 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPTSTR /*
 		} else if(_wcsicmp(__wargv[i], L"--lock") == 0 ||
 			_wcsicmp(__wargv[i], L"-l") == 0) {
 			action = Action::LOCK;
+		} else if((_wcsicmp(__wargv[i], L"--output") == 0 ||
+			_wcsicmp(__wargv[i], L"-o") == 0) && i + 1 < __argc) {
+			output = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--journal") == 0 && i + 1 < __argc) {
+			journal = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--rollback") == 0 && i + 1 < __argc) {
+			action = Action::ROLLBACK;
+			journal = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--manifest") == 0 && i + 1 < __argc) {
+			manifest = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--shard") == 0 && i + 1 < __argc) {
+			i++;
+			if(swscanf_s(__wargv[i], L"%u/%u", &shardIndex, &shardCount) != 2 ||
+				shardCount == 0 || shardIndex >= shardCount) {
+				CString str;
+				str.Format(L"Invalid shard, expected index/count, e.g. 0/4:\n%s", __wargv[i]);
+				::MessageBox(NULL, str, L"Warning", MB_ICONWARNING);
+				shardIndex = 0;
+				shardCount = 1;
+			}
+		} else if(_wcsicmp(__wargv[i], L"--checkpoint") == 0 && i + 1 < __argc) {
+			checkpoint = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--report") == 0 && i + 1 < __argc) {
+			report = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--merge") == 0 && i + 1 < __argc) {
+			action = Action::MERGE;
+			output = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--index-build") == 0 && i + 1 < __argc) {
+			action = Action::INDEX_BUILD;
+			index = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--index-query") == 0 && i + 1 < __argc) {
+			action = Action::INDEX_QUERY;
+			index = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--where") == 0 && i + 1 < __argc) {
+			where = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--name-index-build") == 0 && i + 1 < __argc) {
+			action = Action::NAME_INDEX_BUILD;
+			index = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--name-index-query") == 0 && i + 1 < __argc) {
+			action = Action::NAME_INDEX_QUERY;
+			index = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--name") == 0 && i + 1 < __argc) {
+			name = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--stats-report") == 0 && i + 1 < __argc) {
+			action = Action::STATS_REPORT;
+			statsReport = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--content-hash") == 0 && i + 1 < __argc) {
+			action = Action::CONTENT_HASH;
+			hashes = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--tar") == 0 && i + 1 < __argc) {
+			tar = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--list") == 0) {
+			action = Action::LIST;
+		} else if(_wcsicmp(__wargv[i], L"--server") == 0) {
+			action = Action::SERVER;
+		} else if(_wcsicmp(__wargv[i], L"--pipe") == 0 && i + 1 < __argc) {
+			pipeName = __wargv[++i];
+		} else if(_wcsicmp(__wargv[i], L"--fast-reject") == 0) {
+			fastReject = true;
+		} else if(_wcsicmp(__wargv[i], L"--cache-polite") == 0) {
+			cachePolite = true;
+		} else if(_wcsicmp(__wargv[i], L"--extent-order") == 0) {
+			extentOrder = true;
+		} else if(_wcsicmp(__wargv[i], L"--adaptive") == 0) {
+			adaptive = true;
+		} else if(_wcsicmp(__wargv[i], L"--stats") == 0) {
+			stats = true;
 		} else if(__wargv[i][0] != '-') {
-			archive = __wargv[i];
+			archives.push_back(CString(__wargv[i]));
 		} else {
 			CString str;
 			str.Format(L"Unknown command line option, skipping:\n%s\n\n"
@@ -58,10 +200,78 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPTSTR /*
 		}
 	}
 
+	if(stats) {
+		RarStats::EnableTiming();
+		RarStats::StartSystemCacheMeasurement();
+		RarHeap::StartCounting();
+	}
+
+	if(cachePolite) {
+		RarFile::SetUnbufferedReads(true);
+	}
+
+	if(manifest && action != Action::MERGE) {
+		std::vector<CString> manifestArchives;
+		if(RarManifest::Load(manifest, manifestArchives)) {
+			archives.insert(archives.end(), manifestArchives.begin(), manifestArchives.end());
+		} else {
+			::MessageBox(NULL, L"Could not read the manifest file", L"Error", MB_ICONHAND);
+			action = Action::HELP;
+		}
+	}
+
+	if(shardCount > 1) {
+		RarManifest::FilterShard(archives, shardIndex, shardCount);
+	}
+
+	// --lock and --unlock apply to the archives of the tar stream.
+	Action tarAction = Action::DEFAULT;
+	if(tar && (action == Action::DEFAULT || action == Action::LOCK || action == Action::UNLOCK)) {
+		tarAction = action;
+		action = Action::TAR;
+	}
+
+	const WCHAR* archive = archives.empty() ? nullptr : archives.front().GetString();
+	bool batch = archives.size() > 1 || manifest || journal || checkpoint || report;
+
+	if(batch && output && action != Action::MERGE && action != Action::INDEX_QUERY &&
+		action != Action::NAME_INDEX_QUERY && action != Action::TAR) {
+		::MessageBox(NULL, L"The --output option can only be used with a single archive", L"Error", MB_ICONHAND);
+		action = Action::HELP;
+	}
+
+	// Without --lock or --unlock, a batch only collects the status of the
+	// archives. It runs when any batch option is given, otherwise the first
+	// archive is shown.
+	if(action == Action::DEFAULT) {
+		batch = manifest || report || checkpoint || journal || fastReject || cachePolite ||
+			extentOrder || adaptive;
+	}
+
+	// The stats report and the adaptive batches schedule their threads by
+	// disk themselves, the sequential runs only need the order.
+	if(extentOrder && (action == Action::INDEX_BUILD || action == Action::NAME_INDEX_BUILD ||
+		(batch && !adaptive && (action == Action::DEFAULT || action == Action::LOCK || action == Action::UNLOCK)))) {
+		std::vector<RarScheduler::Device> devices;
+		RarScheduler::Plan(archives, devices);
+
+		std::vector<CString> orderedArchives;
+		orderedArchives.reserve(archives.size());
+		for(size_t i : RarScheduler::GetOrder(devices)) {
+			orderedArchives.push_back(archives[i]);
+		}
+
+		archives.swap(orderedArchives);
+	}
+
+	BatchOptions batchOptions = { journal, checkpoint, report, fastReject, adaptive };
+
 	int nRet = 0;
 	switch(action) {
 	case Action::DEFAULT:
-		nRet = Default(hInstance, archive);
+		nRet = batch ?
+			Batch(hInstance, archives, action, batchOptions) :
+			Default(hInstance, archive);
 		break;
 
 	case Action::HELP:
@@ -69,14 +279,91 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPTSTR /*
 		break;
 
 	case Action::LOCK:
-		nRet = SetLock(hInstance, archive, true);
+		nRet = batch ?
+			Batch(hInstance, archives, action, batchOptions) :
+			SetLock(hInstance, archive, true, output);
 		break;
 
 	case Action::UNLOCK:
-		nRet = SetLock(hInstance, archive, false);
+		nRet = batch ?
+			Batch(hInstance, archives, action, batchOptions) :
+			SetLock(hInstance, archive, false, output);
+		break;
+
+	case Action::ROLLBACK:
+		nRet = Rollback(hInstance, journal);
+		break;
+
+	case Action::SERVER:
+		nRet = Server(hInstance, pipeName);
+		break;
+
+	case Action::MERGE:
+		nRet = Merge(hInstance, archives, output);
+		break;
+
+	case Action::INDEX_BUILD:
+		nRet = BuildIndex(hInstance, archives, index, fastReject);
+		break;
+
+	case Action::INDEX_QUERY:
+		nRet = QueryIndex(hInstance, index, where, output);
+		break;
+
+	case Action::NAME_INDEX_BUILD:
+		nRet = UpdateNameIndex(hInstance, archives, index);
+		break;
+
+	case Action::NAME_INDEX_QUERY:
+		nRet = QueryNameIndex(hInstance, index, name, output);
+		break;
+
+	case Action::LIST:
+		nRet = List(hInstance, archive, output);
+		break;
+
+	case Action::STATS_REPORT:
+		nRet = StatsReport(hInstance, archives, statsReport, fastReject, extentOrder);
+		break;
+
+	case Action::CONTENT_HASH:
+		nRet = ContentHash(hInstance, archives, hashes, extentOrder);
+		break;
+
+	case Action::TAR:
+		nRet = Tar(hInstance, tar, tarAction, output, report);
 		break;
 	}
 
+	if(stats) {
+		RarStats::Snapshot snapshot;
+		RarStats::GetSnapshot(snapshot);
+		CString str = RarStats::FormatSnapshot(snapshot);
+
+		if(fastReject) {
+			RarClassifier::Counters counters;
+			RarClassifier::GetCounters(counters);
+			str += L"\n\n";
+			str += RarClassifier::FormatCounters(counters);
+		}
+
+		RarArena::Counters arenaCounters;
+		RarArena::GetTotalCounters(arenaCounters);
+		if(arenaCounters.allocations > 0) {
+			str += L"\n\n";
+			str += RarArena::FormatCounters(arenaCounters);
+		}
+
+		if(RarHeap::IsCounting()) {
+			RarHeap::Counters heapCounters;
+			RarHeap::GetCounters(heapCounters);
+			str += L"\n\n";
+			str += RarHeap::FormatCounters(heapCounters);
+		}
+
+		::MessageBox(NULL, str, L"Statistics", MB_ICONINFORMATION);
+	}
+
 	_Module.Term();
 	::CoUninitialize();
 
@@ -95,24 +382,63 @@ namespace
 	int Help(HINSTANCE hInstance, const WCHAR* archive)
 	{
 		const WCHAR* usageText =
-			L"Usage:\nrar_unlocker.exe archive.rar [--unlock | --lock]";
+			L"Usage:\nrar_unlocker.exe archive.rar [--unlock | --lock] [--output path] [--stats]\n"
+			L"rar_unlocker.exe archive.rar... [--unlock | --lock] [--journal path] [--fast-reject] [--cache-polite]\n"
+			L"\t[--extent-order | --adaptive] [--stats]\n"
+			L"rar_unlocker.exe [archive.rar...] --manifest path [--unlock | --lock] [--shard i/n]\n"
+			L"\t[--checkpoint path] [--report path] [--journal path] [--fast-reject] [--cache-polite]\n"
+			L"\t[--extent-order | --adaptive] [--stats]\n"
+			L"rar_unlocker.exe archive.rar --list [--output path]\n"
+			L"rar_unlocker.exe archive.rar... [--manifest path] --stats-report path [--fast-reject] [--extent-order]\n"
+			L"rar_unlocker.exe archive.rar... [--manifest path] --content-hash path [--cache-polite] [--extent-order]\n"
+			L"rar_unlocker.exe --tar path [--unlock | --lock] [--output path] [--report path]\n"
+			L"rar_unlocker.exe --rollback path\n"
+			L"rar_unlocker.exe --merge path report...\n"
+			L"rar_unlocker.exe archive.rar... [--manifest path] --index-build path [--fast-reject] [--cache-polite]\n"
+			L"\t[--extent-order]\n"
+			L"rar_unlocker.exe --index-query path --where conditions [--output path]\n"
+			L"rar_unlocker.exe archive.rar... [--manifest path] --name-index-build path [--extent-order]\n"
+			L"rar_unlocker.exe --name-index-query path --name text [--output path]\n"
+			L"rar_unlocker.exe --server [--pipe name]\n\n"
+			L"--output\tWrite the result to a new file, the archive is not modified\n"
+			L"--journal\tRecord the changes to a journal before applying them\n"
+			L"--rollback\tRestore the archives recorded in a journal\n"
+			L"--tar\tFind the RAR archives in a tar stream and write the stream to --output, - for the standard streams\n"
+			L"--list\tList the files of a RAR archive\n"
+			L"--stats-report\tWrite content statistics of RAR archives, read from the headers\n"
+			L"--content-hash\tWrite a hash of each RAR archive which is the same whether it's locked or not\n"
+			L"--manifest\tRead the archive paths from a file, one per line\n"
+			L"--shard\tProcess only shard i of n, e.g. 0/4\n"
+			L"--checkpoint\tSkip the archives recorded in a checkpoint, and record new ones\n"
+			L"--report\tAppend the result of each archive to a report\n"
+			L"--merge\tMerge reports into a single report, sorted by path\n"
+			L"--index-build\tWrite an index of the archive attributes\n"
+			L"--index-query\tList the archives of an index which match the --where conditions\n"
+			L"--name-index-build\tWrite or update an index of the file names in the archives\n"
+			L"--name-index-query\tFind the archives of a name index which hold a file whose name contains --name\n"
+			L"--server\tServe status and lock requests over a named pipe\n"
+			L"--fast-reject\tSkip the files which can't be archives after reading their first bytes\n"
+			L"--cache-polite\tRead the archives without the file cache when they're only inspected\n"
+			L"--extent-order\tRead the archives in their order on disk, one at a time per rotating disk\n"
+			L"--adaptive\tProcess a batch on several threads, adapting the archives in flight on each disk\n"
+			L"--stats\tShow the time spent in each processing stage and the heap allocations";
 
 		::MessageBox(NULL, usageText, L"Usage", MB_ICONINFORMATION);
 
 		return 0;
 	}
 
-	int SetLock(HINSTANCE hInstance, const WCHAR* archive, bool lock)
+	int SetLock(HINSTANCE hInstance, const WCHAR* archive, bool lock, const WCHAR* output)
 	{
-		RarFile file;
-		RarFile::error err = file.Open(archive, true);
+		RarSession session;
+		RarFile::error err = session.Load(archive);
 		switch(err) {
 		case RarFile::error::success:
 			// Very good, continue.
 			break;
 
 		case RarFile::error::open_failed:
-			::MessageBox(NULL, L"Could not open file for writing", L"Error", MB_ICONHAND);
+			::MessageBox(NULL, L"Could not open file", L"Error", MB_ICONHAND);
 			return 1;
 
 		case RarFile::error::invalid_file:
@@ -125,7 +451,7 @@ namespace
 		}
 
 		DWORD flags;
-		err = file.GetFlags(flags);
+		err = session.GetFlags(flags);
 		switch(err) {
 		case RarFile::error::success:
 			// OK.
@@ -144,10 +470,10 @@ namespace
 			return 1;
 		}
 
-		if(lock) {
-			err = file.SetLocked(true);
+		if(output) {
+			err = session.SaveLocked(output, lock);
 		} else {
-			err = file.SetLocked(false);
+			err = session.SetLocked(lock);
 		}
 
 		switch(err) {
@@ -155,6 +481,18 @@ namespace
 			// OK.
 			break;
 
+		case RarFile::error::open_failed:
+			::MessageBox(NULL, L"Could not open file for writing", L"Error", MB_ICONHAND);
+			return 1;
+
+		case RarFile::error::file_changed:
+			::MessageBox(NULL, L"The file was modified while it was being processed", L"Error", MB_ICONHAND);
+			return 1;
+
+		case RarFile::error::write_failed:
+			::MessageBox(NULL, L"Could not write to file", L"Error", MB_ICONHAND);
+			return 1;
+
 		case RarFile::error::encrypted_archive:
 			::MessageBox(NULL, L"The file has encrypted headers, cannot modify", L"Error", MB_ICONHAND);
 			return 1;
@@ -168,6 +506,654 @@ namespace
 			return 1;
 		}
 
+		bool modified = ((flags & RarFile::locked) != 0) != lock;
+		if(modified && (flags & RarFile::recovery_record)) {
+			::MessageBox(NULL, L"The archive has a recovery record, which was not updated. "
+				L"Repairing the archive may report the main header as damaged.",
+				L"Warning", MB_ICONWARNING);
+		}
+
+		return 0;
+	}
+
+	int Batch(HINSTANCE hInstance, std::vector<CString> archives, Action action, const BatchOptions& options)
+	{
+		RarCheckpoint checkpointFile;
+		size_t skipped = 0;
+		if(options.checkpoint) {
+			if(!checkpointFile.Open(options.checkpoint)) {
+				::MessageBox(NULL, L"Could not open the checkpoint file", L"Error", MB_ICONHAND);
+				return 1;
+			}
+
+			auto it = std::remove_if(archives.begin(), archives.end(), [&](const CString& archive) {
+				return checkpointFile.Contains(archive);
+			});
+
+			skipped = archives.end() - it;
+			archives.erase(it, archives.end());
+		}
+
+		RarReport reportFile;
+		if(options.report && !reportFile.Open(options.report)) {
+			::MessageBox(NULL, L"Could not open the report file", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		RarJournal journalFile;
+		if(options.journal && !journalFile.Create(options.journal)) {
+			::MessageBox(NULL, L"Could not create the journal file", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		RarBatch batch;
+		if(options.journal) {
+			batch.SetJournal(&journalFile);
+		}
+
+		batch.SetFastReject(options.fastReject);
+
+		// The report is committed before the checkpoint, so that an archive
+		// is never marked as done without being reported.
+		bool outputFailed = false;
+		if(options.report || options.checkpoint) {
+			batch.SetGroupCallback([&](const RarBatch::Result* results, size_t count) {
+				if(outputFailed) {
+					return;
+				}
+
+				if(options.report) {
+					for(size_t i = 0; i < count; i++) {
+						reportFile.Append(results[i]);
+					}
+
+					if(!reportFile.Commit()) {
+						outputFailed = true;
+						return;
+					}
+				}
+
+				// Only final results are recorded. Archives which couldn't be
+				// opened or written, or which changed while they were read,
+				// are tried again when the run is resumed.
+				if(options.checkpoint) {
+					for(size_t i = 0; i < count; i++) {
+						RarFile::error err = results[i].error;
+						if(err == RarFile::error::success ||
+							err == RarFile::error::invalid_file ||
+							err == RarFile::error::encrypted_archive) {
+							checkpointFile.Append(results[i].fileName);
+						}
+					}
+
+					if(!checkpointFile.Commit()) {
+						outputFailed = true;
+					}
+				}
+			});
+		}
+
+		std::vector<RarBatch::Result> results;
+		if(options.adaptive) {
+			std::vector<RarScheduler::Device> devices;
+			RarScheduler::Plan(archives, devices);
+
+			unsigned int maxThreadCount = std::min(maxAdaptiveThreads,
+				std::max(1u, std::thread::hardware_concurrency()) * adaptiveThreadsPerProcessor);
+
+			if(action == Action::DEFAULT) {
+				batch.GetStatusAdaptive(archives, devices, maxThreadCount, results);
+			} else {
+				batch.SetLockedAdaptive(archives, action == Action::LOCK, devices, maxThreadCount, results);
+			}
+		} else if(action == Action::DEFAULT) {
+			batch.GetStatus(archives, results);
+		} else {
+			batch.SetLocked(archives, action == Action::LOCK, results);
+		}
+
+		journalFile.Close();
+		reportFile.Close();
+		checkpointFile.Close();
+
+		if(outputFailed) {
+			::MessageBox(NULL, L"Could not write to the report or the checkpoint file", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		const size_t maxListedErrors = 20;
+		size_t failed = 0;
+		size_t recoveryRecords = 0;
+		CString errorList;
+
+		for(const auto& result : results) {
+			if(result.modified && (result.flags & RarFile::recovery_record)) {
+				recoveryRecords++;
+			}
+
+			if(result.error == RarFile::error::success) {
+				continue;
+			}
+
+			failed++;
+			if(failed <= maxListedErrors) {
+				errorList += result.fileName;
+				errorList += L": ";
+				errorList += GetErrorMessage(result.error);
+				errorList += L"\n";
+			}
+		}
+
+		CString str;
+		str.Format(L"Processed archives: %Iu\n"
+			L"Archives skipped by the checkpoint: %Iu\n"
+			L"Archives with errors: %Iu",
+			results.size(), skipped, failed);
+
+		if(options.fastReject) {
+			RarClassifier::Counters counters;
+			RarClassifier::GetCounters(counters);
+
+			CString fastRejectStr;
+			fastRejectStr.Format(L"\nFiles rejected without a full scan: %I64u",
+				counters.rejectedByPrefix + counters.rejectedByOverlay);
+			str += fastRejectStr;
+		}
+
+		if(recoveryRecords > 0) {
+			CString recoveryRecordsStr;
+			recoveryRecordsStr.Format(L"\nModified archives with a recovery record which was not updated: %Iu",
+				recoveryRecords);
+			str += recoveryRecordsStr;
+		}
+
+		if(failed > 0) {
+			str += L"\n\n";
+			str += errorList;
+			if(failed > maxListedErrors) {
+				str += L"...";
+			}
+		}
+
+		::MessageBox(NULL, str, L"Batch", (failed > 0 || recoveryRecords > 0) ? MB_ICONWARNING : MB_ICONINFORMATION);
+
+		return failed > 0 ? 1 : 0;
+	}
+
+	int Rollback(HINSTANCE hInstance, const WCHAR* journal)
+	{
+		RarJournal::RollbackStats stats;
+		if(!RarJournal::Rollback(journal, stats)) {
+			::MessageBox(NULL, L"Could not read the journal file", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		CString str;
+		str.Format(L"Restored archives: %Iu\n"
+			L"Archives which were not modified: %Iu\n"
+			L"Archives which could not be restored: %Iu",
+			stats.restored, stats.notApplied, stats.failed);
+
+		::MessageBox(NULL, str, L"Rollback", stats.failed > 0 ? MB_ICONWARNING : MB_ICONINFORMATION);
+
+		return stats.failed > 0 ? 1 : 0;
+	}
+
+	int Server(HINSTANCE hInstance, const WCHAR* pipeName)
+	{
+		RarServer server;
+		if(!server.Run(pipeName)) {
+			::MessageBox(NULL, L"Could not create the named pipe", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	int Merge(HINSTANCE hInstance, const std::vector<CString>& reports, const WCHAR* output)
+	{
+		if(!RarReport::Merge(reports, output)) {
+			::MessageBox(NULL, L"Could not merge the report files", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	int BuildIndex(HINSTANCE hInstance, const std::vector<CString>& archives, const WCHAR* index, bool fastReject)
+	{
+		RarIndex::BuildStats stats;
+		if(!RarIndex::Build(archives, index, stats, fastReject)) {
+			::MessageBox(NULL, L"Could not write the index file", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		CString str;
+		str.Format(L"Archives: %Iu\n"
+			L"Valid: %Iu\n"
+			L"Not archives: %Iu\n"
+			L"Failed: %Iu",
+			archives.size(), stats.validArchives, stats.invalidFiles, stats.failedArchives);
+
+		::MessageBox(NULL, str, L"Index", stats.failedArchives > 0 ? MB_ICONWARNING : MB_ICONINFORMATION);
+
+		return stats.failedArchives > 0 ? 1 : 0;
+	}
+
+	int QueryIndex(HINSTANCE hInstance, const WCHAR* index, const WCHAR* where, const WCHAR* output)
+	{
+		RarIndex::Query query;
+		if(!RarIndex::ParseQuery(where, query)) {
+			CString str;
+			str.Format(L"Invalid query:\n%s", where);
+			::MessageBox(NULL, str, L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		RarIndex indexFile;
+		if(!indexFile.Open(index)) {
+			::MessageBox(NULL, L"Could not read the index file", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		LARGE_INTEGER frequency, start, end;
+		::QueryPerformanceFrequency(&frequency);
+		::QueryPerformanceCounter(&start);
+
+		std::vector<size_t> rows;
+		indexFile.Select(query, rows);
+
+		::QueryPerformanceCounter(&end);
+		double milliseconds = (end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+
+		// The matching paths are written in the manifest format, so that
+		// they can be passed to --manifest.
+		if(output) {
+			std::vector<CString> fileNames;
+			fileNames.reserve(rows.size());
+			for(size_t row : rows) {
+				fileNames.push_back(indexFile.GetFileName(row));
+			}
+
+			if(!RarManifest::Save(output, fileNames)) {
+				::MessageBox(NULL, L"Could not write the output file", L"Error", MB_ICONHAND);
+				return 1;
+			}
+
+			return 0;
+		}
+
+		const size_t maxListedRows = 20;
+
+		CString str;
+		str.Format(L"%Iu of %Iu archives match (%.2f ms)", rows.size(),
+			indexFile.GetRowCount(), milliseconds);
+
+		if(!rows.empty()) {
+			str += L"\n";
+			for(size_t i = 0; i < rows.size() && i < maxListedRows; i++) {
+				str += L"\n";
+				str += indexFile.GetFileName(rows[i]);
+			}
+
+			if(rows.size() > maxListedRows) {
+				str += L"\n...";
+			}
+		}
+
+		::MessageBox(NULL, str, L"Query", MB_ICONINFORMATION);
+
+		return 0;
+	}
+
+	int UpdateNameIndex(HINSTANCE hInstance, const std::vector<CString>& archives, const WCHAR* index)
+	{
+		RarNameIndex::UpdateStats stats;
+		if(!RarNameIndex::Update(archives, index, stats)) {
+			::MessageBox(NULL, L"Could not write the index file", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		CString str;
+		str.Format(L"Archives: %Iu\n"
+			L"Unchanged: %Iu\n"
+			L"Listed: %Iu\n"
+			L"Failed: %Iu",
+			archives.size(), stats.reusedArchives, stats.listedArchives, stats.failedArchives);
+
+		::MessageBox(NULL, str, L"Name index", stats.failedArchives > 0 ? MB_ICONWARNING : MB_ICONINFORMATION);
+
+		return stats.failedArchives > 0 ? 1 : 0;
+	}
+
+	int QueryNameIndex(HINSTANCE hInstance, const WCHAR* index, const WCHAR* name, const WCHAR* output)
+	{
+		RarNameIndex indexFile;
+		if(!indexFile.Open(index)) {
+			::MessageBox(NULL, L"Could not read the index file", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		LARGE_INTEGER frequency, start, end;
+		::QueryPerformanceFrequency(&frequency);
+		::QueryPerformanceCounter(&start);
+
+		std::vector<size_t> entries;
+		indexFile.Find(name, entries);
+
+		::QueryPerformanceCounter(&end);
+		double milliseconds = (end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+
+		// The entries are in archive order, each archive is listed once.
+		std::vector<size_t> archiveRows;
+		for(size_t entry : entries) {
+			size_t archiveRow = indexFile.GetEntryArchive(entry);
+			if(archiveRows.empty() || archiveRows.back() != archiveRow) {
+				archiveRows.push_back(archiveRow);
+			}
+		}
+
+		// The archive paths are written in the manifest format, so that
+		// they can be passed to --manifest.
+		if(output) {
+			std::vector<CString> fileNames;
+			fileNames.reserve(archiveRows.size());
+			for(size_t archiveRow : archiveRows) {
+				fileNames.push_back(indexFile.GetArchiveFileName(archiveRow));
+			}
+
+			if(!RarManifest::Save(output, fileNames)) {
+				::MessageBox(NULL, L"Could not write the output file", L"Error", MB_ICONHAND);
+				return 1;
+			}
+
+			return 0;
+		}
+
+		const size_t maxListedEntries = 20;
+
+		CString str;
+		str.Format(L"%Iu of %Iu files in %Iu of %Iu archives match (%.2f ms)", entries.size(),
+			indexFile.GetEntryCount(), archiveRows.size(), indexFile.GetArchiveCount(), milliseconds);
+
+		if(!entries.empty()) {
+			str += L"\n";
+			for(size_t i = 0; i < entries.size() && i < maxListedEntries; i++) {
+				str += L"\n";
+				str += indexFile.GetArchiveFileName(indexFile.GetEntryArchive(entries[i]));
+				str += L": ";
+				str += indexFile.GetEntryName(entries[i]);
+			}
+
+			if(entries.size() > maxListedEntries) {
+				str += L"\n...";
+			}
+		}
+
+		::MessageBox(NULL, str, L"Query", MB_ICONINFORMATION);
+
+		return 0;
+	}
+
+	int List(HINSTANCE hInstance, const WCHAR* archive, const WCHAR* output)
+	{
+		std::vector<RarListing::Entry> entries;
+		RarListing::Stats stats;
+		RarFile::error err = RarListing::List(archive, entries, stats);
+		if(err == RarFile::error::invalid_file) {
+			::MessageBox(NULL, L"The file is not a valid RAR archive", L"Error", MB_ICONHAND);
+			return 1;
+		} else if(err != RarFile::error::success) {
+			::MessageBox(NULL, GetErrorMessage(err), L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		if(output) {
+			std::vector<CString> fileNames;
+			fileNames.reserve(entries.size());
+			for(const auto& entry : entries) {
+				fileNames.push_back(entry.fileName);
+			}
+
+			if(!RarManifest::Save(output, fileNames)) {
+				::MessageBox(NULL, L"Could not write the output file", L"Error", MB_ICONHAND);
+				return 1;
+			}
+
+			return 0;
+		}
+
+		const size_t maxListedEntries = 20;
+
+		CString str;
+		str.Format(L"Entries: %Iu\n"
+			L"Headers read from the quick open record: %Iu\n"
+			L"Headers read from the archive: %Iu\n",
+			entries.size(), stats.cachedHeaders, stats.readHeaders);
+
+		for(size_t i = 0; i < entries.size() && i < maxListedEntries; i++) {
+			CString line;
+			if(entries[i].directory) {
+				line.Format(L"\n%s\\", entries[i].fileName.GetString());
+			} else {
+				line.Format(L"\n%s (%I64u bytes)", entries[i].fileName.GetString(), entries[i].size);
+			}
+
+			str += line;
+		}
+
+		if(entries.size() > maxListedEntries) {
+			str += L"\n...";
+		}
+
+		::MessageBox(NULL, str, L"List", MB_ICONINFORMATION);
+
 		return 0;
 	}
+
+	int StatsReport(HINSTANCE hInstance, const std::vector<CString>& archives, const WCHAR* report,
+		bool fastReject, bool extentOrder)
+	{
+		std::vector<RarStatsReport::ArchiveStats> archiveStats;
+		RarStatsReport::Totals totals;
+		RarStatsReport::Collect(archives, std::thread::hardware_concurrency(), fastReject, extentOrder,
+			archiveStats, totals);
+
+		if(!RarStatsReport::Write(report, archiveStats, totals)) {
+			::MessageBox(NULL, L"Could not write the report file", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		::MessageBox(NULL, RarStatsReport::FormatTotals(totals), L"Statistics report",
+			totals.failedArchives > 0 ? MB_ICONWARNING : MB_ICONINFORMATION);
+
+		return totals.failedArchives > 0 ? 1 : 0;
+	}
+
+	int ContentHash(HINSTANCE hInstance, const std::vector<CString>& archives, const WCHAR* hashes,
+		bool extentOrder)
+	{
+		std::vector<RarContentHash::Result> results;
+		RarContentHash::ComputeAll(archives, std::thread::hardware_concurrency(), extentOrder, results);
+
+		if(!RarContentHash::Write(hashes, results)) {
+			::MessageBox(NULL, L"Could not write the hash file", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		// Archives with the same hash and size are counted as one.
+		std::vector<std::pair<ULONGLONG, ULONGLONG>> digests;
+		size_t failedArchives = 0;
+		for(const auto& result : results) {
+			if(result.error == RarFile::error::success) {
+				digests.emplace_back(result.hash, result.size);
+			} else {
+				failedArchives++;
+			}
+		}
+
+		std::sort(digests.begin(), digests.end());
+		size_t distinctArchives = std::unique(digests.begin(), digests.end()) - digests.begin();
+
+		CString str;
+		str.Format(L"Archives: %Iu\n"
+			L"Distinct contents: %Iu\n"
+			L"Failed: %Iu",
+			results.size(), distinctArchives, failedArchives);
+
+		::MessageBox(NULL, str, L"Content hash", failedArchives > 0 ? MB_ICONWARNING : MB_ICONINFORMATION);
+
+		return failedArchives > 0 ? 1 : 0;
+	}
+
+	int Tar(HINSTANCE hInstance, const WCHAR* tar, Action tarAction, const WCHAR* output, const WCHAR* report)
+	{
+		if(tarAction != Action::DEFAULT && !output) {
+			::MessageBox(NULL, L"Locking or unlocking the archives of a tar stream requires --output", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		// "-" stands for the standard input and output, which aren't closed.
+		CAtlFile inputFile;
+		HANDLE inputHandle;
+		if(wcscmp(tar, L"-") == 0) {
+			inputHandle = ::GetStdHandle(STD_INPUT_HANDLE);
+		} else {
+			HRESULT hr = inputFile.Create(tar, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING,
+				FILE_FLAG_SEQUENTIAL_SCAN);
+			if(FAILED(hr)) {
+				::MessageBox(NULL, L"Could not open the tar file", L"Error", MB_ICONHAND);
+				return 1;
+			}
+
+			inputHandle = inputFile;
+		}
+
+		CAtlFile outputFile;
+		HANDLE outputHandle = NULL;
+		if(output && wcscmp(output, L"-") == 0) {
+			outputHandle = ::GetStdHandle(STD_OUTPUT_HANDLE);
+		} else if(output) {
+			HRESULT hr = outputFile.Create(output, GENERIC_WRITE, 0, CREATE_ALWAYS);
+			if(FAILED(hr)) {
+				::MessageBox(NULL, L"Could not create the output file", L"Error", MB_ICONHAND);
+				return 1;
+			}
+
+			outputHandle = outputFile;
+		}
+
+		RarReport reportFile;
+		if(report && !reportFile.Open(report)) {
+			::MessageBox(NULL, L"Could not open the report file", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		RarTarStream stream;
+		std::vector<RarBatch::Result> results;
+		RarTarStream::error err;
+		if(tarAction == Action::DEFAULT) {
+			err = stream.GetStatus(inputHandle, outputHandle, results);
+		} else {
+			err = stream.SetLocked(inputHandle, outputHandle, tarAction == Action::LOCK, results);
+		}
+
+		// The archives found before an error are reported too.
+		if(report) {
+			for(const auto& result : results) {
+				reportFile.Append(result);
+			}
+
+			bool reportFailed = !reportFile.Commit();
+			reportFile.Close();
+
+			if(reportFailed) {
+				::MessageBox(NULL, L"Could not write to the report file", L"Error", MB_ICONHAND);
+				return 1;
+			}
+		}
+
+		switch(err) {
+		case RarTarStream::error::success:
+			break;
+
+		case RarTarStream::error::read_failed:
+			::MessageBox(NULL, L"Could not read the tar stream", L"Error", MB_ICONHAND);
+			return 1;
+
+		case RarTarStream::error::write_failed:
+			::MessageBox(NULL, L"Could not write the output stream", L"Error", MB_ICONHAND);
+			return 1;
+
+		case RarTarStream::error::invalid_stream:
+			::MessageBox(NULL, L"The input is not a valid tar stream", L"Error", MB_ICONHAND);
+			return 1;
+		}
+
+		size_t locked = 0;
+		size_t modified = 0;
+		size_t failed = 0;
+		size_t recoveryRecords = 0;
+
+		for(const auto& result : results) {
+			if(result.error != RarFile::error::success) {
+				failed++;
+				continue;
+			}
+
+			if(result.flags & RarFile::locked) {
+				locked++;
+			}
+
+			if(result.modified) {
+				modified++;
+				if(result.flags & RarFile::recovery_record) {
+					recoveryRecords++;
+				}
+			}
+		}
+
+		CString str;
+		str.Format(L"Archives in the stream: %Iu\n"
+			L"Locked archives: %Iu\n"
+			L"Modified archives: %Iu\n"
+			L"Archives with errors: %Iu",
+			results.size(), locked, modified, failed);
+
+		if(recoveryRecords > 0) {
+			CString recoveryRecordsStr;
+			recoveryRecordsStr.Format(L"\nModified archives with a recovery record which was not updated: %Iu",
+				recoveryRecords);
+			str += recoveryRecordsStr;
+		}
+
+		::MessageBox(NULL, str, L"Tar stream", failed > 0 ? MB_ICONWARNING : MB_ICONINFORMATION);
+
+		return failed > 0 ? 1 : 0;
+	}
+
+	const WCHAR* GetErrorMessage(RarFile::error err)
+	{
+		switch(err) {
+		case RarFile::error::success:
+			return L"Success";
+
+		case RarFile::error::open_failed:
+			return L"Could not open file";
+
+		case RarFile::error::invalid_file:
+			return L"The file is not a valid RAR archive";
+
+		case RarFile::error::encrypted_archive:
+			return L"The file has encrypted headers, cannot modify";
+
+		case RarFile::error::file_changed:
+			return L"The file was modified while it was being processed";
+
+		case RarFile::error::write_failed:
+			return L"Could not write to file";
+		}
+
+		return L"An unknown error occurred";
+	}
 }
@@ -0,0 +1,88 @@
+#include "stdafx.h"
+#include "RarArena.h"
+
+std::atomic<ULONGLONG> RarArena::m_totalAllocations;
+std::atomic<ULONGLONG> RarArena::m_totalBytes;
+std::atomic<ULONGLONG> RarArena::m_totalHeapAllocations;
+std::atomic<ULONGLONG> RarArena::m_totalResets;
+
+RarArena::~RarArena()
+{
+	AddToTotals();
+}
+
+void* RarArena::Allocate(size_t size, size_t alignment /*= sizeof(void*)*/)
+{
+	assert(alignment != 0 && (alignment & (alignment - 1)) == 0);
+
+	m_counters.allocations++;
+	m_counters.bytes += size;
+
+	// Use the first block, starting from the current one, with enough room.
+	// Blocks are allocated with new[], which aligns them for any type.
+	while(m_currentBlock < m_blocks.size()) {
+		size_t offset = (m_currentOffset + alignment - 1) & ~(alignment - 1);
+		if(offset <= m_blocks[m_currentBlock].size &&
+			size <= m_blocks[m_currentBlock].size - offset) {
+			m_currentOffset = offset + size;
+			return m_blocks[m_currentBlock].data.get() + offset;
+		}
+
+		m_currentBlock++;
+		m_currentOffset = 0;
+	}
+
+	Block block;
+	block.size = size > m_blockSize ? size : m_blockSize;
+	block.data.reset(new BYTE[block.size]);
+	m_blocks.push_back(std::move(block));
+	m_counters.heapAllocations++;
+
+	m_currentBlock = m_blocks.size() - 1;
+	m_currentOffset = size;
+	return m_blocks[m_currentBlock].data.get();
+}
+
+void RarArena::Reset()
+{
+	m_currentBlock = 0;
+	m_currentOffset = 0;
+	m_counters.resets++;
+
+	AddToTotals();
+}
+
+const RarArena::Counters& RarArena::GetCounters() const
+{
+	return m_counters;
+}
+
+void RarArena::GetTotalCounters(Counters& counters)
+{
+	counters.allocations = m_totalAllocations;
+	counters.bytes = m_totalBytes;
+	counters.heapAllocations = m_totalHeapAllocations;
+	counters.resets = m_totalResets;
+}
+
+CString RarArena::FormatCounters(const Counters& counters)
+{
+	CString str;
+	str.Format(L"Arena allocations: %I64u (%I64u bytes)\n"
+		L"Arena blocks taken from the heap: %I64u\n"
+		L"Arena resets: %I64u",
+		counters.allocations, counters.bytes, counters.heapAllocations, counters.resets);
+	return str;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+void RarArena::AddToTotals()
+{
+	m_totalAllocations += m_counters.allocations - m_reportedCounters.allocations;
+	m_totalBytes += m_counters.bytes - m_reportedCounters.bytes;
+	m_totalHeapAllocations += m_counters.heapAllocations - m_reportedCounters.heapAllocations;
+	m_totalResets += m_counters.resets - m_reportedCounters.resets;
+	m_reportedCounters = m_counters;
+}
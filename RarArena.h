@@ -0,0 +1,59 @@
+#pragma once
+
+// Bump allocator for short-lived data which is released all at once, e.g.
+// the path buffers of a batch group. Memory is taken from the heap in
+// blocks, which are kept on Reset and reused, so that once the blocks are
+// large enough for a group, the following groups don't touch the heap.
+// Not thread safe, each worker thread uses its own arena.
+class RarArena {
+public:
+	struct Counters {
+		ULONGLONG allocations;
+		ULONGLONG bytes;
+		ULONGLONG heapAllocations; // blocks taken from the heap
+		ULONGLONG resets;
+	};
+
+	RarArena() = default;
+	~RarArena();
+
+	RarArena(const RarArena&) = delete;
+	RarArena& operator=(const RarArena&) = delete;
+
+	void* Allocate(size_t size, size_t alignment = sizeof(void*));
+
+	template<typename T>
+	T* AllocateArray(size_t count)
+	{
+		return static_cast<T*>(Allocate(count * sizeof(T), alignof(T)));
+	}
+
+	// Releases all the allocations, the blocks are kept.
+	void Reset();
+	const Counters& GetCounters() const;
+
+	// The counters of all the arenas, updated on Reset and on destruction.
+	static void GetTotalCounters(Counters& counters);
+	static CString FormatCounters(const Counters& counters);
+
+private:
+	struct Block {
+		std::unique_ptr<BYTE[]> data;
+		size_t size;
+	};
+
+	void AddToTotals();
+
+	std::vector<Block> m_blocks;
+	size_t m_currentBlock = 0;
+	size_t m_currentOffset = 0;
+	Counters m_counters = {};
+	Counters m_reportedCounters = {};
+
+	static const size_t m_blockSize = 0x10000;
+
+	static std::atomic<ULONGLONG> m_totalAllocations;
+	static std::atomic<ULONGLONG> m_totalBytes;
+	static std::atomic<ULONGLONG> m_totalHeapAllocations;
+	static std::atomic<ULONGLONG> m_totalResets;
+};
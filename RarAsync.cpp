@@ -0,0 +1,102 @@
+#include "stdafx.h"
+#include "RarAsync.h"
+
+RarAsync::RarAsync(Executor executor, size_t maxConcurrency /*= m_defaultMaxConcurrency*/)
+	: m_executor(std::move(executor)), m_maxConcurrency(std::max<size_t>(maxConcurrency, 1))
+{
+}
+
+RarAsync::~RarAsync()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_stopping = true;
+	m_queue.clear();
+	m_idle.wait(lock, [this] { return m_running == 0; });
+}
+
+void RarAsync::LoadAsync(const TCHAR* fileName, LoadCallback callback)
+{
+	CString fileNameCopy = fileName;
+
+	Submit([this, fileNameCopy, callback]() {
+		auto session = std::make_shared<RarSession>();
+		RarFile::error err = session->Load(fileNameCopy);
+		if(err != RarFile::error::success) {
+			session.reset();
+		}
+
+		Complete([callback, err, session]() {
+			callback(err, session);
+		});
+	});
+}
+
+void RarAsync::SetLockedAsync(std::shared_ptr<RarSession> session, bool locked, SetLockedCallback callback)
+{
+	Submit([this, session, locked, callback]() {
+		RarFile::error err = session->SetLocked(locked);
+
+		Complete([callback, err]() {
+			callback(err);
+		});
+	});
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+void RarAsync::Submit(std::function<void()> operation)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_queue.push_back(std::move(operation));
+		if(m_running >= m_maxConcurrency) {
+			return; // picked up by a running work item
+		}
+
+		m_running++;
+	}
+
+	if(!::QueueUserWorkItem(WorkItemProc, this, WT_EXECUTEDEFAULT)) {
+		// No work item, run the queue on the calling thread.
+		RunQueue();
+	}
+}
+
+void RarAsync::Complete(std::function<void()> completion)
+{
+	if(m_executor) {
+		m_executor(std::move(completion));
+	} else {
+		completion();
+	}
+}
+
+// Runs queued operations until the queue is empty, each work item takes
+// one of the m_maxConcurrency slots.
+void RarAsync::RunQueue()
+{
+	for(;;) {
+		std::function<void()> operation;
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if(m_queue.empty()) {
+				m_running--;
+				m_idle.notify_all();
+				return;
+			}
+
+			operation = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		operation();
+	}
+}
+
+DWORD WINAPI RarAsync::WorkItemProc(LPVOID parameter)
+{
+	static_cast<RarAsync*>(parameter)->RunQueue();
+	return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "RarSession.h"
+
+// Runs archive operations on the system thread pool, so that the caller,
+// e.g. an event loop or a dialog, isn't blocked by a slow disk. At most
+// maxConcurrency operations run at once, the rest wait in a queue, so that
+// many archives can be checked without a thread per archive. Operations
+// use RarSession, the same code as the synchronous path.
+//
+// Completion callbacks are passed to the executor, which is expected to
+// run them on the caller's thread, e.g. by posting a message to a window.
+// Without an executor, they run on a thread pool thread.
+//
+// A session must not be used by more than one operation at a time.
+class RarAsync {
+public:
+	typedef std::function<void(std::function<void()> completion)> Executor;
+	// The session is null if the archive couldn't be loaded.
+	typedef std::function<void(RarFile::error err, std::shared_ptr<RarSession> session)> LoadCallback;
+	typedef std::function<void(RarFile::error err)> SetLockedCallback;
+
+	explicit RarAsync(Executor executor, size_t maxConcurrency = m_defaultMaxConcurrency);
+	// Queued operations are dropped without a completion, and running ones
+	// are waited for.
+	~RarAsync();
+
+	RarAsync(const RarAsync&) = delete;
+	RarAsync& operator=(const RarAsync&) = delete;
+
+	void LoadAsync(const TCHAR* fileName, LoadCallback callback);
+	void SetLockedAsync(std::shared_ptr<RarSession> session, bool locked, SetLockedCallback callback);
+
+private:
+	void Submit(std::function<void()> operation);
+	void Complete(std::function<void()> completion);
+	void RunQueue();
+
+	static DWORD WINAPI WorkItemProc(LPVOID parameter);
+
+	Executor m_executor;
+	size_t m_maxConcurrency;
+
+	std::mutex m_mutex;
+	std::condition_variable m_idle;
+	std::list<std::function<void()>> m_queue;
+	size_t m_running = 0;
+	bool m_stopping = false;
+
+	static const size_t m_defaultMaxConcurrency = 16;
+};
@@ -0,0 +1,261 @@
+#include "stdafx.h"
+#include "RarBatch.h"
+#include "RarClassifier.h"
+#include "RarHeap.h"
+#include "RarJournal.h"
+#include "RarSession.h"
+
+void RarBatch::SetJournal(RarJournal* journal)
+{
+	m_journal = journal;
+}
+
+void RarBatch::SetGroupCallback(GroupCallback callback)
+{
+	m_groupCallback = std::move(callback);
+}
+
+void RarBatch::SetFastReject(bool fastReject)
+{
+	m_fastReject = fastReject;
+}
+
+const RarArena::Counters& RarBatch::GetArenaCounters() const
+{
+	return m_arena.GetCounters();
+}
+
+void RarBatch::GetStatus(const std::vector<CString>& fileNames,
+	std::vector<Result>& results)
+{
+	results.resize(fileNames.size());
+
+	RarSession session;
+
+	for(size_t groupStart = 0; groupStart < fileNames.size(); groupStart += m_groupSize) {
+		size_t groupEnd = std::min(groupStart + m_groupSize, fileNames.size());
+		ULONGLONG heapAllocations = RarHeap::GetThreadAllocations();
+
+		for(size_t i = groupStart; i < groupEnd; i++) {
+			Result& result = results[i];
+			result.fileName = fileNames[i];
+			result.rarVersion = 0;
+			result.flags = 0;
+			result.modified = false;
+
+			result.error = LoadArchive(session, fileNames[i]);
+			if(result.error == RarFile::error::success) {
+				result.rarVersion = session.GetRarVersion();
+				result.error = session.GetFlags(result.flags);
+			}
+		}
+
+		if(m_groupCallback) {
+			m_groupCallback(&results[groupStart], groupEnd - groupStart);
+		}
+
+		if(RarHeap::IsCounting()) {
+			RarHeap::AddGroup(RarHeap::GetThreadAllocations() - heapAllocations);
+		}
+	}
+}
+
+void RarBatch::SetLocked(const std::vector<CString>& fileNames, bool locked,
+	std::vector<Result>& results)
+{
+	results.resize(fileNames.size());
+
+	size_t groupSize = m_groupSize;
+	std::vector<RarSession> sessions(groupSize);
+	std::vector<RarSession::Patch> patches(groupSize);
+	bool journalFailed = false;
+
+	for(size_t groupStart = 0; groupStart < fileNames.size(); groupStart += groupSize) {
+		size_t groupEnd = std::min(groupStart + groupSize, fileNames.size());
+		ULONGLONG heapAllocations = RarHeap::GetThreadAllocations();
+
+		for(size_t i = groupStart; i < groupEnd; i++) {
+			RarSession& session = sessions[i - groupStart];
+			RarSession::Patch& patch = patches[i - groupStart];
+
+			results[i].fileName = fileNames[i];
+			results[i].rarVersion = 0;
+			results[i].flags = 0;
+			results[i].modified = false;
+
+			if(journalFailed) {
+				results[i].error = RarFile::error::write_failed;
+				patch.patchedData.clear();
+				continue;
+			}
+
+			RarFile::error err = LoadArchive(session, fileNames[i]);
+			if(err == RarFile::error::success) {
+				results[i].rarVersion = session.GetRarVersion();
+				err = session.GetLockPatch(locked, patch);
+			}
+
+			if(err != RarFile::error::success) {
+				patch.patchedData.clear();
+			} else if(m_journal && !patch.patchedData.empty()) {
+				m_journal->Append(GetFullPath(fileNames[i]), patch);
+			}
+
+			results[i].error = err;
+		}
+
+		// The journal records must be on disk before the patches are applied.
+		if(m_journal && !journalFailed && !m_journal->Commit()) {
+			journalFailed = true;
+		}
+
+		for(size_t i = groupStart; i < groupEnd; i++) {
+			RarSession& session = sessions[i - groupStart];
+			const RarSession::Patch& patch = patches[i - groupStart];
+
+			if(results[i].error != RarFile::error::success || patch.patchedData.empty()) {
+				continue;
+			}
+
+			if(journalFailed) {
+				results[i].error = RarFile::error::write_failed;
+				continue;
+			}
+
+			results[i].error = session.ApplyPatch(patch);
+			results[i].modified = results[i].error == RarFile::error::success;
+		}
+
+		for(size_t i = groupStart; i < groupEnd; i++) {
+			if(results[i].error == RarFile::error::success) {
+				sessions[i - groupStart].GetFlags(results[i].flags);
+			}
+		}
+
+		if(m_groupCallback) {
+			m_groupCallback(&results[groupStart], groupEnd - groupStart);
+		}
+
+		m_arena.Reset();
+
+		if(RarHeap::IsCounting()) {
+			RarHeap::AddGroup(RarHeap::GetThreadAllocations() - heapAllocations);
+		}
+	}
+}
+
+void RarBatch::GetStatusAdaptive(const std::vector<CString>& fileNames,
+	const std::vector<RarScheduler::Device>& devices, unsigned int maxThreadCount,
+	std::vector<Result>& results)
+{
+	RunAdaptive(fileNames, devices, maxThreadCount, results,
+		[](RarBatch& batch, const std::vector<CString>& sliceFileNames, std::vector<Result>& sliceResults) {
+		batch.GetStatus(sliceFileNames, sliceResults);
+	});
+}
+
+void RarBatch::SetLockedAdaptive(const std::vector<CString>& fileNames, bool locked,
+	const std::vector<RarScheduler::Device>& devices, unsigned int maxThreadCount,
+	std::vector<Result>& results)
+{
+	RunAdaptive(fileNames, devices, maxThreadCount, results,
+		[locked](RarBatch& batch, const std::vector<CString>& sliceFileNames, std::vector<Result>& sliceResults) {
+		batch.SetLocked(sliceFileNames, locked, sliceResults);
+	});
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+void RarBatch::RunAdaptive(const std::vector<CString>& fileNames,
+	const std::vector<RarScheduler::Device>& devices, unsigned int maxThreadCount,
+	std::vector<Result>& results, const Operation& operation)
+{
+	results.resize(fileNames.size());
+
+	// Each slice holds archives of a single device, in the device's order.
+	std::vector<std::vector<size_t>> slices;
+	std::vector<RarScheduler::Device> sliceDevices;
+	for(const auto& device : devices) {
+		RarScheduler::Device sliceDevice;
+		sliceDevice.seekPenalty = device.seekPenalty;
+		sliceDevice.name = device.name;
+
+		for(size_t i = 0; i < device.items.size(); i += m_sliceSize) {
+			size_t sliceEnd = std::min(i + m_sliceSize, device.items.size());
+			sliceDevice.items.push_back(slices.size());
+			slices.emplace_back(device.items.begin() + i, device.items.begin() + sliceEnd);
+		}
+
+		sliceDevices.push_back(std::move(sliceDevice));
+	}
+
+	std::mutex callbackMutex;
+	GroupCallback callback;
+	if(m_groupCallback) {
+		callback = [this, &callbackMutex](const Result* groupResults, size_t count) {
+			std::lock_guard<std::mutex> lock(callbackMutex);
+			m_groupCallback(groupResults, count);
+		};
+	}
+
+	// A worker is only used by the thread of its index.
+	maxThreadCount = std::max(1u, maxThreadCount);
+	std::vector<std::unique_ptr<RarBatch>> workers(maxThreadCount);
+
+	RarScheduler::RunAdaptive(sliceDevices, maxThreadCount, [&](size_t slice, unsigned int thread) {
+		std::unique_ptr<RarBatch>& worker = workers[thread];
+		if(!worker) {
+			worker.reset(new RarBatch);
+			worker->m_journal = m_journal;
+			worker->m_groupCallback = callback;
+			worker->m_fastReject = m_fastReject;
+		}
+
+		const std::vector<size_t>& items = slices[slice];
+
+		std::vector<CString> sliceFileNames;
+		sliceFileNames.reserve(items.size());
+		for(size_t item : items) {
+			sliceFileNames.push_back(fileNames[item]);
+		}
+
+		std::vector<Result> sliceResults;
+		operation(*worker, sliceFileNames, sliceResults);
+
+		for(size_t i = 0; i < items.size(); i++) {
+			results[items[i]] = std::move(sliceResults[i]);
+		}
+
+		return items.size();
+	});
+}
+
+RarFile::error RarBatch::LoadArchive(RarSession& session, const TCHAR* fileName)
+{
+	if(m_fastReject && RarClassifier::Classify(fileName) == RarClassifier::result::not_archive) {
+		return RarFile::error::invalid_file;
+	}
+
+	return session.Load(fileName);
+}
+
+// The path lives until the arena is reset at the end of the group.
+const TCHAR* RarBatch::GetFullPath(const TCHAR* fileName)
+{
+	DWORD bufferLength = MAX_PATH;
+	TCHAR* fullPath = m_arena.AllocateArray<TCHAR>(bufferLength);
+	DWORD length = ::GetFullPathName(fileName, bufferLength, fullPath, NULL);
+	if(length >= bufferLength) {
+		// The required size, including the terminating null character.
+		bufferLength = length;
+		fullPath = m_arena.AllocateArray<TCHAR>(bufferLength);
+		length = ::GetFullPathName(fileName, bufferLength, fullPath, NULL);
+	}
+
+	if(length == 0 || length >= bufferLength) {
+		return fileName;
+	}
+
+	return fullPath;
+}
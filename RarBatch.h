@@ -0,0 +1,79 @@
+#pragma once
+
+#include "RarArena.h"
+#include "RarFile.h"
+#include "RarScheduler.h"
+
+class RarJournal;
+class RarSession;
+
+// Applies an operation to a list of archives. Archives are processed in
+// groups. When a journal is used, the patches of a group are journaled and
+// the journal is flushed once before they're applied. The group callback
+// is called after each group, e.g. to write a report or a checkpoint.
+//
+// The sessions and the patches of a group are reused by the next group,
+// and the other per-archive buffers are taken from an arena which is reset
+// after each group, so that a long run doesn't allocate per archive. The
+// heap allocations of each group are recorded by RarHeap when it counts
+// them. Each worker thread uses its own RarBatch.
+//
+// The adaptive versions run the archives of a RarScheduler plan in slices
+// on several threads, with a RarBatch per thread which is configured like
+// this one. RarScheduler::RunAdaptive chooses how many slices are in
+// flight on each device. The groups finish out of order, and the group
+// callback is called by one thread at a time.
+class RarBatch {
+public:
+	struct Result {
+		CString fileName;
+		RarFile::error error;
+		int rarVersion;
+		DWORD flags;
+		bool modified; // the archive was written to
+	};
+
+	typedef std::function<void(const Result* results, size_t count)> GroupCallback;
+
+	RarBatch() = default;
+	~RarBatch() = default;
+
+	RarBatch(const RarBatch&) = delete;
+	RarBatch& operator=(const RarBatch&) = delete;
+
+	void SetJournal(RarJournal* journal);
+	void SetGroupCallback(GroupCallback callback);
+	// Skip the files which RarClassifier rejects, reported as invalid.
+	void SetFastReject(bool fastReject);
+	const RarArena::Counters& GetArenaCounters() const;
+	void GetStatus(const std::vector<CString>& fileNames,
+		std::vector<Result>& results);
+	void SetLocked(const std::vector<CString>& fileNames, bool locked,
+		std::vector<Result>& results);
+	void GetStatusAdaptive(const std::vector<CString>& fileNames,
+		const std::vector<RarScheduler::Device>& devices, unsigned int maxThreadCount,
+		std::vector<Result>& results);
+	void SetLockedAdaptive(const std::vector<CString>& fileNames, bool locked,
+		const std::vector<RarScheduler::Device>& devices, unsigned int maxThreadCount,
+		std::vector<Result>& results);
+
+private:
+	typedef std::function<void(RarBatch& batch, const std::vector<CString>& fileNames,
+		std::vector<Result>& results)> Operation;
+
+	void RunAdaptive(const std::vector<CString>& fileNames,
+		const std::vector<RarScheduler::Device>& devices, unsigned int maxThreadCount,
+		std::vector<Result>& results, const Operation& operation);
+	RarFile::error LoadArchive(RarSession& session, const TCHAR* fileName);
+	const TCHAR* GetFullPath(const TCHAR* fileName);
+
+	RarJournal* m_journal = nullptr;
+	GroupCallback m_groupCallback;
+	bool m_fastReject = false;
+	RarArena m_arena;
+
+	static const size_t m_groupSize = 64;
+	// Archives per scheduled item of the adaptive versions, each slice is
+	// a group of its own.
+	static const size_t m_sliceSize = 16;
+};
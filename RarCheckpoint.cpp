@@ -0,0 +1,103 @@
+#include "stdafx.h"
+#include "RarCheckpoint.h"
+#include "RarManifest.h"
+
+bool RarCheckpoint::Open(const TCHAR* fileName)
+{
+	assert(!m_open);
+
+	HRESULT hr = m_file.Create(fileName,
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ,
+		OPEN_ALWAYS);
+
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	ULONGLONG size;
+	hr = m_file.GetSize(size);
+	if(FAILED(hr)) {
+		m_file.Close();
+		return false;
+	}
+
+	// A partial record at the end is the result of an interrupted write.
+	size_t recordCount = static_cast<size_t>(size / sizeof(ULONGLONG));
+	std::vector<ULONGLONG> records(recordCount);
+
+	if(recordCount > 0) {
+		hr = m_file.Read(records.data(), static_cast<DWORD>(recordCount * sizeof(ULONGLONG)));
+		if(FAILED(hr)) {
+			m_file.Close();
+			return false;
+		}
+	}
+
+	if(size % sizeof(ULONGLONG) != 0) {
+		hr = m_file.SetSize(recordCount * sizeof(ULONGLONG));
+		if(FAILED(hr)) {
+			m_file.Close();
+			return false;
+		}
+	}
+
+	hr = m_file.Seek(0, FILE_END);
+	if(FAILED(hr)) {
+		m_file.Close();
+		return false;
+	}
+
+	m_finished.clear();
+	m_finished.insert(records.begin(), records.end());
+	m_buffer.clear();
+
+	m_open = true;
+
+	return true;
+}
+
+bool RarCheckpoint::Contains(const TCHAR* archiveFileName) const
+{
+	assert(m_open);
+	return m_finished.count(RarManifest::HashPath(archiveFileName)) > 0;
+}
+
+void RarCheckpoint::Append(const TCHAR* archiveFileName)
+{
+	assert(m_open);
+
+	ULONGLONG hash = RarManifest::HashPath(archiveFileName);
+	if(m_finished.insert(hash).second) {
+		m_buffer.push_back(hash);
+	}
+}
+
+bool RarCheckpoint::Commit()
+{
+	assert(m_open);
+
+	if(m_buffer.empty()) {
+		return true;
+	}
+
+	HRESULT hr = m_file.Write(m_buffer.data(),
+		static_cast<DWORD>(m_buffer.size() * sizeof(ULONGLONG)));
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	m_buffer.clear();
+
+	return SUCCEEDED(m_file.Flush());
+}
+
+void RarCheckpoint::Close()
+{
+	if(m_open) {
+		m_file.Close();
+		m_finished.clear();
+		m_buffer.clear();
+		m_open = false;
+	}
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+// Append-only log of the archives which were already processed, used to
+// resume an interrupted run. Each record is the 64-bit hash of a path, so
+// that finished archives are skipped without opening them.
+class RarCheckpoint {
+public:
+	RarCheckpoint() = default;
+	~RarCheckpoint() = default;
+
+	RarCheckpoint(const RarCheckpoint&) = delete;
+	RarCheckpoint& operator=(const RarCheckpoint&) = delete;
+
+	bool Open(const TCHAR* fileName);
+	bool Contains(const TCHAR* archiveFileName) const;
+	void Append(const TCHAR* archiveFileName);
+	bool Commit();
+	void Close();
+
+private:
+	bool m_open = false;
+	CAtlFile m_file;
+	std::unordered_set<ULONGLONG> m_finished;
+	std::vector<ULONGLONG> m_buffer;
+};
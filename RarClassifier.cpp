@@ -0,0 +1,267 @@
+#include "stdafx.h"
+#include "RarClassifier.h"
+#include "RarStats.h"
+
+std::atomic<ULONGLONG> RarClassifier::m_counters[counter_count];
+
+RarClassifier::result RarClassifier::Classify(const TCHAR* fileName)
+{
+	RarStats::StageTimer timer(RarStats::stage::classify);
+
+	counter stage = counter_unreadable;
+	result classification = result::unreadable;
+
+	CAtlFile file;
+	HRESULT hr = file.Create(fileName, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING);
+	if(SUCCEEDED(hr)) {
+		classification = ClassifyFile(file, stage);
+	}
+
+	m_counters[stage]++;
+	return classification;
+}
+
+void RarClassifier::GetCounters(Counters& counters)
+{
+	counters.rar = m_counters[counter_rar];
+	counters.sfx = m_counters[counter_sfx];
+	counters.possibleSfx = m_counters[counter_possible_sfx];
+	counters.unreadable = m_counters[counter_unreadable];
+	counters.rejectedByPrefix = m_counters[counter_rejected_by_prefix];
+	counters.rejectedByOverlay = m_counters[counter_rejected_by_overlay];
+}
+
+CString RarClassifier::FormatCounters(const Counters& counters)
+{
+	CString str;
+	str.Format(L"Classified files: %I64u\n"
+		L"RAR signature at the beginning: %I64u\n"
+		L"RAR signature at the executable overlay: %I64u\n"
+		L"Executables which need a full scan: %I64u\n"
+		L"Unreadable: %I64u\n"
+		L"Rejected by the first bytes: %I64u\n"
+		L"Rejected by the executable overlay: %I64u",
+		counters.rar + counters.sfx + counters.possibleSfx + counters.unreadable +
+		counters.rejectedByPrefix + counters.rejectedByOverlay,
+		counters.rar, counters.sfx, counters.possibleSfx, counters.unreadable,
+		counters.rejectedByPrefix, counters.rejectedByOverlay);
+	return str;
+}
+
+bool RarClassifier::LocateArchive(const BYTE* prefix, size_t prefixSize, ULONGLONG& archiveOffset)
+{
+	if(HasSignature(prefix, prefixSize)) {
+		archiveOffset = 0;
+		return true;
+	}
+
+	if(prefixSize < 0x40 || prefix[0] != 'M' || prefix[1] != 'Z') {
+		return false;
+	}
+
+	// The same headers as in ClassifyPE, which must all be in the prefix.
+	DWORD peOffset = *reinterpret_cast<const DWORD*>(prefix + 0x3C);
+
+	const size_t fileHeaderSize = 0x18;
+	ULONGLONG fileHeaderEnd = static_cast<ULONGLONG>(peOffset) + fileHeaderSize;
+	if(fileHeaderEnd > prefixSize || memcmp(prefix + peOffset, "PE\0\0", 4) != 0) {
+		return false;
+	}
+
+	const BYTE* fileHeader = prefix + peOffset;
+	WORD sectionCount = *reinterpret_cast<const WORD*>(fileHeader + 0x06);
+	WORD optionalHeaderSize = *reinterpret_cast<const WORD*>(fileHeader + 0x14);
+
+	ULONGLONG headersEnd = fileHeaderEnd + optionalHeaderSize + sectionCount * 0x28;
+	if(headersEnd > prefixSize) {
+		return false;
+	}
+
+	archiveOffset = GetImageEnd(prefix + fileHeaderEnd, optionalHeaderSize, sectionCount, headersEnd);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+RarClassifier::result RarClassifier::ClassifyFile(CAtlFile& file, counter& stage)
+{
+	ULONGLONG fileSize;
+	if(FAILED(file.GetSize(fileSize))) {
+		stage = counter_unreadable;
+		return result::unreadable;
+	}
+
+	BYTE prefix[m_prefixSize];
+	DWORD prefixSize = static_cast<DWORD>(std::min<ULONGLONG>(fileSize, sizeof(prefix)));
+	if(!ReadAt(file, 0, prefix, prefixSize)) {
+		stage = counter_unreadable;
+		return result::unreadable;
+	}
+
+	if(HasSignature(prefix, prefixSize)) {
+		stage = counter_rar;
+		return result::rar;
+	}
+
+	if(prefixSize >= 2 && prefix[0] == 'M' && prefix[1] == 'Z') {
+		return ClassifyPE(file, fileSize, prefix, prefixSize, stage);
+	}
+
+	// SFX modules for other systems, not parsed.
+	if(prefixSize >= 4 && memcmp(prefix, "\x7F" "ELF", 4) == 0) {
+		stage = counter_possible_sfx;
+		return result::possible_sfx;
+	}
+
+	stage = counter_rejected_by_prefix;
+	return result::not_archive;
+}
+
+// The archive of an SFX module is appended to the executable image. The
+// image ends with the raw data of its last section, or with the headers
+// if it has no sections, and an Authenticode signature, if present, is
+// appended after the archive.
+RarClassifier::result RarClassifier::ClassifyPE(CAtlFile& file, ULONGLONG fileSize,
+	const BYTE* prefix, size_t prefixSize, counter& stage)
+{
+	// Anything which isn't a well formed PE file, e.g. a DOS SFX module,
+	// is left for a full scan.
+	stage = counter_possible_sfx;
+
+	if(prefixSize < 0x40) {
+		return result::possible_sfx;
+	}
+
+	// IMAGE_DOS_HEADER::e_lfanew.
+	DWORD peOffset = *reinterpret_cast<const DWORD*>(prefix + 0x3C);
+
+	// Signature (4), IMAGE_FILE_HEADER (20).
+	const size_t fileHeaderSize = 0x18;
+	BYTE fileHeader[fileHeaderSize];
+	ULONGLONG fileHeaderEnd = static_cast<ULONGLONG>(peOffset) + fileHeaderSize;
+	if(fileHeaderEnd <= prefixSize) {
+		memcpy(fileHeader, prefix + peOffset, fileHeaderSize);
+	} else if(fileHeaderEnd > fileSize ||
+		!ReadAt(file, peOffset, fileHeader, fileHeaderSize)) {
+		return result::possible_sfx;
+	}
+
+	if(memcmp(fileHeader, "PE\0\0", 4) != 0) {
+		return result::possible_sfx;
+	}
+
+	WORD sectionCount = *reinterpret_cast<const WORD*>(fileHeader + 0x06);
+	WORD optionalHeaderSize = *reinterpret_cast<const WORD*>(fileHeader + 0x14);
+
+	// The optional header and the section table, 40 bytes per section.
+	size_t headersSize = optionalHeaderSize + sectionCount * 0x28;
+	if(headersSize > m_maxHeadersSize) {
+		return result::possible_sfx;
+	}
+
+	ULONGLONG headersOffset = fileHeaderEnd;
+	ULONGLONG headersEnd = headersOffset + headersSize;
+	if(headersEnd > fileSize) {
+		return result::possible_sfx;
+	}
+
+	std::vector<BYTE> headers(headersSize);
+	if(headersEnd <= prefixSize) {
+		memcpy(headers.data(), prefix + headersOffset, headersSize);
+	} else if(!ReadAt(file, headersOffset, headers.data(), static_cast<DWORD>(headersSize))) {
+		stage = counter_unreadable;
+		return result::unreadable;
+	}
+
+	ULONGLONG imageEnd = GetImageEnd(headers.data(), optionalHeaderSize, sectionCount, headersEnd);
+
+	// IMAGE_DIRECTORY_ENTRY_SECURITY, which holds a file offset.
+	ULONGLONG overlayEnd = fileSize;
+	size_t directoryCountOffset = 0;
+	if(optionalHeaderSize >= 2) {
+		WORD magic = *reinterpret_cast<const WORD*>(headers.data());
+		if(magic == 0x10B) {
+			directoryCountOffset = 0x5C; // PE32
+		} else if(magic == 0x20B) {
+			directoryCountOffset = 0x6C; // PE32+
+		}
+	}
+
+	const size_t securityDirectory = 4;
+	size_t securityOffset = directoryCountOffset + sizeof(DWORD) + securityDirectory * 8;
+	if(directoryCountOffset != 0 && securityOffset + 8 <= optionalHeaderSize &&
+		*reinterpret_cast<const DWORD*>(headers.data() + directoryCountOffset) > securityDirectory) {
+		DWORD certificateOffset = *reinterpret_cast<const DWORD*>(headers.data() + securityOffset);
+		DWORD certificateSize = *reinterpret_cast<const DWORD*>(headers.data() + securityOffset + 4);
+		if(certificateSize != 0 && certificateOffset >= imageEnd &&
+			static_cast<ULONGLONG>(certificateOffset) + certificateSize >= fileSize) {
+			overlayEnd = certificateOffset;
+		}
+	}
+
+	// The signature and the smallest main header.
+	const size_t minArchiveSize = 0x10;
+	if(imageEnd >= overlayEnd || overlayEnd - imageEnd < minArchiveSize) {
+		stage = counter_rejected_by_overlay;
+		return result::not_archive;
+	}
+
+	BYTE overlay[8];
+	if(!ReadAt(file, imageEnd, overlay, sizeof(overlay))) {
+		stage = counter_unreadable;
+		return result::unreadable;
+	}
+
+	if(HasSignature(overlay, sizeof(overlay))) {
+		stage = counter_sfx;
+		return result::sfx;
+	}
+
+	return result::possible_sfx;
+}
+
+// The end of the raw data of the last section, or of the headers if there
+// are no sections. The headers start with the optional header.
+ULONGLONG RarClassifier::GetImageEnd(const BYTE* headers, WORD optionalHeaderSize, WORD sectionCount,
+	ULONGLONG headersEnd)
+{
+	ULONGLONG imageEnd = headersEnd;
+
+	for(WORD i = 0; i < sectionCount; i++) {
+		const BYTE* section = headers + optionalHeaderSize + i * 0x28;
+		DWORD rawSize = *reinterpret_cast<const DWORD*>(section + 0x10);
+		DWORD rawOffset = *reinterpret_cast<const DWORD*>(section + 0x14);
+		if(rawSize != 0) {
+			imageEnd = std::max(imageEnd, static_cast<ULONGLONG>(rawOffset) + rawSize);
+		}
+	}
+
+	return imageEnd;
+}
+
+bool RarClassifier::ReadAt(CAtlFile& file, ULONGLONG offset, void* buffer, DWORD size)
+{
+	if(FAILED(file.Seek(offset, FILE_BEGIN))) {
+		return false;
+	}
+
+	DWORD bytesRead;
+	return SUCCEEDED(file.Read(buffer, size, bytesRead)) && bytesRead == size;
+}
+
+bool RarClassifier::HasSignature(const BYTE* data, size_t size)
+{
+	const BYTE signature[] = { 0x52, 0x61, 0x72, 0x21, 0x1A, 0x07 };
+	if(size < _countof(signature) + 1 || memcmp(data, signature, _countof(signature)) != 0) {
+		return false;
+	}
+
+	BYTE versionByte = data[_countof(signature)];
+	if(versionByte == 0x00) {
+		return true; // RAR 4.x
+	}
+
+	return versionByte == 0x01 && size > _countof(signature) + 1 &&
+		data[_countof(signature) + 1] == 0x00; // RAR 5.0
+}
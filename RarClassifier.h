@@ -0,0 +1,65 @@
+#pragma once
+
+// Cheap classification of a file before it's opened by RarFile, used to
+// skip the files of a mixed directory tree which can't hold an archive
+// without mapping and scanning them. Only the first bytes of the file are
+// read, and for a PE executable, its headers and the first bytes of the
+// overlay (the data past the last section), where SFX modules keep the
+// archive.
+//
+// An archive which is prefixed with arbitrary data, and isn't an SFX
+// archive, is found by RarFile but rejected here.
+class RarClassifier {
+public:
+	enum class result {
+		rar, // a signature at the beginning of the file
+		sfx, // a PE executable with a signature at the beginning of the overlay
+		possible_sfx, // an executable which may hold an archive, needs a full scan
+		not_archive,
+		unreadable // left for RarFile::Open to report
+	};
+
+	// Files classified since the process started, from all threads.
+	struct Counters {
+		ULONGLONG rar;
+		ULONGLONG sfx;
+		ULONGLONG possibleSfx;
+		ULONGLONG unreadable;
+		ULONGLONG rejectedByPrefix; // neither a signature nor an executable
+		ULONGLONG rejectedByOverlay; // a PE executable without archive data past the image
+	};
+
+	static result Classify(const TCHAR* fileName);
+	// Finds where the archive of a file would start from its first bytes
+	// only, for data which can't be read out of order, e.g. a member of a
+	// stream: at the beginning for a signature, or at the end of the image
+	// for a PE executable, whose headers must be in the prefix. Returns
+	// false if the file can't be located as an archive this way.
+	static bool LocateArchive(const BYTE* prefix, size_t prefixSize, ULONGLONG& archiveOffset);
+	static void GetCounters(Counters& counters);
+	static CString FormatCounters(const Counters& counters);
+
+private:
+	enum counter {
+		counter_rar,
+		counter_sfx,
+		counter_possible_sfx,
+		counter_unreadable,
+		counter_rejected_by_prefix,
+		counter_rejected_by_overlay,
+		counter_count
+	};
+
+	static result ClassifyFile(CAtlFile& file, counter& stage);
+	static result ClassifyPE(CAtlFile& file, ULONGLONG fileSize,
+		const BYTE* prefix, size_t prefixSize, counter& stage);
+	static ULONGLONG GetImageEnd(const BYTE* headers, WORD optionalHeaderSize, WORD sectionCount,
+		ULONGLONG headersEnd);
+	static bool ReadAt(CAtlFile& file, ULONGLONG offset, void* buffer, DWORD size);
+	static bool HasSignature(const BYTE* data, size_t size);
+
+	static const size_t m_prefixSize = 0x1000;
+	static const size_t m_maxHeadersSize = 0x10000;
+
+	static std::atomic<ULONGLONG> m_counters[counter_count];
+};
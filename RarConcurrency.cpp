@@ -0,0 +1,105 @@
+#include "stdafx.h"
+#include "RarConcurrency.h"
+
+const double RarConcurrency::m_tolerance = 1.5;
+const double RarConcurrency::m_minGradient = 0.5;
+const double RarConcurrency::m_baselineWindows = 20.0;
+const double RarConcurrency::m_minThroughputGain = 1.05;
+
+RarConcurrency::RarConcurrency(unsigned int initialLimit, unsigned int maxLimit)
+{
+	m_maxLimit = std::max(1u, maxLimit);
+	m_limit = std::max(1u, std::min(initialLimit, m_maxLimit));
+	m_peakLimit = GetLimit();
+
+	LARGE_INTEGER frequency;
+	::QueryPerformanceFrequency(&frequency);
+	m_frequency = frequency.QuadPart;
+}
+
+unsigned int RarConcurrency::GetLimit() const
+{
+	return static_cast<unsigned int>(m_limit);
+}
+
+void RarConcurrency::AddSample(LONGLONG start, LONGLONG end, size_t archives, unsigned int inFlight)
+{
+	if(m_archives == 0 && m_windowSamples == 0) {
+		m_firstStart = start;
+		m_windowStart = start;
+	}
+
+	m_firstStart = std::min(m_firstStart, start);
+	m_lastEnd = std::max(m_lastEnd, end);
+	m_archives += archives;
+
+	m_windowSamples++;
+	m_windowArchives += archives;
+	m_windowTicks += static_cast<double>(end - start);
+	m_windowMaxInFlight = std::max(m_windowMaxInFlight, inFlight);
+
+	size_t windowSize = GetLimit();
+	if(windowSize < m_minWindowSamples) {
+		windowSize = m_minWindowSamples;
+	}
+
+	if(m_windowSamples >= windowSize) {
+		UpdateLimit(end);
+	}
+}
+
+void RarConcurrency::GetSnapshot(Snapshot& snapshot) const
+{
+	double ticksPerMicrosecond = m_frequency / 1000000.0;
+
+	snapshot.limit = GetLimit();
+	snapshot.peakLimit = m_peakLimit;
+	snapshot.archives = m_archives;
+	snapshot.archivesPerSecond = m_lastEnd > m_firstStart ?
+		m_archives * static_cast<double>(m_frequency) / (m_lastEnd - m_firstStart) : 0;
+	snapshot.latency = m_latency / ticksPerMicrosecond;
+	snapshot.baselineLatency = m_baselineLatency / ticksPerMicrosecond;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+void RarConcurrency::UpdateLimit(LONGLONG end)
+{
+	// Items without archives, e.g. empty slices, carry no latency.
+	if(m_windowArchives > 0) {
+		double latency = m_windowTicks / m_windowArchives;
+		double elapsed = static_cast<double>(end - m_windowStart);
+		double throughput = elapsed > 0 ? m_windowArchives / elapsed : 0;
+
+		m_latency = latency;
+		if(m_baselineLatency == 0) {
+			m_baselineLatency = latency;
+		} else {
+			m_baselineLatency += (latency - m_baselineLatency) / m_baselineWindows;
+		}
+
+		double gradient = latency > 0 ? m_tolerance * m_baselineLatency / latency : 1.0;
+		gradient = std::max(m_minGradient, std::min(1.0, gradient));
+
+		// A device which didn't fill its limit gains nothing from a higher one.
+		double queue = m_windowMaxInFlight >= GetLimit() ? std::sqrt(m_limit) : 0;
+		double limit = m_limit * gradient + queue;
+
+		if(m_limit > m_previousLimit && m_previousThroughput > 0 &&
+			throughput < m_previousThroughput * m_minThroughputGain) {
+			limit = std::min(limit, m_previousLimit);
+		}
+
+		m_previousLimit = m_limit;
+		m_previousThroughput = throughput;
+		m_limit = std::max(1.0, std::min<double>(limit, m_maxLimit));
+		m_peakLimit = std::max(m_peakLimit, GetLimit());
+	}
+
+	m_windowStart = end;
+	m_windowSamples = 0;
+	m_windowArchives = 0;
+	m_windowTicks = 0;
+	m_windowMaxInFlight = 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+// Limit of the items in flight on one device, adjusted to the latency and
+// the throughput measured on the device, in the style of the gradient and
+// Vegas congestion controllers.
+//
+// The samples are grouped in windows of about one item per allowed slot.
+// After each window, the limit is multiplied by the ratio of a slowly
+// moving baseline latency (with a tolerance) to the window's latency, at
+// most halving it, and grows by its square root if the window filled it.
+// A device which queues requests, e.g. a throttled share, shows a rising
+// latency and its limit shrinks; a device whose latency stays flat, e.g.
+// an NVMe disk, keeps growing. A raise which doesn't improve the
+// throughput is taken back, so the limit doesn't grow past the point
+// where the device is saturated.
+//
+// The controller isn't thread safe, the caller serializes the calls.
+class RarConcurrency {
+public:
+	struct Snapshot {
+		unsigned int limit;
+		unsigned int peakLimit;
+		ULONGLONG archives;
+		double archivesPerSecond; // from the first start to the last end
+		double latency; // microseconds per archive, in the last window
+		double baselineLatency; // microseconds per archive
+	};
+
+	RarConcurrency(unsigned int initialLimit, unsigned int maxLimit);
+
+	unsigned int GetLimit() const;
+	// Records an item of archives archives, which ran from start to end
+	// (performance counter values) while inFlight items were running on
+	// the device, including itself.
+	void AddSample(LONGLONG start, LONGLONG end, size_t archives, unsigned int inFlight);
+	void GetSnapshot(Snapshot& snapshot) const;
+
+private:
+	void UpdateLimit(LONGLONG end);
+
+	double m_limit;
+	unsigned int m_maxLimit;
+	unsigned int m_peakLimit;
+	LONGLONG m_frequency;
+
+	// The current window.
+	LONGLONG m_windowStart = 0;
+	size_t m_windowSamples = 0;
+	ULONGLONG m_windowArchives = 0;
+	double m_windowTicks = 0;
+	unsigned int m_windowMaxInFlight = 0;
+
+	double m_baselineLatency = 0; // ticks per archive
+	double m_latency = 0;
+	double m_previousLimit = 0;
+	double m_previousThroughput = 0; // archives per tick
+
+	// The whole run.
+	LONGLONG m_firstStart = 0;
+	LONGLONG m_lastEnd = 0;
+	ULONGLONG m_archives = 0;
+
+	static const size_t m_minWindowSamples = 4;
+	static const double m_tolerance; // latency over the baseline before the limit shrinks
+	static const double m_minGradient;
+	static const double m_baselineWindows; // windows averaged in the baseline
+	static const double m_minThroughputGain; // for a raise to be kept
+};
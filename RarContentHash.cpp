@@ -0,0 +1,200 @@
+#include "stdafx.h"
+#include "RarContentHash.h"
+#include "RarScheduler.h"
+#include "RarStats.h"
+#include "xxhash64.h"
+
+RarFile::error RarContentHash::Compute(const TCHAR* fileName, ULONGLONG& hash, ULONGLONG& size)
+{
+	bool unbuffered = RarFile::GetUnbufferedReads();
+
+	CAtlFile file;
+	HRESULT hr;
+
+	{
+		RarStats::StageTimer timer(RarStats::stage::open);
+		hr = file.Create(fileName,
+			GENERIC_READ,
+			FILE_SHARE_READ,
+			OPEN_EXISTING,
+			unbuffered ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN);
+	}
+
+	if(FAILED(hr)) {
+		return RarFile::error::open_failed;
+	}
+
+	// The main header is located through the same handle, with unbuffered
+	// reads of the beginning of the file or with a mapping, which is
+	// released before the file is read.
+	RarFile::MainHeader header;
+	std::vector<BYTE> headerData;
+	RarFile::FileIdentity identity;
+
+	{
+		RarFile archive;
+		RarFile::error err = unbuffered ? archive.OpenUnbufferedHandle(file) : archive.OpenHandle(file);
+		if(err != RarFile::error::success) {
+			return err;
+		}
+
+		identity = archive.GetFileIdentity();
+
+		err = archive.GetMainHeader(header);
+		if(err == RarFile::error::success) {
+			const BYTE* data = archive.GetMainHeaderData();
+			headerData.assign(data, data + header.size);
+			RarFile::PatchLocked(header, headerData.data(), false);
+		} else if(err != RarFile::error::encrypted_archive) {
+			return err;
+		}
+	}
+
+	if(FAILED(file.Seek(0, FILE_BEGIN))) {
+		return RarFile::error::open_failed;
+	}
+
+	// Sector aligned, for unbuffered reads.
+	BYTE* buffer = static_cast<BYTE*>(::VirtualAlloc(NULL, m_readSize,
+		MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+	if(!buffer) {
+		return RarFile::error::open_failed;
+	}
+
+	RarFile::error err = HashFile(file, headerData.empty() ? nullptr : &header,
+		headerData.data(), buffer, hash, size);
+
+	::VirtualFree(buffer, 0, MEM_RELEASE);
+
+	if(err != RarFile::error::success) {
+		return err;
+	}
+
+	if(unbuffered) {
+		RarStats::AddBytesReadUnbuffered(size);
+	}
+
+	RarFile::FileIdentity currentIdentity;
+	if(!RarFile::FileIdentity::Query(file, currentIdentity)) {
+		return RarFile::error::open_failed;
+	}
+
+	if(size != identity.size || currentIdentity != identity) {
+		return RarFile::error::file_changed;
+	}
+
+	return RarFile::error::success;
+}
+
+// The archives are handed out one at a time, so that a few large archives
+// don't leave the other threads idle.
+void RarContentHash::ComputeAll(const std::vector<CString>& fileNames, unsigned int threadCount,
+	bool extentOrder, std::vector<Result>& results)
+{
+	results.resize(fileNames.size());
+
+	std::vector<RarScheduler::Device> devices;
+	if(extentOrder) {
+		RarScheduler::Plan(fileNames, devices);
+	} else {
+		// A single device without a seek penalty, in the given order.
+		RarScheduler::Device device;
+		device.items.resize(fileNames.size());
+		for(size_t i = 0; i < device.items.size(); i++) {
+			device.items[i] = i;
+		}
+
+		device.seekPenalty = false;
+		devices.push_back(std::move(device));
+	}
+
+	RarScheduler::Run(devices, threadCount, [&](size_t i, unsigned int thread) {
+		Result& result = results[i];
+		result.fileName = fileNames[i];
+		result.hash = 0;
+		result.size = 0;
+		result.error = Compute(fileNames[i], result.hash, result.size);
+		if(result.error != RarFile::error::success) {
+			result.hash = 0;
+		}
+	});
+}
+
+bool RarContentHash::Write(const TCHAR* fileName, const std::vector<Result>& results)
+{
+	CAtlFile file;
+	HRESULT hr = file.Create(fileName, GENERIC_WRITE, 0, CREATE_ALWAYS);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	CStringA data;
+	for(const auto& result : results) {
+		data.AppendFormat("%d\t%016I64X\t%I64u\t", static_cast<int>(result.error),
+			result.hash, result.size);
+		data += CW2A(result.fileName, CP_UTF8);
+		data += "\r\n";
+	}
+
+	if(!data.IsEmpty()) {
+		hr = file.Write(data.GetString(), data.GetLength());
+		if(FAILED(hr)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+// Hashes the file from its beginning, with the bytes of the main header
+// replaced by headerData, if header isn't null.
+RarFile::error RarContentHash::HashFile(CAtlFile& file, const RarFile::MainHeader* header,
+	const BYTE* headerData, BYTE* buffer, ULONGLONG& hash, ULONGLONG& size)
+{
+	XXHash64 hasher;
+	ULONGLONG offset = 0;
+
+	for(;;) {
+		DWORD bytesRead;
+		HRESULT hr;
+
+		{
+			RarStats::StageTimer timer(RarStats::stage::read);
+			hr = file.Read(buffer, m_readSize, bytesRead);
+		}
+
+		if(FAILED(hr)) {
+			return RarFile::error::open_failed;
+		}
+
+		if(bytesRead == 0) {
+			break;
+		}
+
+		// The part of the main header which is in this chunk.
+		if(header) {
+			ULONGLONG headerBegin = std::max<ULONGLONG>(offset, header->offset);
+			ULONGLONG headerEnd = std::min<ULONGLONG>(offset + bytesRead,
+				header->offset + header->size);
+			if(headerBegin < headerEnd) {
+				memcpy(buffer + (headerBegin - offset), headerData + (headerBegin - header->offset),
+					static_cast<size_t>(headerEnd - headerBegin));
+			}
+		}
+
+		{
+			RarStats::StageTimer timer(RarStats::stage::hash);
+			hasher.Update(buffer, bytesRead);
+		}
+
+		offset += bytesRead;
+	}
+
+	hash = hasher.Digest();
+	size = offset;
+
+	return RarFile::error::success;
+}
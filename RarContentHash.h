@@ -0,0 +1,40 @@
+#pragma once
+
+#include "RarFile.h"
+
+// Hash of the content of an archive which doesn't depend on its lock
+// state, so that a locked and an unlocked copy of an archive have the same
+// digest. The file is hashed as stored, except for the main header, which
+// is hashed as SetLocked(false) would write it: with the lock bit cleared
+// and the header CRC recomputed. The header is located by RarFile, the
+// rest of the file is streamed with large sequential reads and hashed with
+// XXH64, which keeps up with the disk.
+//
+// Archives with encrypted headers can't be locked or unlocked, they're
+// hashed unchanged.
+class RarContentHash {
+public:
+	struct Result {
+		CString fileName;
+		RarFile::error error;
+		ULONGLONG hash; // 0 unless error is success
+		ULONGLONG size;
+	};
+
+	static RarFile::error Compute(const TCHAR* fileName, ULONGLONG& hash, ULONGLONG& size);
+	// Hashes the archives on threadCount threads. With extentOrder, the
+	// archives of each disk are read in their order on disk, one at a time
+	// from a disk with a seek penalty, see RarScheduler.
+	static void ComputeAll(const std::vector<CString>& fileNames, unsigned int threadCount,
+		bool extentOrder, std::vector<Result>& results);
+	// Tab-separated, one UTF-8 line per archive: error code, hash (hex),
+	// size and path.
+	static bool Write(const TCHAR* fileName, const std::vector<Result>& results);
+
+private:
+	static RarFile::error HashFile(CAtlFile& file, const RarFile::MainHeader* header,
+		const BYTE* headerData, BYTE* buffer, ULONGLONG& hash, ULONGLONG& size);
+
+	// A multiple of the sector size, for unbuffered reads.
+	static const size_t m_readSize = 0x100000;
+};
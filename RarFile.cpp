@@ -1,448 +1,588 @@
 #include "stdafx.h"
 #include "RarFile.h"
+#include "RarFormat.h"
+#include "RarStats.h"
 #include "crc32.h"
 
+std::atomic<bool> RarFile::m_unbufferedReads(false);
+
+RarFile::~RarFile()
+{
+	Close();
+}
+
 RarFile::error RarFile::Open(const TCHAR* fileName,
 	bool writable /*= false*/, size_t maxSearchSize /*= m_defaultMaxSearchSize*/)
+{
+	return OpenFile(fileName, writable, maxSearchSize, false);
+}
+
+RarFile::error RarFile::OpenHandle(HANDLE fileHandle,
+	bool writable /*= false*/, size_t maxSearchSize /*= m_defaultMaxSearchSize*/)
 {
 	assert(!m_open);
 
-	CAtlFile fileHandle;
-	HRESULT hr = fileHandle.Create(fileName,
-		writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
-		FILE_SHARE_READ,
-		OPEN_EXISTING);
+	// The handle belongs to the caller, and its flags can't be changed, so
+	// it's always mapped.
+	CAtlFile file(fileHandle);
+	error err = OpenFileHandle(file, writable, maxSearchSize, false, false);
+	file.Detach();
+	return err;
+}
 
-	if(FAILED(hr)) {
-		return error::open_failed;
-	}
+RarFile::error RarFile::OpenUnbufferedHandle(HANDLE fileHandle,
+	size_t maxSearchSize /*= m_defaultMaxSearchSize*/)
+{
+	assert(!m_open);
+
+	CAtlFile file(fileHandle);
+	error err = OpenFileHandle(file, false, maxSearchSize, false, true);
+	file.Detach();
+	return err;
+}
 
-	ULONGLONG len;
-	fileHandle.GetSize(len);
+RarFile::error RarFile::OpenBuffer(BYTE* data, size_t size,
+	bool writable /*= false*/, size_t maxSearchSize /*= m_defaultMaxSearchSize*/)
+{
+	assert(!m_open);
 
-	hr = m_fileMapping.MapFile(fileHandle,
-		std::min(static_cast<size_t>(len), maxSearchSize),
-		0,
-		writable ? PAGE_READWRITE : PAGE_READONLY,
-		writable ? FILE_MAP_WRITE : FILE_MAP_READ);
+	m_buffer = data;
+	m_mappingSize = size;
+	m_fileIdentity = FileIdentity();
+	m_rejectedCandidates = 0;
 
-	if(FAILED(hr)) {
-		return error::open_failed;
-	}
+	size_t searchSize = std::min(size, maxSearchSize);
+	bool found;
 
-	if(!FindSignature()) {
-		m_fileMapping.Unmap();
-		return error::invalid_file;
+	{
+		RarStats::StageTimer timer(RarStats::stage::find_signature);
+		found = FindSignature(0, searchSize);
 	}
 
-	m_open = true;
-	m_writable = writable;
+	return ParseArchive(found, searchSize, writable);
+}
 
+// The whole file is mapped, so that all the blocks can be iterated. The
+// signature search is still limited to maxSearchSize.
+RarFile::error RarFile::OpenShared(const TCHAR* fileName, std::shared_ptr<const RarFile>& file,
+	size_t maxSearchSize /*= m_defaultMaxSearchSize*/)
+{
+	auto newFile = std::make_shared<RarFile>();
+	error err = newFile->OpenFile(fileName, false, maxSearchSize, true);
+	if(err != error::success) {
+		return err;
+	}
+
+	file = std::move(newFile);
 	return error::success;
 }
 
-int RarFile::GetRarVersion()
+int RarFile::GetRarVersion() const
 {
 	assert(m_open);
 	return m_rarVersion;
 }
 
-bool RarFile::IsSFX()
+bool RarFile::IsSFX() const
 {
 	assert(m_open);
 	return m_fileRarOffset != 0;
 }
 
-RarFile::error RarFile::GetFlags(DWORD& fileFlags)
+size_t RarFile::GetSFXOffset() const
 {
 	assert(m_open);
+	return m_fileRarOffset;
+}
 
-	switch(m_rarVersion) {
-	case 4:
-		return GetFlags4(fileFlags);
+const RarFile::FileIdentity& RarFile::GetFileIdentity() const
+{
+	assert(m_open);
+	return m_fileIdentity;
+}
 
-	case 5:
-		return GetFlags5(fileFlags);
+RarFile::error RarFile::GetMainHeader(MainHeader& header) const
+{
+	assert(m_open);
 
-	default:
-		assert(0);
-		return error::invalid_file;
+	if(m_mainHeaderError != error::success) {
+		return m_mainHeaderError;
 	}
+
+	header = m_mainHeader;
+	return error::success;
 }
 
-RarFile::error RarFile::SetLocked(bool locked)
+const BYTE* RarFile::GetMainHeaderData() const
 {
-	assert(m_open && m_writable);
-
-	switch(m_rarVersion) {
-	case 4:
-		return SetLocked4(locked);
+	assert(m_open && m_mainHeaderError == error::success);
+	return GetData() + m_mainHeader.offset;
+}
 
-	case 5:
-		return SetLocked5(locked);
+RarFile::error RarFile::GetFlags(DWORD& fileFlags) const
+{
+	assert(m_open);
 
-	default:
-		assert(0);
-		return error::invalid_file;
+	if(m_mainHeaderError != error::success) {
+		return m_mainHeaderError;
 	}
+
+	fileFlags = m_mainHeader.flags;
+	return error::success;
 }
 
-void RarFile::Close()
+bool RarFile::GetFirstBlock(Block& block) const
 {
-	if(m_open) {
-		m_fileMapping.Unmap();
-		m_open = false;
+	assert(m_open);
+
+	if(m_mainHeaderError != error::success) {
+		return false;
 	}
-}
 
-//////////////////////////////////////////////////////////////////////////
-// Private functions.
+	return GetBlock(m_mainHeader.offset + m_mainHeader.size, block);
+}
 
-bool RarFile::FindSignature()
+bool RarFile::GetNextBlock(Block& block) const
 {
-	const BYTE* fileBegin = m_fileMapping;
-	const BYTE* fileEnd = fileBegin + m_fileMapping.GetMappingSize();
-	const BYTE signature[] = { 0x52, 0x61, 0x72, 0x21, 0x1A, 0x07 };
+	assert(m_open);
 
-	size_t offset = 0;
+	if(block.endOfArchive) {
+		return false;
+	}
 
-	for(;;) {
-		auto it = std::search(fileBegin + offset, fileEnd,
-			std::begin(signature), std::end(signature));
-		if(it == fileEnd) {
-			return false;
-		}
+	ULONGLONG nextOffset = block.offset + block.headerSize + block.dataSize;
+	if(nextOffset < block.offset || nextOffset > m_mappingSize) {
+		return false;
+	}
 
-		offset = it - fileBegin;
+	return GetBlock(static_cast<size_t>(nextOffset), block);
+}
 
-		it += _countof(signature);
-		if(it >= fileEnd) {
-			return false;
-		}
+RarFile::error RarFile::SetLocked(bool locked)
+{
+	assert(m_open && m_writable);
 
-		if(*it == 0x00) {
-			it++;
-			if(fileEnd - it < 0x14) {
-				return false; // not enough bytes for a valid archive
-			}
+	if(m_mainHeaderError != error::success) {
+		return m_mainHeaderError;
+	}
 
-			m_fileRarOffset = offset;
-			m_rarVersion = 4;
-			return true;
-		} else if(*it == 0x01) {
-			it++;
-			if(it < fileEnd && *it == 0x00) {
-				it++;
-				if(fileEnd - it < 0x08) {
-					return false; // not enough bytes for a valid archive
-				}
+	bool oldLocked = (m_mainHeader.flags & flags::locked) != 0;
+	if(oldLocked == locked) {
+		return error::success;
+	}
 
-				m_fileRarOffset = offset;
-				m_rarVersion = 5;
-				return true;
-			}
-		}
+	BYTE* headerData = const_cast<BYTE*>(GetData()) + m_mainHeader.offset;
+	PatchLocked(m_mainHeader, headerData, locked);
 
-		offset = it - fileBegin;
-	}
+	m_mainHeader.flags ^= flags::locked;
+
+	return error::success;
 }
 
-RarFile::error RarFile::GetFlags4(DWORD& fileFlags)
+void RarFile::Close()
 {
-	const BYTE* fileBegin = m_fileMapping;
-	const BYTE* fileEnd = fileBegin + m_fileMapping.GetMappingSize();
-	const BYTE* archive = fileBegin + m_fileRarOffset;
-
-	assert(archive + 0x0A + sizeof(WORD) <= fileEnd);
-	WORD flags = *reinterpret_cast<const WORD*>(archive + 0x0A);
+	if(m_open) {
+		ReleaseData();
+		m_open = false;
+	}
+}
 
-	// 0x0001  - Volume attribute (archive volume)
-	// 0x0002  - Archive comment present
-	//           RAR 3.x uses the separate comment block
-	//           and does not set this flag.
-	//
-	// 0x0004  - Archive lock attribute
-	// 0x0008  - Solid attribute (solid archive)
-	// 0x0010  - New volume naming scheme ('volname.partN.rar')
-	// 0x0020  - Authenticity information present
-	//           RAR 3.x does not set this flag.
-	//
-	// 0x0040  - Recovery record present
-	// 0x0080  - Block headers are encrypted
-	// 0x0100  - First volume (set only by RAR 3.0 and later)
+void RarFile::PatchLocked(const MainHeader& header, BYTE* headerData, bool locked)
+{
+	if(locked) {
+		headerData[header.flagOffset] |= header.lockMask;
+	} else {
+		headerData[header.flagOffset] &= ~header.lockMask;
+	}
 
-	fileFlags = 0;
+	DWORD hashValue;
 
-	if(flags & 0x0001) {
-		fileFlags |= multivolume;
+	{
+		RarStats::StageTimer timer(RarStats::stage::crc);
+		hashValue = crc32(headerData + header.hashOffset,
+			header.size - header.hashOffset);
 	}
 
-	if(flags & 0x0004) {
-		fileFlags |= locked;
-	}
+	// RAR 4.x stores only the low 16 bits of the CRC32.
+	memcpy(headerData, &hashValue, header.crcSize);
+}
 
-	if(flags & 0x0008) {
-		fileFlags |= solid;
-	}
+void RarFile::SetUnbufferedReads(bool enable)
+{
+	m_unbufferedReads = enable;
+}
 
-	if(flags & 0x0040) {
-		fileFlags |= recovery_record;
-	}
+bool RarFile::GetUnbufferedReads()
+{
+	return m_unbufferedReads;
+}
 
-	if(flags & 0x0080) {
-		fileFlags |= encrypted_headers;
+bool RarFile::FileIdentity::Query(HANDLE fileHandle, FileIdentity& identity)
+{
+	BY_HANDLE_FILE_INFORMATION info;
+	if(!::GetFileInformationByHandle(fileHandle, &info)) {
+		return false;
 	}
 
-	if(flags & 0x0100) {
-		fileFlags |= first_volume;
-	}
+	identity.volumeSerialNumber = info.dwVolumeSerialNumber;
+	identity.fileIndexHigh = info.nFileIndexHigh;
+	identity.fileIndexLow = info.nFileIndexLow;
+	identity.size = (static_cast<ULONGLONG>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+	identity.lastWriteTime = info.ftLastWriteTime;
+	return true;
+}
 
-	return error::success;
+bool RarFile::FileIdentity::operator==(const FileIdentity& other) const
+{
+	return volumeSerialNumber == other.volumeSerialNumber &&
+		fileIndexHigh == other.fileIndexHigh &&
+		fileIndexLow == other.fileIndexLow &&
+		size == other.size &&
+		lastWriteTime.dwLowDateTime == other.lastWriteTime.dwLowDateTime &&
+		lastWriteTime.dwHighDateTime == other.lastWriteTime.dwHighDateTime;
 }
 
-RarFile::error RarFile::GetFlags5(DWORD& fileFlags)
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+RarFile::error RarFile::OpenFile(const TCHAR* fileName,
+	bool writable, size_t maxSearchSize, bool mapWholeFile)
 {
-	const BYTE* fileBegin = m_fileMapping;
-	const BYTE* fileEnd = fileBegin + m_fileMapping.GetMappingSize();
-	const BYTE* archive = fileBegin + m_fileRarOffset;
-	const BYTE* archivePtr = archive;
+	assert(!m_open);
 
-	// Skip signature.
-	archivePtr += 0x08;
+	bool unbuffered = !writable && !mapWholeFile && m_unbufferedReads;
 
-	// Skip header CRC32.
-	archivePtr += sizeof(DWORD);
+	CAtlFile fileHandle;
+	HRESULT hr;
 
-	// Skip header size.
-	ULONGLONG value;
-	size_t bytesRead;
-	if(!GetVint(archivePtr, fileEnd, value, bytesRead)) {
-		return error::invalid_file;
+	{
+		RarStats::StageTimer timer(RarStats::stage::open);
+		hr = fileHandle.Create(fileName,
+			writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+			FILE_SHARE_READ,
+			OPEN_EXISTING,
+			unbuffered ? FILE_FLAG_NO_BUFFERING : FILE_ATTRIBUTE_NORMAL);
 	}
 
-	archivePtr += bytesRead;
-
-	// Verify header type.
-	if(!GetVint(archivePtr, fileEnd, value, bytesRead)) {
-		return error::invalid_file;
+	if(FAILED(hr)) {
+		return error::open_failed;
 	}
 
-	if(value != 1) {
-		if(value == 4) {
-			return error::encrypted_archive;
-		}
+	return OpenFileHandle(fileHandle, writable, maxSearchSize, mapWholeFile, unbuffered);
+}
 
-		return error::invalid_file;
+RarFile::error RarFile::OpenFileHandle(CAtlFile& fileHandle,
+	bool writable, size_t maxSearchSize, bool mapWholeFile, bool unbuffered)
+{
+	if(!FileIdentity::Query(fileHandle, m_fileIdentity)) {
+		return error::open_failed;
 	}
 
-	archivePtr += bytesRead;
-
-	// Skip header flags and the optional extra area size.
-	if(!GetVint(archivePtr, fileEnd, value, bytesRead)) {
-		return error::invalid_file;
+	ULONGLONG len = m_fileIdentity.size;
+	ULONGLONG mapSize = mapWholeFile ? len : std::min<ULONGLONG>(len, maxSearchSize);
+	if(mapSize != static_cast<size_t>(mapSize)) {
+		return error::open_failed; // too large for the address space
 	}
 
-	archivePtr += bytesRead;
+	size_t searchSize = std::min(static_cast<size_t>(mapSize), maxSearchSize);
+	m_rejectedCandidates = 0;
+
+	bool found;
 
-	if(value & 0x0001) {
-		if(!GetVint(archivePtr, fileEnd, value, bytesRead)) {
-			return error::invalid_file;
+	if(unbuffered) {
+		error err = ReadUnbuffered(fileHandle, static_cast<size_t>(mapSize), found);
+		if(err != error::success) {
+			ReleaseData();
+			return err;
+		}
+	} else {
+		HRESULT hr;
+
+		{
+			RarStats::StageTimer timer(RarStats::stage::map);
+			hr = m_fileMapping.MapFile(fileHandle,
+				static_cast<size_t>(mapSize),
+				0,
+				writable ? PAGE_READWRITE : PAGE_READONLY,
+				writable ? FILE_MAP_WRITE : FILE_MAP_READ);
+		}
+
+		if(FAILED(hr)) {
+			return error::open_failed;
 		}
 
-		archivePtr += bytesRead;
+		m_mappingSize = static_cast<size_t>(mapSize);
+
+		RarStats::StageTimer timer(RarStats::stage::find_signature);
+		found = FindSignature(0, searchSize);
 	}
 
-	// Get archive flags.
-	if(!GetVint(archivePtr, fileEnd, value, bytesRead)) {
+	return ParseArchive(found, searchSize, writable);
+}
+
+RarFile::error RarFile::ParseArchive(bool found, size_t searchSize, bool writable)
+{
+	if(!found) {
+		RarStats::AddBytesScanned(searchSize);
+		ReleaseData();
 		return error::invalid_file;
 	}
 
-	archivePtr += bytesRead;
+	RarStats::AddBytesScanned(m_fileRarOffset);
 
-	WORD flags = static_cast<WORD>(value);
+	// The main header is parsed once, later calls use the cached result.
+	RarStats::StageTimer timer(RarStats::stage::parse_header);
 
-	// 0x0001 - Volume. Archive is a part of multivolume set.
-	// 0x0002 - Volume number field is present. This flag is present in all volumes except first.
-	// 0x0004 - Solid archive.
-	// 0x0008 - Recovery record is present.
-	// 0x0010 - Locked archive.
-
-	fileFlags = 0;
+	switch(m_rarVersion) {
+	case RarFormat4::version:
+		m_mainHeaderError = ParseMainHeader<RarFormat4>(m_mainHeader);
+		break;
 
-	if(flags & 0x0001) {
-		fileFlags |= multivolume;
+	case RarFormat5::version:
+		m_mainHeaderError = ParseMainHeader<RarFormat5>(m_mainHeader);
+		break;
 
-		if(!(flags & 0x0002)) {
-			fileFlags |= first_volume;
-		}
+	default:
+		assert(0);
+		m_mainHeaderError = error::invalid_file;
+		break;
 	}
 
-	if(flags & 0x0004) {
-		fileFlags |= solid;
-	}
+	m_open = true;
+	m_writable = writable;
 
-	if(flags & 0x0008) {
-		fileFlags |= recovery_record;
+	return error::success;
+}
+
+// Reads the beginning of the file without the file cache, in chunks,
+// until the main header which follows the signature was read. Unbuffered
+// reads must start at a sector boundary and have a size which is a
+// multiple of the sector size, and the buffer must be sector aligned,
+// which VirtualAlloc memory is.
+RarFile::error RarFile::ReadUnbuffered(CAtlFile& fileHandle, size_t dataSize, bool& found)
+{
+	size_t bufferSize = (dataSize + m_readChunkSize - 1) / m_readChunkSize * m_readChunkSize;
+	if(bufferSize == 0) {
+		found = false;
+		return error::success;
 	}
 
-	if(flags & 0x0010) {
-		fileFlags |= locked;
+	m_readBuffer = static_cast<BYTE*>(::VirtualAlloc(NULL, bufferSize,
+		MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+	if(!m_readBuffer) {
+		return error::open_failed;
 	}
 
-	return error::success;
-}
+	m_mappingSize = 0;
+	found = false;
 
-RarFile::error RarFile::SetLocked4(bool locked)
-{
-	BYTE* fileBegin = m_fileMapping;
-	BYTE* fileEnd = fileBegin + m_fileMapping.GetMappingSize();
-	BYTE* archive = fileBegin + m_fileRarOffset;
+	const size_t signatureSize = 6; // the part which is common to all versions
+	size_t searchBegin = 0;
 
-	assert(archive + 0x0A + sizeof(WORD) <= fileEnd);
-	WORD* flags = reinterpret_cast<WORD*>(archive + 0x0A);
+	while(m_mappingSize < dataSize) {
+		DWORD bytesRead;
+		HRESULT hr;
 
-	bool oldLocked = (*flags & 0x0004) != 0;
-	if(oldLocked == locked) {
-		return error::success;
-	}
+		{
+			RarStats::StageTimer timer(RarStats::stage::read);
+			hr = fileHandle.Read(m_readBuffer + m_mappingSize, m_readChunkSize, bytesRead);
+		}
 
-	assert(archive + 0x0C + sizeof(WORD) <= fileEnd);
-	WORD headerSize = *reinterpret_cast<WORD*>(archive + 0x0C);
+		if(FAILED(hr)) {
+			return error::open_failed;
+		}
 
-	const BYTE* hashCalcStart = archive + 0x09;
-	size_t hashCalcSize = headerSize - 2;
-	if(hashCalcStart + hashCalcSize > fileEnd) {
-		return error::invalid_file;
-	}
+		RarStats::AddBytesReadUnbuffered(bytesRead);
 
-	if(locked) {
-		*flags |= 0x0004;
-	} else {
-		*flags &= ~0x0004;
-	}
+		if(bytesRead == 0) {
+			break; // the file was truncated
+		}
 
-	DWORD hashValue = crc32(hashCalcStart, hashCalcSize);
+		m_mappingSize = std::min(m_mappingSize + bytesRead, dataSize);
+		bool complete = m_mappingSize == dataSize;
 
-	WORD* archiveCrc32 = reinterpret_cast<WORD*>(archive + 0x07);
-	*archiveCrc32 = static_cast<WORD>(hashValue);
+		if(found) {
+			if(m_mappingSize - m_fileRarOffset >= m_mainHeaderReadSize) {
+				break;
+			}
 
-	return error::success;
-}
+			continue;
+		}
 
-RarFile::error RarFile::SetLocked5(bool locked)
-{
-	BYTE* fileBegin = m_fileMapping;
-	BYTE* fileEnd = fileBegin + m_fileMapping.GetMappingSize();
-	BYTE* archive = fileBegin + m_fileRarOffset;
-	BYTE* archivePtr = archive;
+		// The bytes which follow a candidate are needed to check it, the
+		// last candidates of a chunk are checked after the next chunk.
+		if(!complete && m_mappingSize < m_candidateReadAhead) {
+			continue;
+		}
 
-	// Skip signature.
-	archivePtr += 0x08;
+		size_t searchEnd = complete ? m_mappingSize : m_mappingSize - m_candidateReadAhead;
+		if(searchEnd < searchBegin + signatureSize) {
+			continue;
+		}
 
-	// Skip header CRC32.
-	archivePtr += sizeof(DWORD);
+		{
+			RarStats::StageTimer timer(RarStats::stage::find_signature);
+			found = FindSignature(searchBegin, searchEnd);
+		}
 
-	BYTE* hashCalcStart = archivePtr;
+		if(!found && m_rejectedCandidates >= m_maxSignatureCandidates) {
+			break;
+		}
 
-	// Get header size.
-	ULONGLONG value;
-	size_t bytesRead;
-	if(!GetVint(archivePtr, fileEnd, value, bytesRead)) {
-		return error::invalid_file;
+		// The candidates which don't fit before searchEnd.
+		searchBegin = searchEnd - (signatureSize - 1);
 	}
 
-	archivePtr += bytesRead;
+	return error::success;
+}
+
+// Horspool search: after each alignment, the signature is shifted by the
+// distance of the byte under its last byte from the end of the signature.
+// Each alignment is checked with at most a constant number of comparisons,
+// and the shift is at least one byte, so the search is linear in the
+// searched size. To bound the work on crafted files, the search stops
+// after m_maxSignatureCandidates candidates with an invalid version.
+//
+// The whole signature must be between searchBegin and searchEnd.
+bool RarFile::FindSignature(size_t searchBegin, size_t searchEnd)
+{
+	const BYTE* fileBegin = GetData();
+	const BYTE* fileEnd = fileBegin + m_mappingSize;
+	const BYTE signature[] = { 0x52, 0x61, 0x72, 0x21, 0x1A, 0x07 };
+	const size_t signatureSize = _countof(signature);
 
-	size_t headerSize = static_cast<size_t>(value);
-	if(headerSize != value) {
-		return error::invalid_file; // header size too large
+	if(searchEnd < searchBegin + signatureSize) {
+		return false;
 	}
 
-	size_t hashCalcSize = headerSize + bytesRead;
-	if(hashCalcStart + hashCalcSize > fileEnd) {
-		return error::invalid_file;
+	BYTE shift[256];
+	memset(shift, signatureSize, sizeof(shift));
+	for(size_t i = 0; i < signatureSize - 1; i++) {
+		shift[signature[i]] = static_cast<BYTE>(signatureSize - 1 - i);
 	}
 
-	// Verify header type.
-	if(!GetVint(archivePtr, fileEnd, value, bytesRead)) {
-		return error::invalid_file;
-	}
+	// The last position at which the whole signature fits.
+	const BYTE* candidatesEnd = fileBegin + searchEnd - signatureSize + 1;
+	const BYTE* candidate = fileBegin + searchBegin;
 
-	if(value != 1) {
-		if(value == 4) {
-			return error::encrypted_archive;
+	while(candidate < candidatesEnd) {
+		BYTE lastByte = candidate[signatureSize - 1];
+		if(lastByte != signature[signatureSize - 1] ||
+			memcmp(candidate, signature, signatureSize - 1) != 0) {
+			candidate += shift[lastByte];
+			continue;
 		}
 
-		return error::invalid_file;
-	}
+		const BYTE* it = candidate + signatureSize;
+		if(it >= fileEnd) {
+			return false;
+		}
 
-	archivePtr += bytesRead;
+		if(*it == 0x00) {
+			it++;
+			if(fileEnd - it < 0x14) {
+				return false; // not enough bytes for a valid archive
+			}
 
-	// Skip header flags and the optional extra area size.
-	if(!GetVint(archivePtr, fileEnd, value, bytesRead)) {
-		return error::invalid_file;
-	}
+			m_fileRarOffset = candidate - fileBegin;
+			m_rarVersion = 4;
+			return true;
+		} else if(*it == 0x01) {
+			it++;
+			if(it < fileEnd && *it == 0x00) {
+				it++;
+				if(fileEnd - it < 0x08) {
+					return false; // not enough bytes for a valid archive
+				}
 
-	archivePtr += bytesRead;
+				m_fileRarOffset = candidate - fileBegin;
+				m_rarVersion = 5;
+				return true;
+			}
+		}
 
-	if(value & 0x0001) {
-		if(!GetVint(archivePtr, fileEnd, value, bytesRead)) {
-			return error::invalid_file;
+		m_rejectedCandidates++;
+		if(m_rejectedCandidates >= m_maxSignatureCandidates) {
+			return false;
 		}
 
-		archivePtr += bytesRead;
+		// The signature doesn't overlap itself.
+		candidate += signatureSize;
 	}
 
-	// Get archive flags.
-	if(!GetVint(archivePtr, fileEnd, value, bytesRead)) {
-		return error::invalid_file;
-	}
+	return false;
+}
 
-	WORD flags = static_cast<WORD>(value);
+template<class Format>
+RarFile::error RarFile::ParseMainHeader(MainHeader& header)
+{
+	const BYTE* fileBegin = GetData();
+	const BYTE* fileEnd = fileBegin + m_mappingSize;
+	const BYTE* headerStart = fileBegin + m_fileRarOffset + Format::signatureSize;
 
-	bool oldLocked = (flags & 0x0010) != 0;
-	if(oldLocked == locked) {
-		return error::success;
+	ULONGLONG rawFlags;
+	error err = Format::ParseMainHeader(headerStart, fileEnd, rawFlags, header);
+	if(err != error::success) {
+		return err;
 	}
 
-	// Modify the 5-th bit.
-	if(locked) {
-		*archivePtr |= 0x10;
-	} else {
-		*archivePtr &= ~0x10;
-	}
+	header.offset = headerStart - fileBegin;
+	header.crcSize = Format::crcSize;
+	header.lockMask = Format::lockMask;
+	header.flags = Format::DecodeFlags(rawFlags);
 
-	DWORD hashValue = crc32(hashCalcStart, hashCalcSize);
+	return error::success;
+}
 
-	DWORD* archiveCrc32 = reinterpret_cast<DWORD*>(archive + 0x08);
-	*archiveCrc32 = hashValue;
+bool RarFile::GetBlock(size_t offset, Block& block) const
+{
+	switch(m_rarVersion) {
+	case RarFormat4::version:
+		return ParseBlock<RarFormat4>(offset, block);
 
-	return error::success;
+	case RarFormat5::version:
+		return ParseBlock<RarFormat5>(offset, block);
+	}
+
+	assert(0);
+	return false;
 }
 
-bool RarFile::GetVint(const BYTE* dataBegin, const BYTE* dataEnd,
-	ULONGLONG& value, size_t& bytesRead)
+template<class Format>
+bool RarFile::ParseBlock(size_t offset, Block& block) const
 {
-	ULONGLONG result = 0;
-	size_t offset = 0;
-	for(const BYTE* p = dataBegin; p < dataEnd; ++p, ++offset) {
-		BYTE data = (*p) & 0x7F;
-		bool last = ((*p) & 0x80) == 0;
-		size_t shift_bits = offset * 7;
+	const BYTE* fileBegin = GetData();
+	if(offset >= m_mappingSize) {
+		return false;
+	}
 
-		ULONGLONG shifted = (ULONGLONG)data << shift_bits;
-		if((shifted >> shift_bits) != data) {
-			return false; // overflow
-		}
+	Block newBlock;
+	if(!Format::ParseBlock(fileBegin + offset, fileBegin + m_mappingSize, newBlock)) {
+		return false;
+	}
 
-		result |= shifted;
+	newBlock.offset = offset;
+	block = newBlock;
+	return true;
+}
 
-		if(last) {
-			value = result;
-			bytesRead = offset + 1;
-			return true;
-		}
+const BYTE* RarFile::GetData() const
+{
+	if(m_buffer) {
+		return m_buffer;
 	}
 
-	return false;
+	return m_readBuffer ? m_readBuffer : static_cast<const BYTE*>(m_fileMapping);
+}
+
+void RarFile::ReleaseData()
+{
+	if(m_buffer) {
+		m_buffer = nullptr;
+	} else if(m_readBuffer) {
+		::VirtualFree(m_readBuffer, 0, MEM_RELEASE);
+		m_readBuffer = nullptr;
+	} else {
+		m_fileMapping.Unmap();
+	}
 }
@@ -6,7 +6,9 @@ public:
 		success,
 		open_failed,
 		invalid_file,
-		encrypted_archive
+		encrypted_archive,
+		file_changed,
+		write_failed
 	};
 
 	enum flags {
@@ -18,34 +20,130 @@ public:
 		encrypted_headers = 0x20
 	};
 
+	// Identifies a file on disk. Used to make sure that a file wasn't
+	// replaced or modified since it was parsed.
+	struct FileIdentity {
+		DWORD volumeSerialNumber;
+		DWORD fileIndexHigh;
+		DWORD fileIndexLow;
+		ULONGLONG size;
+		FILETIME lastWriteTime;
+
+		static bool Query(HANDLE fileHandle, FileIdentity& identity);
+		bool operator==(const FileIdentity& other) const;
+		bool operator!=(const FileIdentity& other) const { return !(*this == other); }
+	};
+
+	// Location of the main archive header. The header region starts with
+	// the header CRC and ends with the last byte covered by the CRC.
+	struct MainHeader {
+		size_t offset; // from the beginning of the file
+		size_t size;
+		size_t crcSize; // 2 for RAR 4.x, 4 for RAR 5.0
+		size_t hashOffset; // from the beginning of the header region
+		size_t flagOffset; // the byte which holds the lock bit
+		BYTE lockMask;
+		DWORD flags;
+		// From the beginning of the header region, 0 if not present. Only
+		// RAR 5.0 archives have a locator record with these offsets.
+		ULONGLONG quickOpenOffset;
+		ULONGLONG recoveryRecordOffset;
+	};
+
+	// A block (header and data) which follows the main header.
+	struct Block {
+		size_t offset; // from the beginning of the file
+		int type; // the format specific header type
+		size_t headerSize;
+		ULONGLONG dataSize;
+		bool endOfArchive;
+	};
+
 	RarFile() = default;
-	~RarFile() = default;
+	~RarFile();
 
 	RarFile(const RarFile&) = delete;
 	RarFile& operator=(const RarFile&) = delete;
 
 	error Open(const TCHAR* fileName,
 		bool writable = false, size_t maxSearchSize = m_defaultMaxSearchSize);
-	int GetRarVersion();
-	bool IsSFX();
-	error GetFlags(DWORD& fileFlags);
+	// Opens a file which was opened by the caller, with GENERIC_READ, and
+	// GENERIC_WRITE if writable. The handle isn't needed after the call.
+	error OpenHandle(HANDLE fileHandle,
+		bool writable = false, size_t maxSearchSize = m_defaultMaxSearchSize);
+	// Opens a file which the caller opened with GENERIC_READ and
+	// FILE_FLAG_NO_BUFFERING. The beginning of the file is read from the
+	// current position, which must be 0, up to the main header, and the
+	// position is left after the data which was read.
+	error OpenUnbufferedHandle(HANDLE fileHandle,
+		size_t maxSearchSize = m_defaultMaxSearchSize);
+	// Opens an archive which is already in memory. The data must outlive
+	// the RarFile, and is modified by SetLocked if writable. The file
+	// identity is zero.
+	error OpenBuffer(BYTE* data, size_t size,
+		bool writable = false, size_t maxSearchSize = m_defaultMaxSearchSize);
+	int GetRarVersion() const;
+	bool IsSFX() const;
+	size_t GetSFXOffset() const;
+	const FileIdentity& GetFileIdentity() const;
+	error GetMainHeader(MainHeader& header) const;
+	const BYTE* GetMainHeaderData() const;
+	error GetFlags(DWORD& fileFlags) const;
+	// Blocks past the mapped part of the file can't be read, the whole
+	// file is mapped only by OpenShared.
+	bool GetFirstBlock(Block& block) const;
+	bool GetNextBlock(Block& block) const;
 	error SetLocked(bool locked);
 	void Close();
 
+	// Opens a read-only archive which can be shared between threads. All
+	// the methods of a const RarFile can be called concurrently.
+	static error OpenShared(const TCHAR* fileName, std::shared_ptr<const RarFile>& file,
+		size_t maxSearchSize = m_defaultMaxSearchSize);
+	static void PatchLocked(const MainHeader& header, BYTE* headerData, bool locked);
+	// Read-only archives which aren't opened with OpenShared are read with
+	// unbuffered reads instead of being mapped, so that scanning many files
+	// doesn't fill the file cache. Only the beginning of the file up to the
+	// main header is read.
+	static void SetUnbufferedReads(bool enable);
+	static bool GetUnbufferedReads();
+
 private:
-	bool FindSignature();
-	error GetFlags4(DWORD& fileFlags);
-	error GetFlags5(DWORD& fileFlags);
-	error SetLocked4(bool locked);
-	error SetLocked5(bool locked);
-	static bool GetVint(const BYTE* dataBegin, const BYTE* dataEnd,
-		ULONGLONG& value, size_t& bytesRead);
+	error OpenFile(const TCHAR* fileName,
+		bool writable, size_t maxSearchSize, bool mapWholeFile);
+	error OpenFileHandle(CAtlFile& fileHandle,
+		bool writable, size_t maxSearchSize, bool mapWholeFile, bool unbuffered);
+	error ParseArchive(bool found, size_t searchSize, bool writable);
+	error ReadUnbuffered(CAtlFile& fileHandle, size_t dataSize, bool& found);
+	bool FindSignature(size_t searchBegin, size_t searchEnd);
+	const BYTE* GetData() const;
+	void ReleaseData();
+	template<class Format>
+	error ParseMainHeader(MainHeader& header);
+	bool GetBlock(size_t offset, Block& block) const;
+	template<class Format>
+	bool ParseBlock(size_t offset, Block& block) const;
 
 	bool m_open = false;
 	CAtlFileMapping<BYTE> m_fileMapping;
+	BYTE* m_readBuffer = nullptr; // used instead of the mapping for unbuffered reads
+	BYTE* m_buffer = nullptr; // the caller's data, see OpenBuffer
+	size_t m_mappingSize; // the size of the mapped or read data
+	size_t m_rejectedCandidates;
 	bool m_writable;
 	size_t m_fileRarOffset;
 	int m_rarVersion;
+	FileIdentity m_fileIdentity;
+	error m_mainHeaderError;
+	MainHeader m_mainHeader;
 
 	static const size_t m_defaultMaxSearchSize = 1024 * 1024 * 10;
+	static const size_t m_maxSignatureCandidates = 1024;
+	static const size_t m_readChunkSize = 0x10000; // a multiple of the sector size
+	static const size_t m_mainHeaderReadSize = 0x20000; // read after the signature
+	// Read ahead of a signature candidate, for its version and the minimal
+	// main header which FindSignature checks.
+	static const size_t m_candidateReadAhead = 0x20;
+
+	static std::atomic<bool> m_unbufferedReads;
 };
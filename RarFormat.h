@@ -0,0 +1,406 @@
+#pragma once
+
+#include "RarFile.h"
+
+// Format traits of the supported archive versions. RarFile instantiates
+// its header parsing for each of them, so that the version is checked
+// once per archive and not on every call.
+//
+// ParseMainHeader receives a pointer to the main header, which starts
+// right after the signature, and fills the size, hashOffset, flagOffset
+// and locator fields of the header layout. The rest is filled by RarFile.
+//
+// ParseBlock receives a pointer to a block header and fills all the block
+// fields except for the offset. The header CRC isn't verified.
+
+struct RarFormat4 {
+	static const int version = 4;
+	static const size_t signatureSize = 0x07;
+	static const size_t crcSize = sizeof(WORD);
+	static const BYTE lockMask = 0x04;
+
+	static RarFile::error ParseMainHeader(const BYTE* header, const BYTE* dataEnd,
+		ULONGLONG& rawFlags, RarFile::MainHeader& mainHeader)
+	{
+		// HEAD_CRC (2), HEAD_TYPE (1), HEAD_FLAGS (2), HEAD_SIZE (2).
+		assert(header + 0x03 + sizeof(WORD) + sizeof(WORD) <= dataEnd);
+		rawFlags = *reinterpret_cast<const WORD*>(header + 0x03);
+		WORD headerSize = *reinterpret_cast<const WORD*>(header + 0x05);
+
+		// The CRC is calculated over the header, except for the CRC field.
+		if(headerSize < 0x07 || static_cast<size_t>(dataEnd - header) < headerSize) {
+			return RarFile::error::invalid_file;
+		}
+
+		mainHeader.size = headerSize;
+		mainHeader.hashOffset = sizeof(WORD);
+		mainHeader.flagOffset = 0x03; // the low byte of HEAD_FLAGS
+		mainHeader.quickOpenOffset = 0;
+		mainHeader.recoveryRecordOffset = 0;
+		return RarFile::error::success;
+	}
+
+	static bool ParseBlock(const BYTE* header, const BYTE* dataEnd, RarFile::Block& block)
+	{
+		// HEAD_CRC (2), HEAD_TYPE (1), HEAD_FLAGS (2), HEAD_SIZE (2), and
+		// ADD_SIZE (4) if HEAD_FLAGS has 0x8000. File and service headers
+		// have HIGH_PACK_SIZE (4) at 0x20 if HEAD_FLAGS has 0x0100.
+		if(dataEnd - header < 0x07) {
+			return false;
+		}
+
+		BYTE headerType = header[0x02];
+		WORD headerFlags = *reinterpret_cast<const WORD*>(header + 0x03);
+		WORD headerSize = *reinterpret_cast<const WORD*>(header + 0x05);
+
+		if(headerSize < 0x07 || dataEnd - header < headerSize) {
+			return false;
+		}
+
+		ULONGLONG dataSize = 0;
+		if(headerFlags & 0x8000) {
+			if(headerSize < 0x0B) {
+				return false;
+			}
+
+			dataSize = *reinterpret_cast<const DWORD*>(header + 0x07);
+
+			if((headerType == 0x74 || headerType == 0x7A) && (headerFlags & 0x0100)) {
+				if(headerSize < 0x24) {
+					return false;
+				}
+
+				dataSize |= static_cast<ULONGLONG>(*reinterpret_cast<const DWORD*>(header + 0x20)) << 32;
+			}
+		}
+
+		block.type = headerType;
+		block.headerSize = headerSize;
+		block.dataSize = dataSize;
+		block.endOfArchive = headerType == 0x7B;
+		return true;
+	}
+
+	static DWORD DecodeFlags(ULONGLONG rawFlags)
+	{
+		// 0x0001  - Volume attribute (archive volume)
+		// 0x0002  - Archive comment present
+		//           RAR 3.x uses the separate comment block
+		//           and does not set this flag.
+		//
+		// 0x0004  - Archive lock attribute
+		// 0x0008  - Solid attribute (solid archive)
+		// 0x0010  - New volume naming scheme ('volname.partN.rar')
+		// 0x0020  - Authenticity information present
+		//           RAR 3.x does not set this flag.
+		//
+		// 0x0040  - Recovery record present
+		// 0x0080  - Block headers are encrypted
+		// 0x0100  - First volume (set only by RAR 3.0 and later)
+
+		DWORD fileFlags = 0;
+
+		if(rawFlags & 0x0001) {
+			fileFlags |= RarFile::multivolume;
+		}
+
+		if(rawFlags & 0x0004) {
+			fileFlags |= RarFile::locked;
+		}
+
+		if(rawFlags & 0x0008) {
+			fileFlags |= RarFile::solid;
+		}
+
+		if(rawFlags & 0x0040) {
+			fileFlags |= RarFile::recovery_record;
+		}
+
+		if(rawFlags & 0x0080) {
+			fileFlags |= RarFile::encrypted_headers;
+		}
+
+		if(rawFlags & 0x0100) {
+			fileFlags |= RarFile::first_volume;
+		}
+
+		return fileFlags;
+	}
+};
+
+struct RarFormat5 {
+	static const int version = 5;
+	static const size_t signatureSize = 0x08;
+	static const size_t crcSize = sizeof(DWORD);
+	static const BYTE lockMask = 0x10;
+
+	static RarFile::error ParseMainHeader(const BYTE* header, const BYTE* dataEnd,
+		ULONGLONG& rawFlags, RarFile::MainHeader& mainHeader)
+	{
+		const BYTE* headerPtr = header;
+
+		// Skip header CRC32.
+		headerPtr += sizeof(DWORD);
+
+		const BYTE* hashCalcStart = headerPtr;
+
+		// Get header size.
+		ULONGLONG value;
+		size_t bytesRead;
+		if(!GetVint(headerPtr, dataEnd, value, bytesRead)) {
+			return RarFile::error::invalid_file;
+		}
+
+		headerPtr += bytesRead;
+
+		size_t headerSize = static_cast<size_t>(value);
+		if(headerSize != value) {
+			return RarFile::error::invalid_file; // header size too large
+		}
+
+		size_t hashCalcSize = headerSize + bytesRead;
+		if(hashCalcSize < headerSize ||
+			static_cast<size_t>(dataEnd - hashCalcStart) < hashCalcSize) {
+			return RarFile::error::invalid_file;
+		}
+
+		const BYTE* headerEnd = hashCalcStart + hashCalcSize;
+
+		// Verify header type.
+		if(!GetVint(headerPtr, headerEnd, value, bytesRead)) {
+			return RarFile::error::invalid_file;
+		}
+
+		if(value != 1) {
+			if(value == 4) {
+				return RarFile::error::encrypted_archive;
+			}
+
+			return RarFile::error::invalid_file;
+		}
+
+		headerPtr += bytesRead;
+
+		// Get header flags and the optional extra area size.
+		if(!GetVint(headerPtr, headerEnd, value, bytesRead)) {
+			return RarFile::error::invalid_file;
+		}
+
+		headerPtr += bytesRead;
+
+		ULONGLONG extraAreaSize = 0;
+		if(value & 0x0001) {
+			if(!GetVint(headerPtr, headerEnd, extraAreaSize, bytesRead)) {
+				return RarFile::error::invalid_file;
+			}
+
+			headerPtr += bytesRead;
+		}
+
+		// Get archive flags. The lock bit is in the first byte of the vint.
+		if(!GetVint(headerPtr, headerEnd, rawFlags, bytesRead)) {
+			return RarFile::error::invalid_file;
+		}
+
+		mainHeader.size = headerEnd - header;
+		mainHeader.hashOffset = hashCalcStart - header;
+		mainHeader.flagOffset = headerPtr - header;
+		mainHeader.quickOpenOffset = 0;
+		mainHeader.recoveryRecordOffset = 0;
+
+		// The extra area is at the end of the header. A malformed extra
+		// area doesn't make the archive invalid, the locator is optional.
+		if(extraAreaSize > 0 && extraAreaSize < static_cast<size_t>(headerEnd - headerPtr)) {
+			ParseLocator(headerEnd - static_cast<size_t>(extraAreaSize), headerEnd, mainHeader);
+		}
+
+		return RarFile::error::success;
+	}
+
+	static bool ParseBlock(const BYTE* header, const BYTE* dataEnd, RarFile::Block& block)
+	{
+		// CRC32 (4), header size (vint), header type (vint), header flags
+		// (vint), extra area size (vint, flag 0x01), data size (vint, flag 0x02).
+		if(dataEnd - header <= static_cast<ptrdiff_t>(sizeof(DWORD))) {
+			return false;
+		}
+
+		const BYTE* headerPtr = header + sizeof(DWORD);
+
+		ULONGLONG headerSize;
+		size_t bytesRead;
+		if(!GetVint(headerPtr, dataEnd, headerSize, bytesRead)) {
+			return false;
+		}
+
+		headerPtr += bytesRead;
+
+		if(headerSize == 0 || headerSize > static_cast<size_t>(dataEnd - headerPtr)) {
+			return false;
+		}
+
+		const BYTE* headerEnd = headerPtr + static_cast<size_t>(headerSize);
+
+		ULONGLONG headerType;
+		if(!GetVint(headerPtr, headerEnd, headerType, bytesRead)) {
+			return false;
+		}
+
+		headerPtr += bytesRead;
+
+		ULONGLONG headerFlags;
+		if(!GetVint(headerPtr, headerEnd, headerFlags, bytesRead)) {
+			return false;
+		}
+
+		headerPtr += bytesRead;
+
+		ULONGLONG value;
+		if(headerFlags & 0x0001) {
+			if(!GetVint(headerPtr, headerEnd, value, bytesRead)) {
+				return false;
+			}
+
+			headerPtr += bytesRead;
+		}
+
+		ULONGLONG dataSize = 0;
+		if(headerFlags & 0x0002) {
+			if(!GetVint(headerPtr, headerEnd, dataSize, bytesRead)) {
+				return false;
+			}
+		}
+
+		block.type = static_cast<int>(headerType);
+		block.headerSize = headerEnd - header;
+		block.dataSize = dataSize;
+		block.endOfArchive = headerType == 5;
+		return true;
+	}
+
+	// Extra area records: size, type, data. The size covers the type and
+	// the data. The locator record (type 1) has flags, then the quick open
+	// offset (flag 0x01) and the recovery record offset (flag 0x02).
+	static void ParseLocator(const BYTE* extraArea, const BYTE* extraAreaEnd,
+		RarFile::MainHeader& mainHeader)
+	{
+		const BYTE* recordPtr = extraArea;
+
+		while(recordPtr < extraAreaEnd) {
+			ULONGLONG recordSize;
+			size_t bytesRead;
+			if(!GetVint(recordPtr, extraAreaEnd, recordSize, bytesRead)) {
+				return;
+			}
+
+			recordPtr += bytesRead;
+
+			if(recordSize == 0 || recordSize > static_cast<size_t>(extraAreaEnd - recordPtr)) {
+				return;
+			}
+
+			const BYTE* recordEnd = recordPtr + static_cast<size_t>(recordSize);
+
+			ULONGLONG recordType;
+			if(!GetVint(recordPtr, recordEnd, recordType, bytesRead)) {
+				return;
+			}
+
+			if(recordType == 0x01) {
+				const BYTE* fieldPtr = recordPtr + bytesRead;
+
+				ULONGLONG locatorFlags;
+				if(!GetVint(fieldPtr, recordEnd, locatorFlags, bytesRead)) {
+					return;
+				}
+
+				fieldPtr += bytesRead;
+
+				ULONGLONG offset;
+				if(locatorFlags & 0x0001) {
+					if(!GetVint(fieldPtr, recordEnd, offset, bytesRead)) {
+						return;
+					}
+
+					fieldPtr += bytesRead;
+					mainHeader.quickOpenOffset = offset;
+				}
+
+				if(locatorFlags & 0x0002) {
+					if(!GetVint(fieldPtr, recordEnd, offset, bytesRead)) {
+						return;
+					}
+
+					mainHeader.recoveryRecordOffset = offset;
+				}
+
+				return;
+			}
+
+			recordPtr = recordEnd;
+		}
+	}
+
+	static DWORD DecodeFlags(ULONGLONG rawFlags)
+	{
+		// 0x0001 - Volume. Archive is a part of multivolume set.
+		// 0x0002 - Volume number field is present. This flag is present in all volumes except first.
+		// 0x0004 - Solid archive.
+		// 0x0008 - Recovery record is present.
+		// 0x0010 - Locked archive.
+
+		DWORD fileFlags = 0;
+
+		if(rawFlags & 0x0001) {
+			fileFlags |= RarFile::multivolume;
+
+			if(!(rawFlags & 0x0002)) {
+				fileFlags |= RarFile::first_volume;
+			}
+		}
+
+		if(rawFlags & 0x0004) {
+			fileFlags |= RarFile::solid;
+		}
+
+		if(rawFlags & 0x0008) {
+			fileFlags |= RarFile::recovery_record;
+		}
+
+		if(rawFlags & 0x0010) {
+			fileFlags |= RarFile::locked;
+		}
+
+		return fileFlags;
+	}
+
+	static bool GetVint(const BYTE* dataBegin, const BYTE* dataEnd,
+		ULONGLONG& value, size_t& bytesRead)
+	{
+		ULONGLONG result = 0;
+		size_t offset = 0;
+		for(const BYTE* p = dataBegin; p < dataEnd; ++p, ++offset) {
+			BYTE data = (*p) & 0x7F;
+			bool last = ((*p) & 0x80) == 0;
+			size_t shift_bits = offset * 7;
+			if(shift_bits >= 64) {
+				return false; // overflow
+			}
+
+			ULONGLONG shifted = (ULONGLONG)data << shift_bits;
+			if((shifted >> shift_bits) != data) {
+				return false; // overflow
+			}
+
+			result |= shifted;
+
+			if(last) {
+				value = result;
+				bytesRead = offset + 1;
+				return true;
+			}
+		}
+
+		return false;
+	}
+};
@@ -0,0 +1,158 @@
+#include "stdafx.h"
+#include "RarHeap.h"
+
+RarHeap::HeapAllocFunction RarHeap::m_heapAlloc;
+RarHeap::HeapReAllocFunction RarHeap::m_heapReAlloc;
+std::atomic<bool> RarHeap::m_counting;
+std::atomic<ULONGLONG> RarHeap::m_allocations;
+std::atomic<ULONGLONG> RarHeap::m_groups;
+std::atomic<ULONGLONG> RarHeap::m_groupAllocations;
+std::atomic<ULONGLONG> RarHeap::m_allocatingGroups;
+std::atomic<ULONGLONG> RarHeap::m_maxGroupAllocations;
+thread_local ULONGLONG RarHeap::m_threadAllocations = 0;
+
+// Called once, before the worker threads are started.
+bool RarHeap::StartCounting()
+{
+	if(m_counting) {
+		return true;
+	}
+
+	HMODULE kernel32 = ::GetModuleHandle(L"kernel32.dll");
+	if(!kernel32) {
+		return false;
+	}
+
+	// The imports hold the same addresses, also when kernel32 forwards
+	// the functions to ntdll.
+	FARPROC heapAlloc = ::GetProcAddress(kernel32, "HeapAlloc");
+	FARPROC heapReAlloc = ::GetProcAddress(kernel32, "HeapReAlloc");
+	if(!heapAlloc || !heapReAlloc) {
+		return false;
+	}
+
+	m_heapAlloc = reinterpret_cast<HeapAllocFunction>(heapAlloc);
+	m_heapReAlloc = reinterpret_cast<HeapReAllocFunction>(heapReAlloc);
+
+	HMODULE module = ::GetModuleHandle(NULL);
+	size_t replaced = ReplaceImport(module, reinterpret_cast<void*>(heapAlloc),
+		reinterpret_cast<void*>(&CountingHeapAlloc));
+	replaced += ReplaceImport(module, reinterpret_cast<void*>(heapReAlloc),
+		reinterpret_cast<void*>(&CountingHeapReAlloc));
+	if(replaced == 0) {
+		return false;
+	}
+
+	m_counting = true;
+	return true;
+}
+
+bool RarHeap::IsCounting()
+{
+	return m_counting;
+}
+
+ULONGLONG RarHeap::GetThreadAllocations()
+{
+	return m_threadAllocations;
+}
+
+void RarHeap::AddGroup(ULONGLONG allocations)
+{
+	m_groups++;
+	m_groupAllocations += allocations;
+
+	if(allocations > 0) {
+		m_allocatingGroups++;
+	}
+
+	ULONGLONG maxAllocations = m_maxGroupAllocations;
+	while(allocations > maxAllocations &&
+		!m_maxGroupAllocations.compare_exchange_weak(maxAllocations, allocations)) {
+	}
+}
+
+void RarHeap::GetCounters(Counters& counters)
+{
+	counters.allocations = m_allocations;
+	counters.groups = m_groups;
+	counters.groupAllocations = m_groupAllocations;
+	counters.allocatingGroups = m_allocatingGroups;
+	counters.maxGroupAllocations = m_maxGroupAllocations;
+}
+
+CString RarHeap::FormatCounters(const Counters& counters)
+{
+	CString str;
+	str.Format(L"Heap allocations: %I64u", counters.allocations);
+
+	if(counters.groups > 0) {
+		CString line;
+		line.Format(L"\nHeap allocations per batch group: %.2f (at most %I64u, %I64u of %I64u groups allocated)",
+			static_cast<double>(counters.groupAllocations) / counters.groups,
+			counters.maxGroupAllocations, counters.allocatingGroups, counters.groups);
+		str += line;
+	}
+
+	return str;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+LPVOID WINAPI RarHeap::CountingHeapAlloc(HANDLE heap, DWORD flags, SIZE_T bytes)
+{
+	CountAllocation();
+	return m_heapAlloc(heap, flags, bytes);
+}
+
+LPVOID WINAPI RarHeap::CountingHeapReAlloc(HANDLE heap, DWORD flags, LPVOID memory, SIZE_T bytes)
+{
+	CountAllocation();
+	return m_heapReAlloc(heap, flags, memory, bytes);
+}
+
+// Replaces the import address table entries of module which point to
+// function, returns the number of replaced entries.
+size_t RarHeap::ReplaceImport(HMODULE module, void* function, void* replacement)
+{
+	BYTE* base = reinterpret_cast<BYTE*>(module);
+	const IMAGE_DOS_HEADER* dosHeader = reinterpret_cast<const IMAGE_DOS_HEADER*>(base);
+	const IMAGE_NT_HEADERS* ntHeaders = reinterpret_cast<const IMAGE_NT_HEADERS*>(base + dosHeader->e_lfanew);
+	const IMAGE_DATA_DIRECTORY& importDirectory =
+		ntHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+	if(importDirectory.VirtualAddress == 0) {
+		return 0;
+	}
+
+	size_t replaced = 0;
+
+	const IMAGE_IMPORT_DESCRIPTOR* descriptor =
+		reinterpret_cast<const IMAGE_IMPORT_DESCRIPTOR*>(base + importDirectory.VirtualAddress);
+	for(; descriptor->Name != 0; descriptor++) {
+		IMAGE_THUNK_DATA* thunk = reinterpret_cast<IMAGE_THUNK_DATA*>(base + descriptor->FirstThunk);
+		for(; thunk->u1.Function != 0; thunk++) {
+			void** entry = reinterpret_cast<void**>(&thunk->u1.Function);
+			if(*entry != function) {
+				continue;
+			}
+
+			DWORD oldProtect;
+			if(!::VirtualProtect(entry, sizeof(void*), PAGE_READWRITE, &oldProtect)) {
+				continue;
+			}
+
+			*entry = replacement;
+			::VirtualProtect(entry, sizeof(void*), oldProtect, &oldProtect);
+			replaced++;
+		}
+	}
+
+	return replaced;
+}
+
+void RarHeap::CountAllocation()
+{
+	m_allocations.fetch_add(1, std::memory_order_relaxed);
+	m_threadAllocations++;
+}
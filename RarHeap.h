@@ -0,0 +1,50 @@
+#pragma once
+
+// Counts the heap allocations of the process, to check that long runs
+// don't allocate per archive. Counting is off until StartCounting is
+// called, which redirects the module's imports of HeapAlloc and
+// HeapReAlloc to counting wrappers. The C runtime is linked statically, so
+// the allocations of malloc, new and CString are counted too. Memory taken
+// with VirtualAlloc and allocations made inside system DLLs aren't.
+//
+// Only used by the executable, its implicit TLS doesn't work in a DLL
+// which is loaded with LoadLibrary on Windows XP.
+class RarHeap {
+public:
+	struct Counters {
+		ULONGLONG allocations;
+		ULONGLONG groups; // batch groups, see AddGroup
+		ULONGLONG groupAllocations; // made while a batch group was processed
+		ULONGLONG allocatingGroups; // groups which allocated at all
+		ULONGLONG maxGroupAllocations;
+	};
+
+	static bool StartCounting();
+	static bool IsCounting();
+	// Allocations made by the calling thread.
+	static ULONGLONG GetThreadAllocations();
+	// Records the allocations made by a batch group, the difference of
+	// GetThreadAllocations before and after it.
+	static void AddGroup(ULONGLONG allocations);
+	static void GetCounters(Counters& counters);
+	static CString FormatCounters(const Counters& counters);
+
+private:
+	typedef LPVOID(WINAPI* HeapAllocFunction)(HANDLE heap, DWORD flags, SIZE_T bytes);
+	typedef LPVOID(WINAPI* HeapReAllocFunction)(HANDLE heap, DWORD flags, LPVOID memory, SIZE_T bytes);
+
+	static LPVOID WINAPI CountingHeapAlloc(HANDLE heap, DWORD flags, SIZE_T bytes);
+	static LPVOID WINAPI CountingHeapReAlloc(HANDLE heap, DWORD flags, LPVOID memory, SIZE_T bytes);
+	static size_t ReplaceImport(HMODULE module, void* function, void* replacement);
+	static void CountAllocation();
+
+	static HeapAllocFunction m_heapAlloc;
+	static HeapReAllocFunction m_heapReAlloc;
+	static std::atomic<bool> m_counting;
+	static std::atomic<ULONGLONG> m_allocations;
+	static std::atomic<ULONGLONG> m_groups;
+	static std::atomic<ULONGLONG> m_groupAllocations;
+	static std::atomic<ULONGLONG> m_allocatingGroups;
+	static std::atomic<ULONGLONG> m_maxGroupAllocations;
+	static thread_local ULONGLONG m_threadAllocations;
+};
@@ -0,0 +1,506 @@
+#include "stdafx.h"
+#include "RarIndex.h"
+#include "RarClassifier.h"
+
+// File layout, each section is aligned to 8 bytes:
+//
+// Header: magic (4), version (4), row count (8).
+// Bitmaps: one bitmap per bitmap number, one bit per row, as 64-bit words.
+// Columns: size (8), last write time (8), SFX offset (8), file name offset
+//          in characters (8, one more than the row count), flags (4),
+//          error (1), RAR version (1).
+// File names: UTF-16, without terminators.
+
+namespace
+{
+	struct BitmapName {
+		const WCHAR* name;
+		RarIndex::bitmap bitmap;
+	};
+
+	const BitmapName bitmapNames[] = {
+		{ L"multivolume", RarIndex::bitmap_multivolume },
+		{ L"first_volume", RarIndex::bitmap_first_volume },
+		{ L"solid", RarIndex::bitmap_solid },
+		{ L"recovery_record", RarIndex::bitmap_recovery_record },
+		{ L"locked", RarIndex::bitmap_locked },
+		{ L"encrypted_headers", RarIndex::bitmap_encrypted_headers },
+		{ L"sfx", RarIndex::bitmap_sfx },
+		{ L"rar4", RarIndex::bitmap_rar4 },
+		{ L"rar5", RarIndex::bitmap_rar5 },
+	};
+
+	size_t AlignSize(size_t size)
+	{
+		return (size + 7) & ~size_t(7);
+	}
+
+	ULONGLONG FileTimeToULongLong(const FILETIME& fileTime)
+	{
+		return (static_cast<ULONGLONG>(fileTime.dwHighDateTime) << 32) | fileTime.dwLowDateTime;
+	}
+
+	// A number with an optional K, M, G or T suffix (powers of 1024).
+	bool ParseSize(const WCHAR* text, ULONGLONG& size)
+	{
+		WCHAR* end;
+		size = wcstoull(text, &end, 10);
+		if(end == text) {
+			return false;
+		}
+
+		int shift = 0;
+		switch(towupper(*end)) {
+		case L'K': shift = 10; end++; break;
+		case L'M': shift = 20; end++; break;
+		case L'G': shift = 30; end++; break;
+		case L'T': shift = 40; end++; break;
+		}
+
+		if(*end != L'\0' || size > (~0ULL >> shift)) {
+			return false;
+		}
+
+		size <<= shift;
+		return true;
+	}
+
+	// A date in the YYYY-MM-DD format, in UTC.
+	bool ParseDate(const WCHAR* text, ULONGLONG& fileTime)
+	{
+		SYSTEMTIME systemTime = {};
+		if(swscanf_s(text, L"%hu-%hu-%hu", &systemTime.wYear, &systemTime.wMonth, &systemTime.wDay) != 3) {
+			return false;
+		}
+
+		FILETIME result;
+		if(!::SystemTimeToFileTime(&systemTime, &result)) {
+			return false;
+		}
+
+		fileTime = FileTimeToULongLong(result);
+		return true;
+	}
+
+	// Narrows an inclusive range with a "> value" or a "< value" condition.
+	void NarrowRange(WCHAR op, ULONGLONG value, ULONGLONG& minValue, ULONGLONG& maxValue)
+	{
+		if(op == L'>') {
+			if(value == ~0ULL) {
+				minValue = 1;
+				maxValue = 0;
+			} else {
+				minValue = std::max(minValue, value + 1);
+			}
+		} else {
+			if(value == 0) {
+				minValue = 1;
+				maxValue = 0;
+			} else {
+				maxValue = std::min(maxValue, value - 1);
+			}
+		}
+	}
+}
+
+bool RarIndex::Build(const std::vector<CString>& fileNames, const TCHAR* indexFileName,
+	BuildStats& stats, bool fastReject /*= false*/)
+{
+	stats.validArchives = 0;
+	stats.invalidFiles = 0;
+	stats.failedArchives = 0;
+
+	size_t rowCount = fileNames.size();
+	Layout layout = GetLayout(rowCount);
+
+	std::vector<ULONGLONG> bitmaps(bitmap_count * layout.bitmapWords);
+	std::vector<ULONGLONG> sizes(rowCount);
+	std::vector<ULONGLONG> lastWriteTimes(rowCount);
+	std::vector<ULONGLONG> sfxOffsets(rowCount);
+	std::vector<ULONGLONG> fileNameOffsets(rowCount + 1);
+	std::vector<DWORD> flags(rowCount);
+	std::vector<BYTE> errors(rowCount);
+	std::vector<BYTE> versions(rowCount);
+
+	auto setBit = [&](bitmap bitmapNumber, size_t row) {
+		bitmaps[bitmapNumber * layout.bitmapWords + row / 64] |= 1ULL << (row % 64);
+	};
+
+	size_t fileNamesLength = 0;
+
+	for(size_t row = 0; row < rowCount; row++) {
+		fileNameOffsets[row] = fileNamesLength;
+		fileNamesLength += fileNames[row].GetLength();
+
+		if(fastReject &&
+			RarClassifier::Classify(fileNames[row]) == RarClassifier::result::not_archive) {
+			errors[row] = static_cast<BYTE>(RarFile::error::invalid_file);
+			stats.invalidFiles++;
+			continue;
+		}
+
+		RarFile file;
+		RarFile::error err = file.Open(fileNames[row]);
+		if(err != RarFile::error::success) {
+			errors[row] = static_cast<BYTE>(err);
+			if(err == RarFile::error::invalid_file) {
+				stats.invalidFiles++;
+			} else {
+				stats.failedArchives++;
+			}
+
+			continue;
+		}
+
+		const RarFile::FileIdentity& identity = file.GetFileIdentity();
+		sizes[row] = identity.size;
+		lastWriteTimes[row] = FileTimeToULongLong(identity.lastWriteTime);
+		sfxOffsets[row] = file.GetSFXOffset();
+		versions[row] = static_cast<BYTE>(file.GetRarVersion());
+
+		err = file.GetFlags(flags[row]);
+		if(err == RarFile::error::encrypted_archive) {
+			flags[row] = RarFile::encrypted_headers;
+		}
+
+		errors[row] = static_cast<BYTE>(err);
+
+		if(err == RarFile::error::success || err == RarFile::error::encrypted_archive) {
+			for(int i = 0; i < bitmap_sfx; i++) {
+				if(flags[row] & (1 << i)) {
+					setBit(static_cast<bitmap>(i), row);
+				}
+			}
+
+			if(file.IsSFX()) {
+				setBit(bitmap_sfx, row);
+			}
+
+			setBit(versions[row] == 4 ? bitmap_rar4 : bitmap_rar5, row);
+			setBit(bitmap_valid, row);
+			stats.validArchives++;
+		} else if(err == RarFile::error::invalid_file) {
+			stats.invalidFiles++;
+		} else {
+			stats.failedArchives++;
+		}
+
+		file.Close();
+	}
+
+	fileNameOffsets[rowCount] = fileNamesLength;
+
+	std::vector<BYTE> data(layout.fileNamesOffset + fileNamesLength * sizeof(WCHAR));
+	BYTE* p = data.data();
+
+	DWORD magic = m_magic;
+	DWORD version = m_version;
+	ULONGLONG rowCount64 = rowCount;
+	memcpy(p, &magic, sizeof(magic));
+	memcpy(p + 4, &version, sizeof(version));
+	memcpy(p + 8, &rowCount64, sizeof(rowCount64));
+
+	auto copyColumn = [&](size_t offset, const void* column, size_t size) {
+		if(size > 0) {
+			memcpy(p + offset, column, size);
+		}
+	};
+
+	copyColumn(layout.bitmapsOffset, bitmaps.data(), bitmaps.size() * sizeof(ULONGLONG));
+	copyColumn(layout.sizeOffset, sizes.data(), rowCount * sizeof(ULONGLONG));
+	copyColumn(layout.lastWriteTimeOffset, lastWriteTimes.data(), rowCount * sizeof(ULONGLONG));
+	copyColumn(layout.sfxOffsetOffset, sfxOffsets.data(), rowCount * sizeof(ULONGLONG));
+	copyColumn(layout.fileNameOffsetsOffset, fileNameOffsets.data(), (rowCount + 1) * sizeof(ULONGLONG));
+	copyColumn(layout.flagsOffset, flags.data(), rowCount * sizeof(DWORD));
+	copyColumn(layout.errorOffset, errors.data(), rowCount);
+	copyColumn(layout.versionOffset, versions.data(), rowCount);
+
+	for(size_t row = 0; row < rowCount; row++) {
+		copyColumn(layout.fileNamesOffset + fileNameOffsets[row] * sizeof(WCHAR),
+			fileNames[row].GetString(), fileNames[row].GetLength() * sizeof(WCHAR));
+	}
+
+	return WriteIndexFile(indexFileName, data.data(), data.size());
+}
+
+// Conditions are separated by commas or spaces:
+// flag        the flag is set: multivolume, first_volume, solid,
+//             recovery_record, locked, encrypted_headers, sfx, rar4, rar5
+// !flag       the flag is not set
+// invalid     the file couldn't be parsed (by default, such files never match)
+// size>N      also size<N, the number can have a K, M, G or T suffix
+// mtime>DATE  also mtime<DATE, the date is in the YYYY-MM-DD format (UTC)
+bool RarIndex::ParseQuery(const WCHAR* text, Query& query)
+{
+	query.requiredBitmaps = 1 << bitmap_valid;
+	query.excludedBitmaps = 0;
+	query.minSize = 0;
+	query.maxSize = ~0ULL;
+	query.minLastWriteTime = 0;
+	query.maxLastWriteTime = ~0ULL;
+
+	CString terms(text);
+	int position = 0;
+	CString term = terms.Tokenize(L", ", position);
+
+	while(position != -1) {
+		if(term == L"invalid") {
+			query.requiredBitmaps &= ~(1 << bitmap_valid);
+			query.excludedBitmaps |= 1 << bitmap_valid;
+		} else if(term.Left(5) == L"size>" || term.Left(5) == L"size<") {
+			ULONGLONG size;
+			if(!ParseSize(term.GetString() + 5, size)) {
+				return false;
+			}
+
+			NarrowRange(term[4], size, query.minSize, query.maxSize);
+		} else if(term.Left(6) == L"mtime>" || term.Left(6) == L"mtime<") {
+			ULONGLONG fileTime;
+			if(!ParseDate(term.GetString() + 6, fileTime)) {
+				return false;
+			}
+
+			NarrowRange(term[5], fileTime, query.minLastWriteTime, query.maxLastWriteTime);
+		} else {
+			bool negated = term[0] == L'!';
+			const WCHAR* name = term.GetString() + (negated ? 1 : 0);
+
+			auto it = std::find_if(std::begin(bitmapNames), std::end(bitmapNames), [=](const BitmapName& entry) {
+				return wcscmp(entry.name, name) == 0;
+			});
+
+			if(it == std::end(bitmapNames)) {
+				return false;
+			}
+
+			if(negated) {
+				query.excludedBitmaps |= 1 << it->bitmap;
+			} else {
+				query.requiredBitmaps |= 1 << it->bitmap;
+			}
+		}
+
+		term = terms.Tokenize(L", ", position);
+	}
+
+	return true;
+}
+
+bool RarIndex::Open(const TCHAR* indexFileName)
+{
+	assert(!m_open);
+
+	CAtlFile indexFile;
+	HRESULT hr = indexFile.Create(indexFileName, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	hr = m_fileMapping.MapFile(indexFile);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	const BYTE* p = m_fileMapping;
+	size_t size = m_fileMapping.GetMappingSize();
+
+	DWORD magic, version;
+	ULONGLONG rowCount;
+	if(size < 16) {
+		m_fileMapping.Unmap();
+		return false;
+	}
+
+	memcpy(&magic, p, sizeof(magic));
+	memcpy(&version, p + 4, sizeof(version));
+	memcpy(&rowCount, p + 8, sizeof(rowCount));
+
+	// Each row takes more than 32 bytes, the bound makes sure that the
+	// layout computation can't overflow.
+	if(magic != m_magic || version != m_version || rowCount > size / 32) {
+		m_fileMapping.Unmap();
+		return false;
+	}
+
+	Layout layout = GetLayout(rowCount);
+	if(layout.fileNamesOffset > size) {
+		m_fileMapping.Unmap();
+		return false;
+	}
+
+	m_rowCount = static_cast<size_t>(rowCount);
+	m_layout = layout;
+
+	// The file name offsets must be ascending and inside the file.
+	const ULONGLONG* fileNameOffsets = GetColumn<ULONGLONG>(m_layout.fileNameOffsetsOffset);
+	size_t fileNamesLength = (size - m_layout.fileNamesOffset) / sizeof(WCHAR);
+	for(size_t row = 0; row < m_rowCount; row++) {
+		if(fileNameOffsets[row] > fileNameOffsets[row + 1]) {
+			m_fileMapping.Unmap();
+			return false;
+		}
+	}
+
+	if(fileNameOffsets[0] != 0 || fileNameOffsets[m_rowCount] > fileNamesLength) {
+		m_fileMapping.Unmap();
+		return false;
+	}
+
+	m_open = true;
+
+	return true;
+}
+
+size_t RarIndex::GetRowCount()
+{
+	assert(m_open);
+	return m_rowCount;
+}
+
+void RarIndex::Select(const Query& query, std::vector<size_t>& rows)
+{
+	assert(m_open);
+
+	rows.clear();
+
+	const ULONGLONG* bitmaps = GetColumn<ULONGLONG>(m_layout.bitmapsOffset);
+	const ULONGLONG* sizes = GetColumn<ULONGLONG>(m_layout.sizeOffset);
+	const ULONGLONG* lastWriteTimes = GetColumn<ULONGLONG>(m_layout.lastWriteTimeOffset);
+
+	bool checkSize = query.minSize != 0 || query.maxSize != ~0ULL;
+	bool checkLastWriteTime = query.minLastWriteTime != 0 || query.maxLastWriteTime != ~0ULL;
+
+	for(size_t word = 0; word < m_layout.bitmapWords; word++) {
+		ULONGLONG bits = ~0ULL;
+
+		for(int i = 0; i < bitmap_count && bits; i++) {
+			if(query.requiredBitmaps & (1 << i)) {
+				bits &= bitmaps[i * m_layout.bitmapWords + word];
+			} else if(query.excludedBitmaps & (1 << i)) {
+				bits &= ~bitmaps[i * m_layout.bitmapWords + word];
+			}
+		}
+
+		// Clear the bits past the last row.
+		if(word == m_layout.bitmapWords - 1 && m_rowCount % 64 != 0) {
+			bits &= (1ULL << (m_rowCount % 64)) - 1;
+		}
+
+		for(size_t bit = 0; bits; bit++, bits >>= 1) {
+			if(!(bits & 1)) {
+				continue;
+			}
+
+			size_t row = word * 64 + bit;
+
+			if(checkSize && (sizes[row] < query.minSize || sizes[row] > query.maxSize)) {
+				continue;
+			}
+
+			if(checkLastWriteTime && (lastWriteTimes[row] < query.minLastWriteTime ||
+				lastWriteTimes[row] > query.maxLastWriteTime)) {
+				continue;
+			}
+
+			rows.push_back(row);
+		}
+	}
+}
+
+void RarIndex::GetRow(size_t row, Row& result)
+{
+	assert(m_open && row < m_rowCount);
+
+	ULONGLONG lastWriteTime = GetColumn<ULONGLONG>(m_layout.lastWriteTimeOffset)[row];
+
+	result.fileName = GetFileName(row);
+	result.error = static_cast<RarFile::error>(GetColumn<BYTE>(m_layout.errorOffset)[row]);
+	result.rarVersion = GetColumn<BYTE>(m_layout.versionOffset)[row];
+	result.sfxOffset = GetColumn<ULONGLONG>(m_layout.sfxOffsetOffset)[row];
+	result.flags = GetColumn<DWORD>(m_layout.flagsOffset)[row];
+	result.size = GetColumn<ULONGLONG>(m_layout.sizeOffset)[row];
+	result.lastWriteTime.dwLowDateTime = static_cast<DWORD>(lastWriteTime);
+	result.lastWriteTime.dwHighDateTime = static_cast<DWORD>(lastWriteTime >> 32);
+}
+
+CString RarIndex::GetFileName(size_t row)
+{
+	assert(m_open && row < m_rowCount);
+
+	const ULONGLONG* fileNameOffsets = GetColumn<ULONGLONG>(m_layout.fileNameOffsetsOffset);
+	const WCHAR* fileNames = GetColumn<WCHAR>(m_layout.fileNamesOffset);
+
+	return CString(fileNames + fileNameOffsets[row],
+		static_cast<int>(fileNameOffsets[row + 1] - fileNameOffsets[row]));
+}
+
+void RarIndex::Close()
+{
+	if(m_open) {
+		m_fileMapping.Unmap();
+		m_open = false;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+// The index is written to a temporary file next to it, which replaces it
+// once it's complete, so that a failed build leaves the previous index
+// intact.
+bool RarIndex::WriteIndexFile(const TCHAR* indexFileName, const BYTE* data, size_t size)
+{
+	CString tempFileName = indexFileName;
+	tempFileName += L".tmp";
+
+	bool written = false;
+
+	{
+		CAtlFile indexFile;
+		HRESULT hr = indexFile.Create(tempFileName, GENERIC_WRITE, 0, CREATE_ALWAYS);
+		if(FAILED(hr)) {
+			return false;
+		}
+
+		// A single write is limited to 4 GB.
+		written = true;
+		for(size_t offset = 0; written && offset < size; offset += m_writeChunkSize) {
+			DWORD chunkSize = m_writeChunkSize;
+			if(size - offset < chunkSize) {
+				chunkSize = static_cast<DWORD>(size - offset);
+			}
+
+			written = SUCCEEDED(indexFile.Write(data + offset, chunkSize));
+		}
+
+		if(written) {
+			written = SUCCEEDED(indexFile.Flush());
+		}
+	}
+
+	if(!written || !::MoveFileEx(tempFileName, indexFileName, MOVEFILE_REPLACE_EXISTING)) {
+		::DeleteFile(tempFileName);
+		return false;
+	}
+
+	return true;
+}
+
+RarIndex::Layout RarIndex::GetLayout(ULONGLONG rowCount)
+{
+	size_t rows = static_cast<size_t>(rowCount);
+
+	Layout layout;
+	layout.bitmapWords = (rows + 63) / 64;
+	layout.bitmapsOffset = 16;
+	layout.sizeOffset = layout.bitmapsOffset + bitmap_count * layout.bitmapWords * sizeof(ULONGLONG);
+	layout.lastWriteTimeOffset = layout.sizeOffset + rows * sizeof(ULONGLONG);
+	layout.sfxOffsetOffset = layout.lastWriteTimeOffset + rows * sizeof(ULONGLONG);
+	layout.fileNameOffsetsOffset = layout.sfxOffsetOffset + rows * sizeof(ULONGLONG);
+	layout.flagsOffset = layout.fileNameOffsetsOffset + (rows + 1) * sizeof(ULONGLONG);
+	layout.errorOffset = AlignSize(layout.flagsOffset + rows * sizeof(DWORD));
+	layout.versionOffset = layout.errorOffset + rows;
+	layout.fileNamesOffset = AlignSize(layout.versionOffset + rows);
+
+	return layout;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "RarFile.h"
+
+// Columnar index of archive attributes, used to answer queries about a
+// large set of archives without opening them again. Each attribute is
+// stored as a separate column, and each flag as a bitmap with one bit per
+// archive, so that a query is mostly a few passes of bitwise operations.
+class RarIndex {
+public:
+	// Bitmap numbers. The first ones match the bits of RarFile::flags.
+	enum bitmap {
+		bitmap_multivolume,
+		bitmap_first_volume,
+		bitmap_solid,
+		bitmap_recovery_record,
+		bitmap_locked,
+		bitmap_encrypted_headers,
+		bitmap_sfx,
+		bitmap_rar4,
+		bitmap_rar5,
+		bitmap_valid, // the archive was parsed successfully
+		bitmap_count
+	};
+
+	struct Row {
+		CString fileName;
+		RarFile::error error;
+		int rarVersion;
+		ULONGLONG sfxOffset;
+		DWORD flags;
+		ULONGLONG size;
+		FILETIME lastWriteTime;
+	};
+
+	// All the conditions must match. The masks are bitmap numbers as bits.
+	struct Query {
+		DWORD requiredBitmaps;
+		DWORD excludedBitmaps;
+		ULONGLONG minSize;
+		ULONGLONG maxSize;
+		ULONGLONG minLastWriteTime;
+		ULONGLONG maxLastWriteTime;
+	};
+
+	struct BuildStats {
+		size_t validArchives; // parsed, including archives with encrypted headers
+		size_t invalidFiles; // not archives
+		size_t failedArchives; // couldn't be read, e.g. the file couldn't be opened
+	};
+
+	RarIndex() = default;
+	~RarIndex() = default;
+
+	RarIndex(const RarIndex&) = delete;
+	RarIndex& operator=(const RarIndex&) = delete;
+
+	// With fastReject, the files which RarClassifier rejects aren't opened.
+	static bool Build(const std::vector<CString>& fileNames, const TCHAR* indexFileName,
+		BuildStats& stats, bool fastReject = false);
+	static bool ParseQuery(const WCHAR* text, Query& query);
+
+	bool Open(const TCHAR* indexFileName);
+	size_t GetRowCount();
+	void Select(const Query& query, std::vector<size_t>& rows);
+	void GetRow(size_t row, Row& result);
+	CString GetFileName(size_t row);
+	void Close();
+
+private:
+	struct Layout {
+		size_t bitmapWords;
+		size_t bitmapsOffset;
+		size_t sizeOffset;
+		size_t lastWriteTimeOffset;
+		size_t sfxOffsetOffset;
+		size_t flagsOffset;
+		size_t fileNameOffsetsOffset;
+		size_t errorOffset;
+		size_t versionOffset;
+		size_t fileNamesOffset;
+	};
+
+	static Layout GetLayout(ULONGLONG rowCount);
+	static bool WriteIndexFile(const TCHAR* indexFileName, const BYTE* data, size_t size);
+
+	template<typename T>
+	const T* GetColumn(size_t offset)
+	{
+		return reinterpret_cast<const T*>(static_cast<const BYTE*>(m_fileMapping) + offset);
+	}
+
+	bool m_open = false;
+	CAtlFileMapping<BYTE> m_fileMapping;
+	size_t m_rowCount;
+	Layout m_layout;
+
+	static const DWORD m_magic = 0x49524152; // "RARI"
+	static const DWORD m_version = 1;
+	static const DWORD m_writeChunkSize = 0x1000000;
+};
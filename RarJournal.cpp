@@ -0,0 +1,250 @@
+#include "stdafx.h"
+#include "RarJournal.h"
+#include "crc32.h"
+
+// File layout:
+//
+// Header: magic (4), version (4).
+// Record: record size (4), path length in characters (2), path (UTF-16),
+//         offset (8), patch size (2), original bytes, patched bytes,
+//         CRC32 of the record fields after the record size (4).
+//
+// A record with a bad CRC is the result of an interrupted write, it and
+// the records after it were never committed.
+
+namespace
+{
+	template<typename T>
+	void AppendValue(std::vector<BYTE>& buffer, T value)
+	{
+		const BYTE* p = reinterpret_cast<const BYTE*>(&value);
+		buffer.insert(buffer.end(), p, p + sizeof(T));
+	}
+
+	template<typename T>
+	T ReadValue(const BYTE* p)
+	{
+		T value;
+		memcpy(&value, p, sizeof(T));
+		return value;
+	}
+}
+
+bool RarJournal::Create(const TCHAR* fileName)
+{
+	assert(!m_open);
+
+	HRESULT hr = m_file.Create(fileName,
+		GENERIC_WRITE,
+		FILE_SHARE_READ,
+		CREATE_ALWAYS);
+
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	m_buffer.clear();
+	AppendValue(m_buffer, m_magic);
+	AppendValue(m_buffer, m_version);
+
+	m_open = true;
+
+	return Commit();
+}
+
+void RarJournal::Append(const TCHAR* archiveFullPath, const RarSession::Patch& patch)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	assert(m_open);
+	assert(patch.originalData.size() == patch.patchedData.size());
+
+	size_t pathLength = wcslen(archiveFullPath);
+	WORD patchSize = static_cast<WORD>(patch.patchedData.size());
+
+	size_t recordStart = m_buffer.size();
+	AppendValue(m_buffer, DWORD(0)); // record size, set below
+
+	AppendValue(m_buffer, static_cast<WORD>(pathLength));
+	const BYTE* path = reinterpret_cast<const BYTE*>(archiveFullPath);
+	m_buffer.insert(m_buffer.end(), path, path + pathLength * sizeof(WCHAR));
+	AppendValue(m_buffer, patch.offset);
+	AppendValue(m_buffer, patchSize);
+	m_buffer.insert(m_buffer.end(), patch.originalData.begin(), patch.originalData.end());
+	m_buffer.insert(m_buffer.end(), patch.patchedData.begin(), patch.patchedData.end());
+
+	const BYTE* recordData = m_buffer.data() + recordStart + sizeof(DWORD);
+	size_t recordDataSize = m_buffer.size() - recordStart - sizeof(DWORD);
+	DWORD hashValue = crc32(recordData, recordDataSize);
+	AppendValue(m_buffer, hashValue);
+
+	DWORD recordSize = static_cast<DWORD>(m_buffer.size() - recordStart - sizeof(DWORD));
+	memcpy(m_buffer.data() + recordStart, &recordSize, sizeof(DWORD));
+}
+
+bool RarJournal::Commit()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	assert(m_open);
+
+	if(m_buffer.empty()) {
+		return true;
+	}
+
+	HRESULT hr = m_file.Write(m_buffer.data(), static_cast<DWORD>(m_buffer.size()));
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	m_buffer.clear();
+
+	return SUCCEEDED(m_file.Flush());
+}
+
+void RarJournal::Close()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if(m_open) {
+		m_file.Close();
+		m_buffer.clear();
+		m_open = false;
+	}
+}
+
+bool RarJournal::Rollback(const TCHAR* fileName, RollbackStats& stats)
+{
+	stats = RollbackStats{};
+
+	CAtlFile file;
+	HRESULT hr = file.Create(fileName,
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		OPEN_EXISTING);
+
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	DWORD header[2];
+	hr = file.Read(header, sizeof(header));
+	if(FAILED(hr) || header[0] != m_magic || header[1] != m_version) {
+		return false;
+	}
+
+	std::vector<BYTE> record;
+
+	for(;;) {
+		DWORD recordSize;
+		DWORD bytesRead;
+		hr = file.Read(&recordSize, sizeof(recordSize), bytesRead);
+		if(FAILED(hr) || bytesRead != sizeof(recordSize)) {
+			break;
+		}
+
+		if(recordSize <= sizeof(DWORD)) {
+			break;
+		}
+
+		record.resize(recordSize);
+		hr = file.Read(record.data(), recordSize, bytesRead);
+		if(FAILED(hr) || bytesRead != recordSize) {
+			break;
+		}
+
+		const BYTE* recordData = record.data();
+		size_t recordDataSize = recordSize - sizeof(DWORD);
+		if(crc32(recordData, recordDataSize) != ReadValue<DWORD>(recordData + recordDataSize)) {
+			break;
+		}
+
+		if(!RollbackRecord(recordData, recordDataSize, stats)) {
+			stats.failed++;
+		}
+	}
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+bool RarJournal::RollbackRecord(const BYTE* record, size_t recordSize, RollbackStats& stats)
+{
+	const BYTE* recordEnd = record + recordSize;
+	const BYTE* p = record;
+
+	if(recordEnd - p < static_cast<ptrdiff_t>(sizeof(WORD))) {
+		return false;
+	}
+
+	WORD pathLength = ReadValue<WORD>(p);
+	p += sizeof(WORD);
+
+	if(recordEnd - p < static_cast<ptrdiff_t>(pathLength * sizeof(WCHAR) + sizeof(ULONGLONG) + sizeof(WORD))) {
+		return false;
+	}
+
+	CString archiveFileName(reinterpret_cast<const WCHAR*>(p), pathLength);
+	p += pathLength * sizeof(WCHAR);
+
+	ULONGLONG offset = ReadValue<ULONGLONG>(p);
+	p += sizeof(ULONGLONG);
+
+	WORD patchSize = ReadValue<WORD>(p);
+	p += sizeof(WORD);
+
+	if(recordEnd - p != patchSize * 2) {
+		return false;
+	}
+
+	const BYTE* originalData = p;
+	const BYTE* patchedData = p + patchSize;
+
+	CAtlFile archiveFile;
+	HRESULT hr = archiveFile.Create(archiveFileName,
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ,
+		OPEN_EXISTING);
+
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	std::vector<BYTE> currentData(patchSize);
+
+	hr = archiveFile.Seek(offset, FILE_BEGIN);
+	if(SUCCEEDED(hr)) {
+		hr = archiveFile.Read(currentData.data(), patchSize);
+	}
+
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	if(memcmp(currentData.data(), originalData, patchSize) == 0) {
+		stats.notApplied++;
+		return true;
+	}
+
+	if(memcmp(currentData.data(), patchedData, patchSize) != 0) {
+		return false; // modified by something else
+	}
+
+	hr = archiveFile.Seek(offset, FILE_BEGIN);
+	if(SUCCEEDED(hr)) {
+		hr = archiveFile.Write(originalData, patchSize);
+	}
+
+	if(SUCCEEDED(hr)) {
+		hr = archiveFile.Flush();
+	}
+
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	stats.restored++;
+	return true;
+}
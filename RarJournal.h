@@ -0,0 +1,44 @@
+#pragma once
+
+#include "RarSession.h"
+
+// Write-ahead journal of archive patches. Each record holds the archive
+// path, the patch offset, and the original and the patched bytes. Records
+// are buffered and written in groups with a single flush per group, which
+// must happen before the patches of the group are applied. Append, Commit
+// and Close can be called from several threads, a commit writes the
+// records of all the threads.
+class RarJournal {
+public:
+	struct RollbackStats {
+		size_t restored;
+		size_t notApplied;
+		size_t failed;
+	};
+
+	RarJournal() = default;
+	~RarJournal() = default;
+
+	RarJournal(const RarJournal&) = delete;
+	RarJournal& operator=(const RarJournal&) = delete;
+
+	bool Create(const TCHAR* fileName);
+	// The path should be a full path, so that the journal doesn't depend on
+	// the current directory.
+	void Append(const TCHAR* archiveFullPath, const RarSession::Patch& patch);
+	bool Commit();
+	void Close();
+
+	static bool Rollback(const TCHAR* fileName, RollbackStats& stats);
+
+private:
+	static bool RollbackRecord(const BYTE* record, size_t recordSize, RollbackStats& stats);
+
+	bool m_open = false;
+	CAtlFile m_file;
+	std::vector<BYTE> m_buffer;
+	std::mutex m_mutex;
+
+	static const DWORD m_magic = 0x4A524152; // "RARJ"
+	static const DWORD m_version = 1;
+};
@@ -0,0 +1,700 @@
+#include "stdafx.h"
+#include "RarListing.h"
+#include "RarFormat.h"
+#include "crc32.h"
+
+// RAR 5.0 header: CRC32 (4), header size (vint), header type (vint),
+// header flags (vint), extra area size (vint, flag 0x01), data size (vint,
+// flag 0x02), type specific fields, extra area. The header size covers
+// everything after the header size field, and the CRC32 covers everything
+// after the CRC32 field.
+//
+// The quick open record is a service header named "QO", its data holds
+// copies of other headers: CRC32 (4), record size (vint), flags (vint),
+// offset back from the quick open header (vint), header size (vint),
+// header data.
+
+namespace
+{
+	const ULONGLONG headerTypeFile = 2;
+	const ULONGLONG headerTypeService = 3;
+	const ULONGLONG headerTypeEndOfArchive = 5;
+
+	const int headerTypeFile4 = 0x74;
+
+	const size_t maxQuickOpenSize = 0x10000000;
+}
+
+RarFile::error RarListing::List(const TCHAR* fileName, std::vector<Entry>& entries, Stats& stats)
+{
+	stats.archiveFlags = 0;
+	stats.cachedHeaders = 0;
+	stats.readHeaders = 0;
+	stats.bytesRead = 0;
+
+	RarFile rarFile;
+	RarFile::error err = rarFile.Open(fileName);
+	if(err != RarFile::error::success) {
+		return err;
+	}
+
+	int rarVersion = rarFile.GetRarVersion();
+
+	RarFile::MainHeader mainHeader;
+	err = rarFile.GetMainHeader(mainHeader);
+	if(err != RarFile::error::success) {
+		return err;
+	}
+
+	RarFile::FileIdentity fileIdentity = rarFile.GetFileIdentity();
+	stats.archiveFlags = mainHeader.flags;
+	rarFile.Close();
+
+	// The main header was parsed from the beginning of the file, the rest
+	// of the headers can be anywhere in it.
+	CAtlFile file;
+	HRESULT hr = file.Create(fileName, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING);
+	if(FAILED(hr)) {
+		return RarFile::error::open_failed;
+	}
+
+	RarFile::FileIdentity currentIdentity;
+	if(!RarFile::FileIdentity::Query(file, currentIdentity)) {
+		return RarFile::error::open_failed;
+	}
+
+	if(currentIdentity != fileIdentity) {
+		return RarFile::error::file_changed;
+	}
+
+	std::vector<Entry> result;
+	if(rarVersion == RarFormat4::version) {
+		err = ListRar4(file, mainHeader, fileIdentity.size, result, stats);
+	} else {
+		err = ListRar5(file, mainHeader, fileIdentity.size, result, stats);
+	}
+
+	if(err != RarFile::error::success) {
+		return err;
+	}
+
+	entries = std::move(result);
+
+	return RarFile::error::success;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+RarFile::error RarListing::ListRar5(CAtlFile& file, const RarFile::MainHeader& mainHeader,
+	ULONGLONG fileSize, std::vector<Entry>& entries, Stats& stats)
+{
+	// A damaged quick open record is ignored, all the headers are read from
+	// the archive instead.
+	std::map<ULONGLONG, std::vector<BYTE>> cachedHeaders;
+	if(mainHeader.quickOpenOffset != 0) {
+		ULONGLONG quickOpenPosition = mainHeader.offset + mainHeader.quickOpenOffset;
+		if(!ReadQuickOpen(file, quickOpenPosition, cachedHeaders, stats)) {
+			cachedHeaders.clear();
+		}
+	}
+
+	std::vector<BYTE> buffer;
+	ULONGLONG position = mainHeader.offset + mainHeader.size;
+
+	while(position < fileSize) {
+		const BYTE* data;
+		size_t size;
+
+		auto it = cachedHeaders.find(position);
+		if(it != cachedHeaders.end()) {
+			data = it->second.data();
+			size = it->second.size();
+			stats.cachedHeaders++;
+		} else {
+			if(!ReadHeader(file, position, buffer, stats)) {
+				return RarFile::error::invalid_file;
+			}
+
+			data = buffer.data();
+			size = buffer.size();
+			stats.readHeaders++;
+		}
+
+		BlockHeader header;
+		if(!ParseHeader(data, size, header)) {
+			return RarFile::error::invalid_file;
+		}
+
+		if(header.type == headerTypeEndOfArchive) {
+			break;
+		}
+
+		if(header.type == headerTypeFile) {
+			FileHeader fileHeader;
+			if(!ParseFileHeader(header, fileHeader)) {
+				return RarFile::error::invalid_file;
+			}
+
+			// Compression information: version (bits 0-5), solid (bit 6),
+			// method (bits 7-9), dictionary size as 128 KB << N (bits 10-14).
+			Entry entry;
+			entry.headerOffset = position;
+			entry.fileName = CA2W(fileHeader.name, CP_UTF8);
+			entry.size = fileHeader.unpackedSize;
+			entry.packedSize = header.dataSize;
+			entry.directory = (fileHeader.fileFlags & 0x0001) != 0;
+			entry.compressionMethod = static_cast<int>((fileHeader.compressionInfo >> 7) & 0x07);
+			entry.dictionarySize = 0x20000ULL << ((fileHeader.compressionInfo >> 10) & 0x1F);
+			entries.push_back(entry);
+		}
+
+		ULONGLONG nextPosition = position + header.size + header.dataSize;
+		if(nextPosition <= position) {
+			return RarFile::error::invalid_file;
+		}
+
+		position = nextPosition;
+	}
+
+	return RarFile::error::success;
+}
+
+// RAR 4.x header: CRC16 (2), type (1), flags (2), header size (2), and
+// the data size (4) if flag 0x8000 is set. The CRC16 is the low half of
+// the CRC32 of everything after the CRC field.
+//
+// File header (type 0x74): packed size (4), unpacked size (4), host OS
+// (1), file CRC32 (4), mtime (4), version (1), method (1), name size (2),
+// attributes (4), high packed and unpacked sizes (4 + 4, flag 0x0100),
+// name. Flags 0x00E0 hold the dictionary size, or 0x00E0 for a directory.
+RarFile::error RarListing::ListRar4(CAtlFile& file, const RarFile::MainHeader& mainHeader,
+	ULONGLONG fileSize, std::vector<Entry>& entries, Stats& stats)
+{
+	if(mainHeader.flags & RarFile::encrypted_headers) {
+		return RarFile::error::encrypted_archive;
+	}
+
+	std::vector<BYTE> buffer;
+	ULONGLONG position = mainHeader.offset + mainHeader.size;
+
+	while(position < fileSize) {
+		if(!ReadRar4Header(file, position, buffer, stats)) {
+			return RarFile::error::invalid_file;
+		}
+
+		stats.readHeaders++;
+
+		RarFile::Block block;
+		if(!RarFormat4::ParseBlock(buffer.data(), buffer.data() + buffer.size(), block)) {
+			return RarFile::error::invalid_file;
+		}
+
+		if(block.endOfArchive) {
+			break;
+		}
+
+		if(block.type == headerTypeFile4) {
+			Entry entry;
+			if(!ParseRar4FileHeader(buffer.data(), buffer.size(), entry)) {
+				return RarFile::error::invalid_file;
+			}
+
+			entry.headerOffset = position;
+			entry.packedSize = block.dataSize;
+			entries.push_back(entry);
+		}
+
+		ULONGLONG nextPosition = position + block.headerSize + block.dataSize;
+		if(nextPosition <= position) {
+			return RarFile::error::invalid_file;
+		}
+
+		position = nextPosition;
+	}
+
+	return RarFile::error::success;
+}
+
+bool RarListing::ReadHeader(CAtlFile& file, ULONGLONG position, std::vector<BYTE>& buffer, Stats& stats)
+{
+	// The CRC32 and the header size, which takes up to 3 bytes.
+	BYTE prefix[7];
+
+	HRESULT hr = file.Seek(position, FILE_BEGIN);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	DWORD bytesRead;
+	hr = file.Read(prefix, sizeof(prefix), bytesRead);
+	if(FAILED(hr) || bytesRead <= sizeof(DWORD)) {
+		return false;
+	}
+
+	stats.bytesRead += bytesRead;
+
+	ULONGLONG headerSize;
+	size_t vintSize;
+	if(!RarFormat5::GetVint(prefix + sizeof(DWORD), prefix + bytesRead, headerSize, vintSize)) {
+		return false;
+	}
+
+	if(headerSize > m_maxHeaderSize) {
+		return false;
+	}
+
+	size_t totalSize = sizeof(DWORD) + vintSize + static_cast<size_t>(headerSize);
+	size_t prefixSize = std::min<size_t>(bytesRead, totalSize);
+
+	buffer.resize(totalSize);
+	memcpy(buffer.data(), prefix, prefixSize);
+
+	if(totalSize > prefixSize) {
+		hr = file.Seek(position + prefixSize, FILE_BEGIN);
+		if(FAILED(hr)) {
+			return false;
+		}
+
+		hr = file.Read(buffer.data() + prefixSize, static_cast<DWORD>(totalSize - prefixSize));
+		if(FAILED(hr)) {
+			return false;
+		}
+
+		stats.bytesRead += totalSize - prefixSize;
+	}
+
+	return true;
+}
+
+bool RarListing::ParseHeader(const BYTE* data, size_t size, BlockHeader& header)
+{
+	if(size <= sizeof(DWORD)) {
+		return false;
+	}
+
+	DWORD headerCrc;
+	memcpy(&headerCrc, data, sizeof(DWORD));
+
+	const BYTE* dataEnd = data + size;
+	const BYTE* headerPtr = data + sizeof(DWORD);
+
+	ULONGLONG headerSize;
+	size_t bytesRead;
+	if(!RarFormat5::GetVint(headerPtr, dataEnd, headerSize, bytesRead)) {
+		return false;
+	}
+
+	headerPtr += bytesRead;
+
+	if(headerSize == 0 || headerSize > static_cast<size_t>(dataEnd - headerPtr)) {
+		return false;
+	}
+
+	const BYTE* headerEnd = headerPtr + static_cast<size_t>(headerSize);
+
+	if(crc32(data + sizeof(DWORD), headerEnd - (data + sizeof(DWORD))) != headerCrc) {
+		return false;
+	}
+
+	if(!RarFormat5::GetVint(headerPtr, headerEnd, header.type, bytesRead)) {
+		return false;
+	}
+
+	headerPtr += bytesRead;
+
+	if(!RarFormat5::GetVint(headerPtr, headerEnd, header.flags, bytesRead)) {
+		return false;
+	}
+
+	headerPtr += bytesRead;
+
+	ULONGLONG extraAreaSize = 0;
+	if(header.flags & 0x0001) {
+		if(!RarFormat5::GetVint(headerPtr, headerEnd, extraAreaSize, bytesRead)) {
+			return false;
+		}
+
+		headerPtr += bytesRead;
+	}
+
+	header.dataSize = 0;
+	if(header.flags & 0x0002) {
+		if(!RarFormat5::GetVint(headerPtr, headerEnd, header.dataSize, bytesRead)) {
+			return false;
+		}
+
+		headerPtr += bytesRead;
+	}
+
+	if(extraAreaSize > static_cast<size_t>(headerEnd - headerPtr)) {
+		return false;
+	}
+
+	header.fields = headerPtr;
+	header.fieldsEnd = headerEnd - static_cast<size_t>(extraAreaSize);
+	header.size = headerEnd - data;
+	return true;
+}
+
+// File and service headers: file flags (vint), unpacked size (vint),
+// attributes (vint), mtime (4, file flag 0x02), data CRC32 (4, file flag
+// 0x04), compression information (vint), host OS (vint), name length
+// (vint), name (UTF-8).
+bool RarListing::ParseFileHeader(const BlockHeader& header, FileHeader& fileHeader)
+{
+	const BYTE* fieldPtr = header.fields;
+	const BYTE* fieldsEnd = header.fieldsEnd;
+	size_t bytesRead;
+
+	if(!RarFormat5::GetVint(fieldPtr, fieldsEnd, fileHeader.fileFlags, bytesRead)) {
+		return false;
+	}
+
+	fieldPtr += bytesRead;
+
+	if(!RarFormat5::GetVint(fieldPtr, fieldsEnd, fileHeader.unpackedSize, bytesRead)) {
+		return false;
+	}
+
+	fieldPtr += bytesRead;
+
+	ULONGLONG value;
+	if(!RarFormat5::GetVint(fieldPtr, fieldsEnd, value, bytesRead)) {
+		return false; // attributes
+	}
+
+	fieldPtr += bytesRead;
+
+	fileHeader.dataCrc = 0;
+	if(fileHeader.fileFlags & 0x0002) {
+		if(static_cast<size_t>(fieldsEnd - fieldPtr) < sizeof(DWORD)) {
+			return false;
+		}
+
+		fieldPtr += sizeof(DWORD);
+	}
+
+	if(fileHeader.fileFlags & 0x0004) {
+		if(static_cast<size_t>(fieldsEnd - fieldPtr) < sizeof(DWORD)) {
+			return false;
+		}
+
+		memcpy(&fileHeader.dataCrc, fieldPtr, sizeof(DWORD));
+		fieldPtr += sizeof(DWORD);
+	}
+
+	if(!RarFormat5::GetVint(fieldPtr, fieldsEnd, fileHeader.compressionInfo, bytesRead)) {
+		return false;
+	}
+
+	fieldPtr += bytesRead;
+
+	if(!RarFormat5::GetVint(fieldPtr, fieldsEnd, value, bytesRead)) {
+		return false; // host OS
+	}
+
+	fieldPtr += bytesRead;
+
+	ULONGLONG nameLength;
+	if(!RarFormat5::GetVint(fieldPtr, fieldsEnd, nameLength, bytesRead)) {
+		return false;
+	}
+
+	fieldPtr += bytesRead;
+
+	if(nameLength > static_cast<size_t>(fieldsEnd - fieldPtr)) {
+		return false;
+	}
+
+	fileHeader.name = CStringA(reinterpret_cast<const char*>(fieldPtr), static_cast<int>(nameLength));
+	return true;
+}
+
+bool RarListing::ReadQuickOpen(CAtlFile& file, ULONGLONG position,
+	std::map<ULONGLONG, std::vector<BYTE>>& cachedHeaders, Stats& stats)
+{
+	std::vector<BYTE> buffer;
+	if(!ReadHeader(file, position, buffer, stats)) {
+		return false;
+	}
+
+	BlockHeader header;
+	if(!ParseHeader(buffer.data(), buffer.size(), header) || header.type != headerTypeService) {
+		return false;
+	}
+
+	FileHeader fileHeader;
+	if(!ParseFileHeader(header, fileHeader) || strcmp(fileHeader.name, "QO") != 0) {
+		return false;
+	}
+
+	// Only stored data can be used, the compression method is in bits 7-9.
+	if(((fileHeader.compressionInfo >> 7) & 0x07) != 0 || header.dataSize > maxQuickOpenSize) {
+		return false;
+	}
+
+	size_t dataSize = static_cast<size_t>(header.dataSize);
+	std::vector<BYTE> data(dataSize);
+
+	if(dataSize > 0) {
+		HRESULT hr = file.Seek(position + header.size, FILE_BEGIN);
+		if(FAILED(hr)) {
+			return false;
+		}
+
+		hr = file.Read(data.data(), static_cast<DWORD>(dataSize));
+		if(FAILED(hr)) {
+			return false;
+		}
+
+		stats.bytesRead += dataSize;
+	}
+
+	if((fileHeader.fileFlags & 0x0004) && crc32(data.data(), dataSize) != fileHeader.dataCrc) {
+		return false;
+	}
+
+	const BYTE* recordPtr = data.data();
+	const BYTE* dataEnd = recordPtr + dataSize;
+
+	while(recordPtr < dataEnd) {
+		if(static_cast<size_t>(dataEnd - recordPtr) <= sizeof(DWORD)) {
+			return false;
+		}
+
+		DWORD recordCrc;
+		memcpy(&recordCrc, recordPtr, sizeof(DWORD));
+
+		const BYTE* crcStart = recordPtr + sizeof(DWORD);
+		const BYTE* fieldPtr = crcStart;
+
+		ULONGLONG recordSize;
+		size_t bytesRead;
+		if(!RarFormat5::GetVint(fieldPtr, dataEnd, recordSize, bytesRead)) {
+			return false;
+		}
+
+		fieldPtr += bytesRead;
+
+		if(recordSize > static_cast<size_t>(dataEnd - fieldPtr)) {
+			return false;
+		}
+
+		const BYTE* recordEnd = fieldPtr + static_cast<size_t>(recordSize);
+
+		if(crc32(crcStart, recordEnd - crcStart) != recordCrc) {
+			return false;
+		}
+
+		ULONGLONG value;
+		if(!RarFormat5::GetVint(fieldPtr, recordEnd, value, bytesRead)) {
+			return false; // flags
+		}
+
+		fieldPtr += bytesRead;
+
+		ULONGLONG offset;
+		if(!RarFormat5::GetVint(fieldPtr, recordEnd, offset, bytesRead) || offset > position) {
+			return false;
+		}
+
+		fieldPtr += bytesRead;
+
+		ULONGLONG headerSize;
+		if(!RarFormat5::GetVint(fieldPtr, recordEnd, headerSize, bytesRead)) {
+			return false;
+		}
+
+		fieldPtr += bytesRead;
+
+		if(headerSize > static_cast<size_t>(recordEnd - fieldPtr)) {
+			return false;
+		}
+
+		cachedHeaders[position - offset].assign(fieldPtr, fieldPtr + static_cast<size_t>(headerSize));
+
+		recordPtr = recordEnd;
+	}
+
+	// The walk passes the quick open header too, it doesn't have to be read again.
+	cachedHeaders[position] = std::move(buffer);
+
+	return true;
+}
+
+bool RarListing::ReadRar4Header(CAtlFile& file, ULONGLONG position, std::vector<BYTE>& buffer, Stats& stats)
+{
+	// The CRC16, the type, the flags and the header size.
+	BYTE prefix[7];
+
+	HRESULT hr = file.Seek(position, FILE_BEGIN);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	hr = file.Read(prefix, sizeof(prefix));
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	stats.bytesRead += sizeof(prefix);
+
+	WORD headerCrc, headerSize;
+	memcpy(&headerCrc, prefix, sizeof(WORD));
+	memcpy(&headerSize, prefix + 0x05, sizeof(WORD));
+	if(headerSize < sizeof(prefix)) {
+		return false;
+	}
+
+	buffer.resize(headerSize);
+	memcpy(buffer.data(), prefix, sizeof(prefix));
+
+	if(headerSize > sizeof(prefix)) {
+		hr = file.Read(buffer.data() + sizeof(prefix), headerSize - sizeof(prefix));
+		if(FAILED(hr)) {
+			return false;
+		}
+
+		stats.bytesRead += headerSize - sizeof(prefix);
+	}
+
+	return (crc32(buffer.data() + sizeof(WORD), headerSize - sizeof(WORD)) & 0xFFFF) == headerCrc;
+}
+
+bool RarListing::ParseRar4FileHeader(const BYTE* data, size_t size, Entry& entry)
+{
+	if(size < 0x20) {
+		return false;
+	}
+
+	WORD headerFlags, nameSize;
+	DWORD unpackedSize;
+	memcpy(&headerFlags, data + 0x03, sizeof(WORD));
+	memcpy(&unpackedSize, data + 0x0B, sizeof(DWORD));
+	memcpy(&nameSize, data + 0x1A, sizeof(WORD));
+	BYTE method = data[0x19];
+
+	entry.size = unpackedSize;
+
+	size_t namePosition = 0x20;
+	if(headerFlags & 0x0100) {
+		if(size < 0x28) {
+			return false;
+		}
+
+		DWORD highUnpackedSize;
+		memcpy(&highUnpackedSize, data + 0x24, sizeof(DWORD));
+		entry.size |= static_cast<ULONGLONG>(highUnpackedSize) << 32;
+		namePosition = 0x28;
+	}
+
+	if(nameSize > size - namePosition) {
+		return false;
+	}
+
+	const char* name = reinterpret_cast<const char*>(data + namePosition);
+	if(headerFlags & 0x0200) {
+		entry.fileName = DecodeRar4Name(name, nameSize);
+	} else {
+		entry.fileName = CString(CA2W(CStringA(name, nameSize), CP_OEMCP));
+	}
+
+	// Methods 0x30 (stored) to 0x35 (best).
+	entry.directory = (headerFlags & 0x00E0) == 0x00E0;
+	entry.compressionMethod = method >= 0x30 && method <= 0x35 ? method - 0x30 : 0;
+	entry.dictionarySize = entry.directory ? 0 : 0x10000ULL << ((headerFlags >> 5) & 0x07);
+	return true;
+}
+
+// A Unicode name is stored as an OEM name, a zero byte and the UTF-16 name
+// encoded against the OEM one. Without the zero byte, the name is UTF-8.
+CString RarListing::DecodeRar4Name(const char* name, size_t nameSize)
+{
+	size_t oemSize = strnlen(name, nameSize);
+	if(oemSize == nameSize) {
+		return CString(CA2W(CStringA(name, static_cast<int>(nameSize)), CP_UTF8));
+	}
+
+	const BYTE* oemName = reinterpret_cast<const BYTE*>(name);
+	const BYTE* encoded = oemName + oemSize + 1;
+	size_t encodedSize = nameSize - oemSize - 1;
+	if(encodedSize == 0) {
+		return CString(CA2W(CStringA(name, static_cast<int>(oemSize)), CP_OEMCP));
+	}
+
+	// Each pair of flag bits selects how the next characters are stored:
+	// 0 - the low byte, 1 - the low byte with the common high byte, 2 - both
+	// bytes, 3 - a run of characters copied from the OEM name, with an
+	// optional correction added to the low byte.
+	std::wstring result;
+	size_t position = 0;
+	BYTE highByte = encoded[position++];
+	BYTE flags = 0;
+	int flagBits = 0;
+
+	while(position < encodedSize && result.size() < nameSize) {
+		if(flagBits == 0) {
+			flags = encoded[position++];
+			flagBits = 8;
+		}
+
+		switch(flags >> 6) {
+		case 0:
+			if(position >= encodedSize) {
+				break;
+			}
+
+			result += static_cast<WCHAR>(encoded[position++]);
+			break;
+
+		case 1:
+			if(position >= encodedSize) {
+				break;
+			}
+
+			result += static_cast<WCHAR>(encoded[position++] | (highByte << 8));
+			break;
+
+		case 2:
+			if(position + 1 >= encodedSize) {
+				position = encodedSize;
+				break;
+			}
+
+			result += static_cast<WCHAR>(encoded[position] | (encoded[position + 1] << 8));
+			position += 2;
+			break;
+
+		case 3: {
+			if(position >= encodedSize) {
+				break;
+			}
+
+			size_t length = encoded[position++];
+			if(length & 0x80) {
+				if(position >= encodedSize) {
+					break;
+				}
+
+				BYTE correction = encoded[position++];
+				for(length = (length & 0x7F) + 2; length > 0 && result.size() < oemSize; length--) {
+					BYTE low = static_cast<BYTE>(oemName[result.size()] + correction);
+					result += static_cast<WCHAR>(low | (highByte << 8));
+				}
+			} else {
+				for(length += 2; length > 0 && result.size() < oemSize; length--) {
+					result += static_cast<WCHAR>(oemName[result.size()]);
+				}
+			}
+
+			break;
+		}
+		}
+
+		flags <<= 2;
+		flagBits -= 2;
+	}
+
+	return CString(result.c_str(), static_cast<int>(result.size()));
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "RarFile.h"
+
+// Lists the files of a RAR archive. The headers are walked from the main
+// header to the end of archive header, the file data isn't read. When a
+// RAR 5.0 archive has a quick open record, the headers cached in it are
+// read with a single read near the end of the archive, and only the
+// headers which aren't cached are read from their position in the archive.
+class RarListing {
+public:
+	struct Entry {
+		CString fileName;
+		ULONGLONG size;
+		ULONGLONG packedSize;
+		bool directory;
+		int compressionMethod; // 0 (stored) to 5 (best)
+		ULONGLONG dictionarySize;
+		ULONGLONG headerOffset; // of the file header, from the beginning of the file
+	};
+
+	struct Stats {
+		DWORD archiveFlags; // RarFile::flags of the main header
+		size_t cachedHeaders; // served from the quick open record of RAR 5.0
+		size_t readHeaders; // read from the archive
+		ULONGLONG bytesRead; // not including the main header
+	};
+
+	static RarFile::error List(const TCHAR* fileName, std::vector<Entry>& entries, Stats& stats);
+
+private:
+	// The common fields of a RAR 5.0 header.
+	struct BlockHeader {
+		ULONGLONG type;
+		ULONGLONG flags;
+		ULONGLONG dataSize;
+		const BYTE* fields; // the type specific fields
+		const BYTE* fieldsEnd; // the extra area or the end of the header
+		size_t size; // the total size, including the CRC
+	};
+
+	// The fields of a file or a service header.
+	struct FileHeader {
+		ULONGLONG fileFlags;
+		ULONGLONG unpackedSize;
+		DWORD dataCrc; // if file flag 0x04 is set
+		ULONGLONG compressionInfo;
+		CStringA name; // UTF-8
+	};
+
+	static RarFile::error ListRar4(CAtlFile& file, const RarFile::MainHeader& mainHeader,
+		ULONGLONG fileSize, std::vector<Entry>& entries, Stats& stats);
+	static RarFile::error ListRar5(CAtlFile& file, const RarFile::MainHeader& mainHeader,
+		ULONGLONG fileSize, std::vector<Entry>& entries, Stats& stats);
+	static bool ReadHeader(CAtlFile& file, ULONGLONG position, std::vector<BYTE>& buffer, Stats& stats);
+	static bool ParseHeader(const BYTE* data, size_t size, BlockHeader& header);
+	static bool ParseFileHeader(const BlockHeader& header, FileHeader& fileHeader);
+	static bool ReadQuickOpen(CAtlFile& file, ULONGLONG position,
+		std::map<ULONGLONG, std::vector<BYTE>>& cachedHeaders, Stats& stats);
+	static bool ReadRar4Header(CAtlFile& file, ULONGLONG position, std::vector<BYTE>& buffer, Stats& stats);
+	static bool ParseRar4FileHeader(const BYTE* data, size_t size, Entry& entry);
+	static CString DecodeRar4Name(const char* name, size_t nameSize);
+
+	static const size_t m_maxHeaderSize = 0x200000;
+};
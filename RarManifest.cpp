@@ -0,0 +1,106 @@
+#include "stdafx.h"
+#include "RarManifest.h"
+
+// Reads a UTF-8 text file. Empty lines are ignored, and both LF and CRLF
+// line endings are accepted.
+bool RarManifest::Load(const TCHAR* fileName, std::vector<CString>& fileNames)
+{
+	CAtlFile file;
+	HRESULT hr = file.Create(fileName, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	ULONGLONG size;
+	hr = file.GetSize(size);
+	if(FAILED(hr) || size > 0xFFFFFFFF) {
+		return false;
+	}
+
+	std::vector<char> data(static_cast<size_t>(size));
+	if(size > 0) {
+		hr = file.Read(data.data(), static_cast<DWORD>(size));
+		if(FAILED(hr)) {
+			return false;
+		}
+	}
+
+	auto start = data.begin();
+	if(data.size() >= 3 && memcmp(data.data(), "\xEF\xBB\xBF", 3) == 0) {
+		start += 3;
+	}
+
+	std::vector<CString> result;
+
+	while(start != data.end()) {
+		auto end = std::find(start, data.end(), '\n');
+
+		auto lineEnd = end;
+		if(lineEnd != start && *(lineEnd - 1) == '\r') {
+			--lineEnd;
+		}
+
+		if(lineEnd != start) {
+			CStringA line(&*start, static_cast<int>(lineEnd - start));
+			result.push_back(CString(CA2W(line, CP_UTF8)));
+		}
+
+		start = (end == data.end()) ? end : end + 1;
+	}
+
+	fileNames = std::move(result);
+
+	return true;
+}
+
+bool RarManifest::Save(const TCHAR* fileName, const std::vector<CString>& fileNames)
+{
+	CAtlFile file;
+	HRESULT hr = file.Create(fileName, GENERIC_WRITE, 0, CREATE_ALWAYS);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	CStringA data;
+	for(const auto& name : fileNames) {
+		data += CW2A(name, CP_UTF8);
+		data += "\r\n";
+	}
+
+	if(!data.IsEmpty()) {
+		hr = file.Write(data.GetString(), data.GetLength());
+		if(FAILED(hr)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Keeps only the paths which belong to the given shard. The assignment
+// depends only on the path, so shards stay stable when the list is reordered.
+void RarManifest::FilterShard(std::vector<CString>& fileNames, unsigned int shardIndex, unsigned int shardCount)
+{
+	assert(shardCount > 0 && shardIndex < shardCount);
+
+	auto it = std::remove_if(fileNames.begin(), fileNames.end(), [=](const CString& fileName) {
+		return HashPath(fileName) % shardCount != shardIndex;
+	});
+
+	fileNames.erase(it, fileNames.end());
+}
+
+// 64-bit FNV-1a of the UTF-16 path. Paths are hashed as given, so all the
+// runs which share a manifest or a checkpoint must spell the paths the same.
+ULONGLONG RarManifest::HashPath(const TCHAR* fileName)
+{
+	ULONGLONG hash = 0xCBF29CE484222325;
+
+	for(const TCHAR* p = fileName; *p; p++) {
+		WCHAR c = *p;
+		hash = (hash ^ (c & 0xFF)) * 0x100000001B3;
+		hash = (hash ^ (c >> 8)) * 0x100000001B3;
+	}
+
+	return hash;
+}
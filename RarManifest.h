@@ -0,0 +1,11 @@
+#pragma once
+
+// A list of archive paths, one per line, which can be split into shards so
+// that several processes or machines can work on the same list.
+class RarManifest {
+public:
+	static bool Load(const TCHAR* fileName, std::vector<CString>& fileNames);
+	static bool Save(const TCHAR* fileName, const std::vector<CString>& fileNames);
+	static void FilterShard(std::vector<CString>& fileNames, unsigned int shardIndex, unsigned int shardCount);
+	static ULONGLONG HashPath(const TCHAR* fileName);
+};
@@ -0,0 +1,636 @@
+#include "stdafx.h"
+#include "RarNameIndex.h"
+#include "RarListing.h"
+
+// File layout, each section is aligned to 8 bytes:
+//
+// Header: magic (4), version (4), archive count (8), entry count (8),
+//         trigram count (8), posting count (8).
+// Archive columns: size (8), last write time (8), file index (8), name
+//         offset in characters (8, one more than the archive count),
+//         volume serial number (4), error (1).
+// Entry columns: header offset (8), name offset in characters (8, one more
+//         than the entry count), archive number (4).
+// Trigrams: keys in ascending order (4), posting offset (8, one more than
+//         the trigram count).
+// Postings: entry numbers (4), in ascending order for each trigram.
+// Names: UTF-16, without terminators, the archive names and the entry
+//        names share the same character array.
+//
+// A trigram key holds a byte for each lowercased character: characters
+// below 0x80 as they are, and others hashed to 0x80-0xFE. Different
+// characters can share a key, the names of the candidates are compared.
+
+namespace
+{
+	size_t AlignSize(size_t size)
+	{
+		return (size + 7) & ~size_t(7);
+	}
+
+	ULONGLONG FileTimeToULongLong(const FILETIME& fileTime)
+	{
+		return (static_cast<ULONGLONG>(fileTime.dwHighDateTime) << 32) | fileTime.dwLowDateTime;
+	}
+
+	DWORD GetGramKey(const WCHAR* text)
+	{
+		DWORD key = 0;
+		for(size_t i = 0; i < 3; i++) {
+			WCHAR c = text[i];
+			BYTE value = c < 0x80 ? static_cast<BYTE>(c) : static_cast<BYTE>(0x80 | (c % 0x7F));
+			key = (key << 8) | value;
+		}
+
+		return key;
+	}
+
+	// Archives whose listing failed this way are read again by the next
+	// update, even if their identity didn't change.
+	bool IsTransientError(RarFile::error err)
+	{
+		return err == RarFile::error::open_failed || err == RarFile::error::file_changed;
+	}
+}
+
+bool RarNameIndex::Update(const std::vector<CString>& fileNames, const TCHAR* indexFileName,
+	UpdateStats& stats)
+{
+	stats.reusedArchives = 0;
+	stats.listedArchives = 0;
+	stats.failedArchives = 0;
+
+	// A missing or damaged index is rebuilt from the archives.
+	RarNameIndex previous;
+	std::map<CString, size_t> previousArchives;
+	if(previous.Open(indexFileName)) {
+		for(size_t i = 0; i < previous.m_archiveCount; i++) {
+			CString key = previous.GetArchiveFileName(i);
+			key.MakeLower();
+			previousArchives[key] = i;
+		}
+	}
+
+	std::vector<Archive> archives(fileNames.size());
+
+	for(size_t i = 0; i < fileNames.size(); i++) {
+		Archive& archive = archives[i];
+		archive.fileName = fileNames[i];
+		archive.identityKnown = QueryIdentity(fileNames[i], archive.identity);
+
+		if(archive.identityKnown) {
+			CString key = fileNames[i];
+			key.MakeLower();
+
+			auto it = previousArchives.find(key);
+			if(it != previousArchives.end()) {
+				Archive previousArchive;
+				previous.GetArchive(it->second, previousArchive);
+
+				if(previousArchive.identityKnown && previousArchive.identity == archive.identity) {
+					archive.error = previousArchive.error;
+					archive.entryNames.swap(previousArchive.entryNames);
+					archive.headerOffsets.swap(previousArchive.headerOffsets);
+					stats.reusedArchives++;
+					continue;
+				}
+			}
+		}
+
+		LoadArchive(fileNames[i], archive);
+
+		stats.listedArchives++;
+		if(archive.error != RarFile::error::success) {
+			stats.failedArchives++;
+		}
+	}
+
+	// The previous index is replaced by the new one.
+	previous.Close();
+
+	return Write(archives, indexFileName);
+}
+
+bool RarNameIndex::Open(const TCHAR* indexFileName)
+{
+	assert(!m_open);
+
+	CAtlFile indexFile;
+	HRESULT hr = indexFile.Create(indexFileName, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	hr = m_fileMapping.MapFile(indexFile);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	const BYTE* p = m_fileMapping;
+	size_t size = m_fileMapping.GetMappingSize();
+
+	if(size < m_headerSize) {
+		m_fileMapping.Unmap();
+		return false;
+	}
+
+	DWORD magic, version;
+	ULONGLONG archiveCount, entryCount, gramCount, postingCount;
+	memcpy(&magic, p, sizeof(magic));
+	memcpy(&version, p + 4, sizeof(version));
+	memcpy(&archiveCount, p + 8, sizeof(archiveCount));
+	memcpy(&entryCount, p + 16, sizeof(entryCount));
+	memcpy(&gramCount, p + 24, sizeof(gramCount));
+	memcpy(&postingCount, p + 32, sizeof(postingCount));
+
+	// Each archive takes more than 32 bytes, each entry more than 16, each
+	// trigram more than 8 and each posting 4. The bounds make sure that the
+	// layout computation can't overflow.
+	if(magic != m_magic || version != m_version || archiveCount > size / 32 ||
+		entryCount > size / 16 || gramCount > size / 8 || postingCount > size / 4) {
+		m_fileMapping.Unmap();
+		return false;
+	}
+
+	Layout layout = GetLayout(archiveCount, entryCount, gramCount, postingCount);
+	if(layout.namesOffset > size) {
+		m_fileMapping.Unmap();
+		return false;
+	}
+
+	m_archiveCount = static_cast<size_t>(archiveCount);
+	m_entryCount = static_cast<size_t>(entryCount);
+	m_gramCount = static_cast<size_t>(gramCount);
+	m_layout = layout;
+
+	// The offsets of each table must be ascending, and end inside the
+	// names or at the end of the postings.
+	auto checkOffsets = [this](size_t offsetsOffset, size_t count, ULONGLONG first, ULONGLONG last) {
+		const ULONGLONG* offsets = GetColumn<ULONGLONG>(offsetsOffset);
+		for(size_t i = 0; i < count; i++) {
+			if(offsets[i] > offsets[i + 1]) {
+				return false;
+			}
+		}
+
+		return offsets[0] >= first && offsets[count] <= last;
+	};
+
+	size_t namesLength = (size - m_layout.namesOffset) / sizeof(WCHAR);
+	if(!checkOffsets(m_layout.archiveNameOffsetsOffset, m_archiveCount, 0, namesLength) ||
+		!checkOffsets(m_layout.entryNameOffsetsOffset, m_entryCount, 0, namesLength) ||
+		!checkOffsets(m_layout.gramPostingOffsetsOffset, m_gramCount, 0, postingCount)) {
+		m_fileMapping.Unmap();
+		return false;
+	}
+
+	const DWORD* entryArchives = GetColumn<DWORD>(m_layout.entryArchiveOffset);
+	for(size_t entry = 0; entry < m_entryCount; entry++) {
+		if(entryArchives[entry] >= m_archiveCount) {
+			m_fileMapping.Unmap();
+			return false;
+		}
+	}
+
+	m_open = true;
+
+	return true;
+}
+
+size_t RarNameIndex::GetArchiveCount()
+{
+	assert(m_open);
+	return m_archiveCount;
+}
+
+size_t RarNameIndex::GetEntryCount()
+{
+	assert(m_open);
+	return m_entryCount;
+}
+
+void RarNameIndex::Find(const WCHAR* pattern, std::vector<size_t>& entries)
+{
+	assert(m_open);
+
+	entries.clear();
+
+	std::wstring foldedPattern = FoldName(pattern, wcslen(pattern));
+	bool wholePath = foldedPattern.find(L'\\') != std::wstring::npos;
+
+	if(wholePath || foldedPattern.size() < m_gramLength) {
+		for(size_t entry = 0; entry < m_entryCount; entry++) {
+			if(Matches(entry, foldedPattern, wholePath)) {
+				entries.push_back(entry);
+			}
+		}
+
+		return;
+	}
+
+	const DWORD* gramKeys = GetColumn<DWORD>(m_layout.gramKeysOffset);
+	const ULONGLONG* postingOffsets = GetColumn<ULONGLONG>(m_layout.gramPostingOffsetsOffset);
+	const DWORD* postings = GetColumn<DWORD>(m_layout.postingsOffset);
+
+	std::vector<DWORD> keys;
+	GetGramKeys(foldedPattern, 0, keys);
+
+	// The posting list of each trigram, the shortest one gives the first
+	// candidates and the others only remove candidates.
+	std::vector<std::pair<const DWORD*, const DWORD*>> lists;
+	for(DWORD key : keys) {
+		const DWORD* gram = std::lower_bound(gramKeys, gramKeys + m_gramCount, key);
+		if(gram == gramKeys + m_gramCount || *gram != key) {
+			return;
+		}
+
+		size_t gramNumber = gram - gramKeys;
+		lists.emplace_back(postings + postingOffsets[gramNumber], postings + postingOffsets[gramNumber + 1]);
+	}
+
+	std::sort(lists.begin(), lists.end(), [](const std::pair<const DWORD*, const DWORD*>& a,
+		const std::pair<const DWORD*, const DWORD*>& b) {
+		return a.second - a.first < b.second - b.first;
+	});
+
+	std::vector<DWORD> candidates(lists[0].first, lists[0].second);
+	for(size_t i = 1; i < lists.size() && !candidates.empty(); i++) {
+		const DWORD* position = lists[i].first;
+		const DWORD* end = lists[i].second;
+
+		auto last = std::remove_if(candidates.begin(), candidates.end(), [&](DWORD candidate) {
+			position = std::lower_bound(position, end, candidate);
+			return position == end || *position != candidate;
+		});
+
+		candidates.erase(last, candidates.end());
+	}
+
+	for(DWORD candidate : candidates) {
+		if(candidate < m_entryCount && Matches(candidate, foldedPattern, false)) {
+			entries.push_back(candidate);
+		}
+	}
+}
+
+CString RarNameIndex::GetArchiveFileName(size_t archive)
+{
+	assert(m_open && archive < m_archiveCount);
+	return GetString(m_layout.archiveNameOffsetsOffset, archive);
+}
+
+RarFile::error RarNameIndex::GetArchiveError(size_t archive)
+{
+	assert(m_open && archive < m_archiveCount);
+	return static_cast<RarFile::error>(GetColumn<BYTE>(m_layout.archiveErrorOffset)[archive]);
+}
+
+size_t RarNameIndex::GetEntryArchive(size_t entry)
+{
+	assert(m_open && entry < m_entryCount);
+	return GetColumn<DWORD>(m_layout.entryArchiveOffset)[entry];
+}
+
+CString RarNameIndex::GetEntryName(size_t entry)
+{
+	assert(m_open && entry < m_entryCount);
+	return GetString(m_layout.entryNameOffsetsOffset, entry);
+}
+
+ULONGLONG RarNameIndex::GetEntryHeaderOffset(size_t entry)
+{
+	assert(m_open && entry < m_entryCount);
+	return GetColumn<ULONGLONG>(m_layout.entryHeaderOffsetsOffset)[entry];
+}
+
+void RarNameIndex::Close()
+{
+	if(m_open) {
+		m_fileMapping.Unmap();
+		m_open = false;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+RarNameIndex::Layout RarNameIndex::GetLayout(ULONGLONG archiveCount, ULONGLONG entryCount,
+	ULONGLONG gramCount, ULONGLONG postingCount)
+{
+	size_t archives = static_cast<size_t>(archiveCount);
+	size_t entries = static_cast<size_t>(entryCount);
+	size_t grams = static_cast<size_t>(gramCount);
+	size_t postings = static_cast<size_t>(postingCount);
+
+	Layout layout;
+	layout.archiveSizeOffset = m_headerSize;
+	layout.archiveLastWriteTimeOffset = layout.archiveSizeOffset + archives * sizeof(ULONGLONG);
+	layout.archiveFileIndexOffset = layout.archiveLastWriteTimeOffset + archives * sizeof(ULONGLONG);
+	layout.archiveNameOffsetsOffset = layout.archiveFileIndexOffset + archives * sizeof(ULONGLONG);
+	layout.archiveVolumeSerialNumberOffset = layout.archiveNameOffsetsOffset + (archives + 1) * sizeof(ULONGLONG);
+	layout.archiveErrorOffset = layout.archiveVolumeSerialNumberOffset + archives * sizeof(DWORD);
+	layout.entryHeaderOffsetsOffset = AlignSize(layout.archiveErrorOffset + archives);
+	layout.entryNameOffsetsOffset = layout.entryHeaderOffsetsOffset + entries * sizeof(ULONGLONG);
+	layout.entryArchiveOffset = layout.entryNameOffsetsOffset + (entries + 1) * sizeof(ULONGLONG);
+	layout.gramKeysOffset = AlignSize(layout.entryArchiveOffset + entries * sizeof(DWORD));
+	layout.gramPostingOffsetsOffset = AlignSize(layout.gramKeysOffset + grams * sizeof(DWORD));
+	layout.postingsOffset = layout.gramPostingOffsetsOffset + (grams + 1) * sizeof(ULONGLONG);
+	layout.namesOffset = AlignSize(layout.postingsOffset + postings * sizeof(DWORD));
+
+	return layout;
+}
+
+// No read access is needed for the identity, an unchanged archive isn't
+// read at all.
+bool RarNameIndex::QueryIdentity(const CString& fileName, RarFile::FileIdentity& identity)
+{
+	CAtlFile file;
+	HRESULT hr = file.Create(fileName, FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, OPEN_EXISTING);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	return RarFile::FileIdentity::Query(file, identity);
+}
+
+void RarNameIndex::LoadArchive(const CString& fileName, Archive& archive)
+{
+	archive.entryNames.clear();
+	archive.headerOffsets.clear();
+
+	if(!archive.identityKnown) {
+		archive.error = RarFile::error::open_failed;
+		return;
+	}
+
+	std::vector<RarListing::Entry> entries;
+	RarListing::Stats stats;
+	archive.error = RarListing::List(fileName, entries, stats);
+	if(archive.error != RarFile::error::success) {
+		return;
+	}
+
+	archive.entryNames.reserve(entries.size());
+	archive.headerOffsets.reserve(entries.size());
+	for(auto& entry : entries) {
+		entry.fileName.Replace(L'/', L'\\');
+		archive.entryNames.push_back(entry.fileName);
+		archive.headerOffsets.push_back(entry.headerOffset);
+	}
+}
+
+bool RarNameIndex::Write(const std::vector<Archive>& archives, const TCHAR* indexFileName)
+{
+	size_t archiveCount = archives.size();
+	size_t entryCount = 0;
+	for(const auto& archive : archives) {
+		entryCount += archive.entryNames.size();
+	}
+
+	// Entry numbers are stored in 32 bits.
+	if(entryCount > 0xFFFFFFFF) {
+		return false;
+	}
+
+	// The trigrams are counted first, so that the posting lists can be
+	// filled in place, in entry order.
+	std::unordered_map<DWORD, ULONGLONG> gramPositions;
+	std::vector<DWORD> keys;
+	ULONGLONG postingCount = 0;
+
+	for(const auto& archive : archives) {
+		for(const auto& entryName : archive.entryNames) {
+			std::wstring foldedName = FoldName(entryName, entryName.GetLength());
+			GetGramKeys(foldedName, GetFileNamePart(foldedName), keys);
+
+			for(DWORD key : keys) {
+				gramPositions[key]++;
+			}
+
+			postingCount += keys.size();
+		}
+	}
+
+	std::vector<DWORD> gramKeys;
+	gramKeys.reserve(gramPositions.size());
+	for(const auto& gram : gramPositions) {
+		gramKeys.push_back(gram.first);
+	}
+
+	std::sort(gramKeys.begin(), gramKeys.end());
+
+	size_t gramCount = gramKeys.size();
+	std::vector<ULONGLONG> gramPostingOffsets(gramCount + 1);
+	for(size_t i = 0; i < gramCount; i++) {
+		ULONGLONG count = gramPositions[gramKeys[i]];
+		gramPositions[gramKeys[i]] = gramPostingOffsets[i];
+		gramPostingOffsets[i + 1] = gramPostingOffsets[i] + count;
+	}
+
+	Layout layout = GetLayout(archiveCount, entryCount, gramCount, postingCount);
+
+	size_t namesLength = 0;
+	for(const auto& archive : archives) {
+		namesLength += archive.fileName.GetLength();
+		for(const auto& entryName : archive.entryNames) {
+			namesLength += entryName.GetLength();
+		}
+	}
+
+	std::vector<BYTE> data(layout.namesOffset + namesLength * sizeof(WCHAR));
+	BYTE* p = data.data();
+
+	DWORD magic = m_magic;
+	DWORD version = m_version;
+	ULONGLONG counts[] = { archiveCount, entryCount, gramCount, postingCount };
+	memcpy(p, &magic, sizeof(magic));
+	memcpy(p + 4, &version, sizeof(version));
+	memcpy(p + 8, counts, sizeof(counts));
+
+	ULONGLONG* archiveSizes = reinterpret_cast<ULONGLONG*>(p + layout.archiveSizeOffset);
+	ULONGLONG* archiveLastWriteTimes = reinterpret_cast<ULONGLONG*>(p + layout.archiveLastWriteTimeOffset);
+	ULONGLONG* archiveFileIndexes = reinterpret_cast<ULONGLONG*>(p + layout.archiveFileIndexOffset);
+	ULONGLONG* archiveNameOffsets = reinterpret_cast<ULONGLONG*>(p + layout.archiveNameOffsetsOffset);
+	DWORD* archiveVolumeSerialNumbers = reinterpret_cast<DWORD*>(p + layout.archiveVolumeSerialNumberOffset);
+	BYTE* archiveErrors = p + layout.archiveErrorOffset;
+	ULONGLONG* entryHeaderOffsets = reinterpret_cast<ULONGLONG*>(p + layout.entryHeaderOffsetsOffset);
+	ULONGLONG* entryNameOffsets = reinterpret_cast<ULONGLONG*>(p + layout.entryNameOffsetsOffset);
+	DWORD* entryArchives = reinterpret_cast<DWORD*>(p + layout.entryArchiveOffset);
+	DWORD* postings = reinterpret_cast<DWORD*>(p + layout.postingsOffset);
+	WCHAR* names = reinterpret_cast<WCHAR*>(p + layout.namesOffset);
+
+	if(gramCount > 0) {
+		memcpy(p + layout.gramKeysOffset, gramKeys.data(), gramCount * sizeof(DWORD));
+	}
+
+	memcpy(p + layout.gramPostingOffsetsOffset, gramPostingOffsets.data(), (gramCount + 1) * sizeof(ULONGLONG));
+
+	auto copyName = [&](const CString& name, ULONGLONG& offset) {
+		offset = names - reinterpret_cast<WCHAR*>(p + layout.namesOffset);
+		memcpy(names, name.GetString(), name.GetLength() * sizeof(WCHAR));
+		names += name.GetLength();
+	};
+
+	// The archive names come first, so that their offsets end where the
+	// entry names begin.
+	for(size_t i = 0; i < archiveCount; i++) {
+		const Archive& archive = archives[i];
+		copyName(archive.fileName, archiveNameOffsets[i]);
+
+		if(archive.identityKnown) {
+			archiveSizes[i] = archive.identity.size;
+			archiveLastWriteTimes[i] = FileTimeToULongLong(archive.identity.lastWriteTime);
+			archiveFileIndexes[i] = (static_cast<ULONGLONG>(archive.identity.fileIndexHigh) << 32) |
+				archive.identity.fileIndexLow;
+			archiveVolumeSerialNumbers[i] = archive.identity.volumeSerialNumber;
+		}
+
+		archiveErrors[i] = static_cast<BYTE>(archive.identityKnown ?
+			archive.error : RarFile::error::open_failed);
+	}
+
+	copyName(CString(), archiveNameOffsets[archiveCount]);
+
+	size_t entry = 0;
+	for(size_t i = 0; i < archiveCount; i++) {
+		const Archive& archive = archives[i];
+		for(size_t j = 0; j < archive.entryNames.size(); j++, entry++) {
+			const CString& entryName = archive.entryNames[j];
+			copyName(entryName, entryNameOffsets[entry]);
+			entryHeaderOffsets[entry] = archive.headerOffsets[j];
+			entryArchives[entry] = static_cast<DWORD>(i);
+
+			std::wstring foldedName = FoldName(entryName, entryName.GetLength());
+			GetGramKeys(foldedName, GetFileNamePart(foldedName), keys);
+
+			for(DWORD key : keys) {
+				postings[gramPositions[key]++] = static_cast<DWORD>(entry);
+			}
+		}
+	}
+
+	copyName(CString(), entryNameOffsets[entryCount]);
+
+	return WriteIndexFile(indexFileName, data.data(), data.size());
+}
+
+// The index is written to a temporary file next to it, which replaces it
+// once it's complete, so that an interrupted update leaves the previous
+// index intact.
+bool RarNameIndex::WriteIndexFile(const TCHAR* indexFileName, const BYTE* data, size_t size)
+{
+	CString tempFileName = indexFileName;
+	tempFileName += L".tmp";
+
+	bool written = false;
+
+	{
+		CAtlFile indexFile;
+		HRESULT hr = indexFile.Create(tempFileName, GENERIC_WRITE, 0, CREATE_ALWAYS);
+		if(FAILED(hr)) {
+			return false;
+		}
+
+		// A single write is limited to 4 GB.
+		written = true;
+		for(size_t offset = 0; written && offset < size; offset += m_writeChunkSize) {
+			DWORD chunkSize = m_writeChunkSize;
+			if(size - offset < chunkSize) {
+				chunkSize = static_cast<DWORD>(size - offset);
+			}
+
+			written = SUCCEEDED(indexFile.Write(data + offset, chunkSize));
+		}
+
+		if(written) {
+			written = SUCCEEDED(indexFile.Flush());
+		}
+	}
+
+	if(!written || !::MoveFileEx(tempFileName, indexFileName, MOVEFILE_REPLACE_EXISTING)) {
+		::DeleteFile(tempFileName);
+		return false;
+	}
+
+	return true;
+}
+
+// Lowercase, with backslashes as path separators.
+std::wstring RarNameIndex::FoldName(const WCHAR* name, size_t length)
+{
+	std::wstring result(name, length);
+	for(auto& c : result) {
+		c = c == L'/' ? L'\\' : towlower(c);
+	}
+
+	return result;
+}
+
+size_t RarNameIndex::GetFileNamePart(const std::wstring& name)
+{
+	size_t separator = name.rfind(L'\\');
+	return separator == std::wstring::npos ? 0 : separator + 1;
+}
+
+// The distinct trigram keys of the name from start, in ascending order.
+void RarNameIndex::GetGramKeys(const std::wstring& name, size_t start, std::vector<DWORD>& keys)
+{
+	keys.clear();
+	for(size_t i = start; i + m_gramLength <= name.size(); i++) {
+		keys.push_back(GetGramKey(name.c_str() + i));
+	}
+
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+}
+
+void RarNameIndex::GetArchive(size_t archive, Archive& result)
+{
+	assert(m_open && archive < m_archiveCount);
+
+	ULONGLONG fileIndex = GetColumn<ULONGLONG>(m_layout.archiveFileIndexOffset)[archive];
+	ULONGLONG lastWriteTime = GetColumn<ULONGLONG>(m_layout.archiveLastWriteTimeOffset)[archive];
+
+	result.fileName = GetArchiveFileName(archive);
+	result.error = GetArchiveError(archive);
+	result.identityKnown = !IsTransientError(result.error);
+	result.identity.volumeSerialNumber = GetColumn<DWORD>(m_layout.archiveVolumeSerialNumberOffset)[archive];
+	result.identity.fileIndexHigh = static_cast<DWORD>(fileIndex >> 32);
+	result.identity.fileIndexLow = static_cast<DWORD>(fileIndex);
+	result.identity.size = GetColumn<ULONGLONG>(m_layout.archiveSizeOffset)[archive];
+	result.identity.lastWriteTime.dwLowDateTime = static_cast<DWORD>(lastWriteTime);
+	result.identity.lastWriteTime.dwHighDateTime = static_cast<DWORD>(lastWriteTime >> 32);
+
+	result.entryNames.clear();
+	result.headerOffsets.clear();
+
+	// The entries of an archive are stored together, the first one is
+	// found by its archive number.
+	const DWORD* entryArchives = GetColumn<DWORD>(m_layout.entryArchiveOffset);
+	const DWORD* first = std::lower_bound(entryArchives, entryArchives + m_entryCount, static_cast<DWORD>(archive));
+	for(size_t entry = first - entryArchives; entry < m_entryCount && entryArchives[entry] == archive; entry++) {
+		result.entryNames.push_back(GetEntryName(entry));
+		result.headerOffsets.push_back(GetEntryHeaderOffset(entry));
+	}
+}
+
+bool RarNameIndex::Matches(size_t entry, const std::wstring& pattern, bool wholePath)
+{
+	const ULONGLONG* nameOffsets = GetColumn<ULONGLONG>(m_layout.entryNameOffsetsOffset);
+	const WCHAR* names = GetColumn<WCHAR>(m_layout.namesOffset);
+
+	std::wstring foldedName = FoldName(names + nameOffsets[entry],
+		static_cast<size_t>(nameOffsets[entry + 1] - nameOffsets[entry]));
+
+	size_t start = wholePath ? 0 : GetFileNamePart(foldedName);
+	return foldedName.find(pattern, start) != std::wstring::npos;
+}
+
+CString RarNameIndex::GetString(size_t offsetsOffset, size_t index)
+{
+	const ULONGLONG* offsets = GetColumn<ULONGLONG>(offsetsOffset);
+	const WCHAR* names = GetColumn<WCHAR>(m_layout.namesOffset);
+
+	return CString(names + offsets[index], static_cast<int>(offsets[index + 1] - offsets[index]));
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "RarFile.h"
+
+// Index of the entry names of many archives, used to find the archives
+// which hold a file without opening them. The names are read from the file
+// headers of each archive, nothing is decompressed.
+//
+// The file name part of each entry, after the last path separator, is
+// split into trigrams of lowercased characters. Each trigram has a sorted
+// list of the entries whose file name contains it, and a lookup intersects
+// the lists of the pattern's trigrams before comparing the names of the
+// remaining candidates.
+//
+// Each archive is stored with its file identity. When the index is
+// updated, the archives whose identity didn't change keep their entries
+// from the previous index, and only new or changed archives are read.
+class RarNameIndex {
+public:
+	struct UpdateStats {
+		size_t reusedArchives; // unchanged since the previous index
+		size_t listedArchives; // read from the archive
+		size_t failedArchives; // couldn't be listed, indexed without entries
+	};
+
+	RarNameIndex() = default;
+	~RarNameIndex() = default;
+
+	RarNameIndex(const RarNameIndex&) = delete;
+	RarNameIndex& operator=(const RarNameIndex&) = delete;
+
+	// Writes an index of the archives, in their order. The unchanged
+	// archives of an existing index file are taken from it, the archives
+	// which aren't in the list are dropped.
+	static bool Update(const std::vector<CString>& fileNames, const TCHAR* indexFileName,
+		UpdateStats& stats);
+
+	bool Open(const TCHAR* indexFileName);
+	size_t GetArchiveCount();
+	size_t GetEntryCount();
+	// Finds the entries whose name contains the pattern, ignoring case. A
+	// pattern without a path separator is matched against the file name
+	// part only, and uses the trigrams if it has at least three characters.
+	// Other patterns are matched against the whole path of each entry.
+	void Find(const WCHAR* pattern, std::vector<size_t>& entries);
+	CString GetArchiveFileName(size_t archive);
+	RarFile::error GetArchiveError(size_t archive);
+	size_t GetEntryArchive(size_t entry);
+	CString GetEntryName(size_t entry); // with backslashes as path separators
+	ULONGLONG GetEntryHeaderOffset(size_t entry);
+	void Close();
+
+private:
+	struct Archive {
+		CString fileName;
+		RarFile::FileIdentity identity;
+		bool identityKnown;
+		RarFile::error error;
+		std::vector<CString> entryNames;
+		std::vector<ULONGLONG> headerOffsets;
+	};
+
+	struct Layout {
+		size_t archiveSizeOffset;
+		size_t archiveLastWriteTimeOffset;
+		size_t archiveFileIndexOffset;
+		size_t archiveNameOffsetsOffset;
+		size_t archiveVolumeSerialNumberOffset;
+		size_t archiveErrorOffset;
+		size_t entryHeaderOffsetsOffset;
+		size_t entryNameOffsetsOffset;
+		size_t entryArchiveOffset;
+		size_t gramKeysOffset;
+		size_t gramPostingOffsetsOffset;
+		size_t postingsOffset;
+		size_t namesOffset;
+	};
+
+	static Layout GetLayout(ULONGLONG archiveCount, ULONGLONG entryCount,
+		ULONGLONG gramCount, ULONGLONG postingCount);
+	static bool QueryIdentity(const CString& fileName, RarFile::FileIdentity& identity);
+	static void LoadArchive(const CString& fileName, Archive& archive);
+	static bool Write(const std::vector<Archive>& archives, const TCHAR* indexFileName);
+	static bool WriteIndexFile(const TCHAR* indexFileName, const BYTE* data, size_t size);
+	static std::wstring FoldName(const WCHAR* name, size_t length);
+	static size_t GetFileNamePart(const std::wstring& name);
+	static void GetGramKeys(const std::wstring& name, size_t start, std::vector<DWORD>& keys);
+	void GetArchive(size_t archive, Archive& result);
+	bool Matches(size_t entry, const std::wstring& pattern, bool wholePath);
+	CString GetString(size_t offsetsOffset, size_t index);
+
+	template<typename T>
+	const T* GetColumn(size_t offset)
+	{
+		return reinterpret_cast<const T*>(static_cast<const BYTE*>(m_fileMapping) + offset);
+	}
+
+	bool m_open = false;
+	CAtlFileMapping<BYTE> m_fileMapping;
+	size_t m_archiveCount;
+	size_t m_entryCount;
+	size_t m_gramCount;
+	Layout m_layout;
+
+	static const DWORD m_magic = 0x4E524152; // "RARN"
+	static const DWORD m_version = 1;
+	static const size_t m_headerSize = 40;
+	static const size_t m_gramLength = 3;
+	static const DWORD m_writeChunkSize = 0x1000000;
+};
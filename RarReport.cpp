@@ -0,0 +1,176 @@
+#include "stdafx.h"
+#include "RarReport.h"
+
+bool RarReport::Open(const TCHAR* fileName)
+{
+	assert(!m_open);
+
+	HRESULT hr = m_file.Create(fileName,
+		GENERIC_WRITE,
+		FILE_SHARE_READ,
+		OPEN_ALWAYS);
+
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	hr = m_file.Seek(0, FILE_END);
+	if(FAILED(hr)) {
+		m_file.Close();
+		return false;
+	}
+
+	m_buffer.Empty();
+	m_open = true;
+
+	return true;
+}
+
+void RarReport::Append(const RarBatch::Result& result)
+{
+	assert(m_open);
+
+	char prefix[32];
+	int prefixLength = sprintf_s(prefix, "%d\t%d\t%08X\t", static_cast<int>(result.error),
+		result.rarVersion, result.flags);
+
+	// The line is written directly to the buffer, which keeps its size
+	// after a commit, so that once it's large enough for a group, appending
+	// doesn't allocate.
+	int pathLength = ::WideCharToMultiByte(CP_UTF8, 0, result.fileName,
+		result.fileName.GetLength(), NULL, 0, NULL, NULL);
+
+	int length = m_buffer.GetLength();
+	char* buffer = m_buffer.GetBuffer(length + prefixLength + pathLength + 2);
+
+	memcpy(buffer + length, prefix, prefixLength);
+	length += prefixLength;
+
+	::WideCharToMultiByte(CP_UTF8, 0, result.fileName, result.fileName.GetLength(),
+		buffer + length, pathLength, NULL, NULL);
+	length += pathLength;
+
+	memcpy(buffer + length, "\r\n", 2);
+	length += 2;
+
+	m_buffer.ReleaseBufferSetLength(length);
+}
+
+bool RarReport::Commit()
+{
+	assert(m_open);
+
+	if(m_buffer.IsEmpty()) {
+		return true;
+	}
+
+	HRESULT hr = m_file.Write(m_buffer.GetString(), m_buffer.GetLength());
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	m_buffer.Truncate(0);
+
+	return SUCCEEDED(m_file.Flush());
+}
+
+void RarReport::Close()
+{
+	if(m_open) {
+		m_file.Close();
+		m_buffer.Empty();
+		m_open = false;
+	}
+}
+
+// Lines are keyed by path. When a path appears more than once, the line
+// which was read last wins, so reports should be passed oldest first. The
+// output is sorted by path. Incomplete lines, e.g. from an interrupted run,
+// are dropped.
+bool RarReport::Merge(const std::vector<CString>& inputFileNames, const TCHAR* outputFileName)
+{
+	std::map<std::string, std::string> lines;
+
+	for(const auto& inputFileName : inputFileNames) {
+		std::vector<char> data;
+		if(!ReadFile(inputFileName, data)) {
+			return false;
+		}
+
+		auto start = data.begin();
+		while(start != data.end()) {
+			auto end = std::find(start, data.end(), '\n');
+			if(end == data.end()) {
+				break;
+			}
+
+			std::string line(start, end);
+			if(!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+
+			size_t pathStart = 0;
+			for(int i = 0; i < 3 && pathStart != std::string::npos; i++) {
+				pathStart = line.find('\t', pathStart);
+				if(pathStart != std::string::npos) {
+					pathStart++;
+				}
+			}
+
+			if(pathStart != std::string::npos && pathStart < line.size()) {
+				lines[line.substr(pathStart)] = std::move(line);
+			}
+
+			start = end + 1;
+		}
+	}
+
+	std::string output;
+	for(const auto& entry : lines) {
+		output += entry.second;
+		output += "\r\n";
+	}
+
+	CAtlFile file;
+	HRESULT hr = file.Create(outputFileName, GENERIC_WRITE, 0, CREATE_ALWAYS);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	if(!output.empty()) {
+		hr = file.Write(output.data(), static_cast<DWORD>(output.size()));
+		if(FAILED(hr)) {
+			return false;
+		}
+	}
+
+	return SUCCEEDED(file.Flush());
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+bool RarReport::ReadFile(const TCHAR* fileName, std::vector<char>& data)
+{
+	CAtlFile file;
+	HRESULT hr = file.Create(fileName, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	ULONGLONG size;
+	hr = file.GetSize(size);
+	if(FAILED(hr) || size > 0xFFFFFFFF) {
+		return false;
+	}
+
+	data.resize(static_cast<size_t>(size));
+	if(size > 0) {
+		hr = file.Read(data.data(), static_cast<DWORD>(size));
+		if(FAILED(hr)) {
+			return false;
+		}
+	}
+
+	return true;
+}
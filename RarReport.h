@@ -0,0 +1,29 @@
+#pragma once
+
+#include "RarBatch.h"
+
+// Append-only, tab-separated report of batch results, one UTF-8 line per
+// archive: error code, RAR version, flags (hex) and path. Reports of
+// several shards or resumed runs can be merged into a single report.
+class RarReport {
+public:
+	RarReport() = default;
+	~RarReport() = default;
+
+	RarReport(const RarReport&) = delete;
+	RarReport& operator=(const RarReport&) = delete;
+
+	bool Open(const TCHAR* fileName);
+	void Append(const RarBatch::Result& result);
+	bool Commit();
+	void Close();
+
+	static bool Merge(const std::vector<CString>& inputFileNames, const TCHAR* outputFileName);
+
+private:
+	static bool ReadFile(const TCHAR* fileName, std::vector<char>& data);
+
+	bool m_open = false;
+	CAtlFile m_file;
+	CStringA m_buffer;
+};
@@ -0,0 +1,351 @@
+#include "stdafx.h"
+#include "RarScheduler.h"
+#include "RarStats.h"
+
+void RarScheduler::Plan(const std::vector<CString>& fileNames, std::vector<Device>& devices)
+{
+	std::map<DWORD, Volume> volumes;
+	std::vector<Location> locations;
+	locations.reserve(fileNames.size());
+	for(const auto& fileName : fileNames) {
+		locations.push_back(GetLocation(fileName, volumes));
+	}
+
+	std::vector<size_t> order(fileNames.size());
+	for(size_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+
+	// Within a disk, its volumes are swept one after the other. Files which
+	// couldn't be opened sort last, in their original order.
+	std::stable_sort(order.begin(), order.end(), [&locations](size_t a, size_t b) {
+		const Location& locationA = locations[a];
+		const Location& locationB = locations[b];
+		if(locationA.device != locationB.device) {
+			return locationA.device < locationB.device;
+		}
+
+		if(locationA.volumeSerialNumber != locationB.volumeSerialNumber) {
+			return locationA.volumeSerialNumber < locationB.volumeSerialNumber;
+		}
+
+		return locationA.cluster < locationB.cluster;
+	});
+
+	devices.clear();
+	for(size_t i = 0; i < order.size(); i++) {
+		const Location& location = locations[order[i]];
+		if(i == 0 || location.device != locations[order[i - 1]].device) {
+			Device device;
+			device.seekPenalty = location.seekPenalty;
+			device.name = GetDeviceName(location.device);
+			devices.push_back(std::move(device));
+		}
+
+		devices.back().items.push_back(order[i]);
+	}
+}
+
+std::vector<size_t> RarScheduler::GetOrder(const std::vector<Device>& devices)
+{
+	std::vector<size_t> order;
+	for(const auto& device : devices) {
+		order.insert(order.end(), device.items.begin(), device.items.end());
+	}
+
+	return order;
+}
+
+void RarScheduler::Run(const std::vector<Device>& devices, unsigned int threadCount,
+	const std::function<void(size_t item, unsigned int thread)>& work)
+{
+	RunDevices(devices, threadCount, nullptr, [&work](size_t item, unsigned int thread) {
+		work(item, thread);
+		return size_t(1);
+	});
+}
+
+void RarScheduler::RunAdaptive(const std::vector<Device>& devices, unsigned int maxThreadCount,
+	const std::function<size_t(size_t item, unsigned int thread)>& work)
+{
+	std::vector<RarConcurrency> controllers;
+	controllers.reserve(devices.size());
+	for(const auto& device : devices) {
+		unsigned int initialLimit = m_initialLimit;
+		if(device.seekPenalty) {
+			initialLimit = m_maxSeeksPerSpindle;
+		}
+
+		controllers.emplace_back(initialLimit, maxThreadCount);
+	}
+
+	RunDevices(devices, maxThreadCount, &controllers, work);
+
+	for(size_t i = 0; i < devices.size(); i++) {
+		RarConcurrency::Snapshot snapshot;
+		controllers[i].GetSnapshot(snapshot);
+
+		RarStats::DeviceConcurrency concurrency;
+		concurrency.device = devices[i].name;
+		concurrency.limit = snapshot.limit;
+		concurrency.peakLimit = snapshot.peakLimit;
+		concurrency.archives = snapshot.archives;
+		concurrency.archivesPerSecond = snapshot.archivesPerSecond;
+		concurrency.latency = snapshot.latency;
+		RarStats::AddDeviceConcurrency(concurrency);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+void RarScheduler::RunDevices(const std::vector<Device>& devices, unsigned int threadCount,
+	std::vector<RarConcurrency>* controllers,
+	const std::function<size_t(size_t item, unsigned int thread)>& work)
+{
+	size_t itemCount = 0;
+	for(const auto& device : devices) {
+		itemCount += device.items.size();
+	}
+
+	threadCount = std::max(1u, std::min<unsigned int>(threadCount,
+		static_cast<unsigned int>(itemCount)));
+
+	struct DeviceState {
+		size_t nextItem;
+		unsigned int running;
+		unsigned int maxRunning;
+	};
+
+	std::vector<DeviceState> states(devices.size());
+	for(size_t i = 0; i < devices.size(); i++) {
+		states[i].nextItem = 0;
+		states[i].running = 0;
+		states[i].maxRunning = threadCount;
+		if(devices[i].seekPenalty) {
+			states[i].maxRunning = m_maxSeeksPerSpindle;
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable released;
+	size_t nextDevice = 0;
+
+	auto worker = [&](unsigned int thread) {
+		std::unique_lock<std::mutex> lock(mutex);
+		for(;;) {
+			// The devices are taken in turns, so that several disks are read
+			// in parallel, each one in its own order.
+			bool itemsLeft = false;
+			size_t device = devices.size();
+			for(size_t i = 0; i < devices.size(); i++) {
+				size_t candidate = (nextDevice + i) % devices.size();
+				const DeviceState& state = states[candidate];
+				if(state.nextItem < devices[candidate].items.size()) {
+					itemsLeft = true;
+					unsigned int maxRunning = controllers ?
+						(*controllers)[candidate].GetLimit() : state.maxRunning;
+					if(state.running < maxRunning) {
+						device = candidate;
+						break;
+					}
+				}
+			}
+
+			if(!itemsLeft) {
+				break;
+			}
+
+			if(device == devices.size()) {
+				released.wait(lock);
+				continue;
+			}
+
+			nextDevice = device + 1;
+
+			DeviceState& state = states[device];
+			size_t item = devices[device].items[state.nextItem++];
+			unsigned int inFlight = ++state.running;
+
+			lock.unlock();
+			LARGE_INTEGER start, end;
+			::QueryPerformanceCounter(&start);
+			size_t archives = work(item, thread);
+			::QueryPerformanceCounter(&end);
+			lock.lock();
+
+			if(controllers) {
+				(*controllers)[device].AddSample(start.QuadPart, end.QuadPart, archives, inFlight);
+			}
+
+			state.running--;
+			released.notify_all();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for(unsigned int i = 1; i < threadCount; i++) {
+		threads.emplace_back(worker, i);
+	}
+
+	worker(0);
+
+	for(auto& thread : threads) {
+		thread.join();
+	}
+}
+
+CString RarScheduler::GetDeviceName(ULONGLONG device)
+{
+	CString name;
+	if(device == m_unknownDevice) {
+		name = L"Unknown";
+	} else if(device & m_volumeDevice) {
+		name.Format(L"Volume %08X", static_cast<DWORD>(device));
+	} else {
+		name.Format(L"Disk %u", static_cast<DWORD>(device));
+	}
+
+	return name;
+}
+
+RarScheduler::Location RarScheduler::GetLocation(const CString& fileName, std::map<DWORD, Volume>& volumes)
+{
+	RarStats::StageTimer timer(RarStats::stage::locate);
+
+	Location location = { m_unknownDevice, false, 0, 0 };
+
+	// No read access is needed for the queries, and a file which is being
+	// written by another process can still be scheduled.
+	CAtlFile file;
+	HRESULT hr = file.Create(fileName, FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, OPEN_EXISTING);
+	if(FAILED(hr)) {
+		return location;
+	}
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if(!::GetFileInformationByHandle(file, &info)) {
+		return location;
+	}
+
+	auto it = volumes.find(info.dwVolumeSerialNumber);
+	if(it == volumes.end()) {
+		Volume volume = GetVolume(fileName, info.dwVolumeSerialNumber);
+		it = volumes.insert(std::make_pair(info.dwVolumeSerialNumber, volume)).first;
+	}
+
+	location.device = it->second.device;
+	location.seekPenalty = it->second.seekPenalty;
+	location.volumeSerialNumber = info.dwVolumeSerialNumber;
+
+	// Small files which are stored in the MFT have no clusters, and are
+	// read first.
+	GetFirstCluster(file, location.cluster);
+
+	return location;
+}
+
+// The disk of a volume is identified by its device number, a volume which
+// spans several disks has no device number and is scheduled on its own.
+RarScheduler::Volume RarScheduler::GetVolume(const CString& fileName, DWORD volumeSerialNumber)
+{
+	Volume volume = { m_volumeDevice | volumeSerialNumber, false };
+
+	WCHAR volumePath[MAX_PATH];
+	if(!::GetVolumePathName(fileName, volumePath, MAX_PATH)) {
+		return volume;
+	}
+
+	// Network shares don't expose their disks.
+	if(::GetDriveType(volumePath) == DRIVE_REMOTE) {
+		return volume;
+	}
+
+	// Local disks are assumed to be rotating unless they report otherwise,
+	// which requires Windows 7 or newer.
+	volume.seekPenalty = true;
+
+	WCHAR volumeName[MAX_PATH];
+	if(!::GetVolumeNameForVolumeMountPoint(volumePath, volumeName, MAX_PATH)) {
+		return volume;
+	}
+
+	// Without the trailing backslash, the name refers to the volume device
+	// rather than to its root directory.
+	size_t volumeNameLength = wcslen(volumeName);
+	if(volumeNameLength > 0 && volumeName[volumeNameLength - 1] == L'\\') {
+		volumeName[volumeNameLength - 1] = L'\0';
+	}
+
+	// No access rights are needed for the queries, which doesn't require
+	// the process to be elevated.
+	CAtlFile volumeFile;
+	HRESULT hr = volumeFile.Create(volumeName, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, OPEN_EXISTING);
+	if(FAILED(hr)) {
+		return volume;
+	}
+
+	STORAGE_DEVICE_NUMBER deviceNumber;
+	DWORD bytesReturned;
+	if(::DeviceIoControl(volumeFile, IOCTL_STORAGE_GET_DEVICE_NUMBER, nullptr, 0,
+		&deviceNumber, sizeof(deviceNumber), &bytesReturned, nullptr)) {
+		volume.device = (static_cast<ULONGLONG>(deviceNumber.DeviceType) << 32) | deviceNumber.DeviceNumber;
+	}
+
+	bool seekPenalty;
+	if(GetSeekPenalty(volumeFile, seekPenalty)) {
+		volume.seekPenalty = seekPenalty;
+	}
+
+	return volume;
+}
+
+bool RarScheduler::GetFirstCluster(HANDLE fileHandle, ULONGLONG& cluster)
+{
+	STARTING_VCN_INPUT_BUFFER input = {};
+	RETRIEVAL_POINTERS_BUFFER output;
+	DWORD bytesReturned;
+
+	// The buffer holds a single extent, ERROR_MORE_DATA only means that the
+	// file has more.
+	if(!::DeviceIoControl(fileHandle, FSCTL_GET_RETRIEVAL_POINTERS, &input, sizeof(input),
+		&output, sizeof(output), &bytesReturned, nullptr) && ::GetLastError() != ERROR_MORE_DATA) {
+		return false;
+	}
+
+	// A sparse or compressed extent has no clusters, and an Lcn of -1.
+	if(output.ExtentCount == 0 || output.Extents[0].Lcn.QuadPart < 0) {
+		return false;
+	}
+
+	cluster = output.Extents[0].Lcn.QuadPart;
+	return true;
+}
+
+bool RarScheduler::GetSeekPenalty(HANDLE volumeHandle, bool& seekPenalty)
+{
+	// StorageDeviceSeekPenaltyProperty and DEVICE_SEEK_PENALTY_DESCRIPTOR,
+	// which aren't declared when targeting Windows XP.
+	const int seekPenaltyProperty = 7;
+	struct SeekPenaltyDescriptor {
+		DWORD version;
+		DWORD size;
+		BOOLEAN incursSeekPenalty;
+	};
+
+	STORAGE_PROPERTY_QUERY query = {};
+	query.PropertyId = static_cast<STORAGE_PROPERTY_ID>(seekPenaltyProperty);
+	query.QueryType = PropertyStandardQuery;
+
+	SeekPenaltyDescriptor descriptor = {};
+	DWORD bytesReturned;
+	if(!::DeviceIoControl(volumeHandle, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&descriptor, sizeof(descriptor), &bytesReturned, nullptr) ||
+		bytesReturned < offsetof(SeekPenaltyDescriptor, incursSeekPenalty) + sizeof(BOOLEAN)) {
+		return false;
+	}
+
+	seekPenalty = descriptor.incursSeekPenalty != FALSE;
+	return true;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "RarConcurrency.h"
+
+// Orders the archives of a run by their location on disk, so that the
+// header reads of archives on a rotating disk become a sweep across the
+// disk instead of a seek per archive. The archives are grouped by the disk
+// which holds them, and sorted by the first cluster of their data within
+// each disk.
+//
+// Run processes the archives of a plan on several threads, but at most
+// m_maxSeeksPerSpindle archives of a disk with a seek penalty at a time,
+// so that the threads don't pull the heads back and forth. Disks without
+// a seek penalty, e.g. SSDs, are processed by all the threads.
+//
+// RunAdaptive lets a RarConcurrency controller of each disk choose how
+// many of its archives are in flight, starting from one archive on a disk
+// with a seek penalty. The chosen limits are recorded in RarStats.
+class RarScheduler {
+public:
+	struct Device {
+		std::vector<size_t> items; // indices into the file names, in disk order
+		bool seekPenalty;
+		CString name; // for the statistics, e.g. "Disk 1"
+	};
+
+	static void Plan(const std::vector<CString>& fileNames, std::vector<Device>& devices);
+	// The items of all the devices, device after device.
+	static std::vector<size_t> GetOrder(const std::vector<Device>& devices);
+	// Calls work(item, thread) for each item, thread is in [0, threadCount).
+	static void Run(const std::vector<Device>& devices, unsigned int threadCount,
+		const std::function<void(size_t item, unsigned int thread)>& work);
+	// Like Run, work returns the number of archives of the item, which
+	// weighs its latency. maxThreadCount bounds the limits of all devices.
+	static void RunAdaptive(const std::vector<Device>& devices, unsigned int maxThreadCount,
+		const std::function<size_t(size_t item, unsigned int thread)>& work);
+
+private:
+	struct Location {
+		ULONGLONG device;
+		bool seekPenalty;
+		DWORD volumeSerialNumber;
+		ULONGLONG cluster; // first logical cluster of the data
+	};
+
+	struct Volume {
+		ULONGLONG device;
+		bool seekPenalty;
+	};
+
+	static void RunDevices(const std::vector<Device>& devices, unsigned int threadCount,
+		std::vector<RarConcurrency>* controllers,
+		const std::function<size_t(size_t item, unsigned int thread)>& work);
+	static CString GetDeviceName(ULONGLONG device);
+	static Location GetLocation(const CString& fileName, std::map<DWORD, Volume>& volumes);
+	static Volume GetVolume(const CString& fileName, DWORD volumeSerialNumber);
+	static bool GetFirstCluster(HANDLE fileHandle, ULONGLONG& cluster);
+	static bool GetSeekPenalty(HANDLE volumeHandle, bool& seekPenalty);
+
+	static const unsigned int m_maxSeeksPerSpindle = 1;
+	static const unsigned int m_initialLimit = 4; // of a device without a seek penalty
+	// Device keys of volumes whose disk is unknown, ORed with the volume
+	// serial number, and of files which couldn't be opened.
+	static const ULONGLONG m_volumeDevice = 1ULL << 63;
+	static const ULONGLONG m_unknownDevice = ~0ULL;
+};
@@ -0,0 +1,422 @@
+#include "stdafx.h"
+#include "RarServer.h"
+
+#ifndef PIPE_REJECT_REMOTE_CLIENTS
+#define PIPE_REJECT_REMOTE_CLIENTS 0x00000008
+#endif
+
+namespace
+{
+	const char* commandNames[] = {
+		"status",
+		"lock",
+		"unlock",
+	};
+
+	const char* errorNames[] = {
+		"success",
+		"open_failed",
+		"invalid_file",
+		"encrypted_archive",
+		"file_changed",
+		"write_failed",
+	};
+
+	// Upper bounds of the latency histogram buckets, in microseconds.
+	const ULONGLONG latencyBucketBounds[] = {
+		50, 100, 250, 500, 1000, 2500, 5000, 10000, 100000
+	};
+
+	const size_t responseSize = 7;
+}
+
+RarServer::RarServer()
+{
+	for(size_t i = 0; i < m_commandCount; i++) {
+		for(size_t j = 0; j < m_errorCount; j++) {
+			m_requests[i][j] = 0;
+		}
+
+		for(size_t j = 0; j < m_latencyBuckets + 1; j++) {
+			m_latency[i][j] = 0;
+		}
+
+		m_latencySumMicroseconds[i] = 0;
+	}
+
+	m_cacheHits = 0;
+	m_cacheMisses = 0;
+}
+
+bool RarServer::Run(const TCHAR* pipeName, size_t workerCount /*= 0*/)
+{
+	static_assert(_countof(errorNames) == m_errorCount, "errorNames doesn't match RarFile::error");
+	static_assert(_countof(latencyBucketBounds) == m_latencyBuckets, "latencyBucketBounds size mismatch");
+
+	if(workerCount == 0) {
+		workerCount = std::max(std::thread::hardware_concurrency(), 4u);
+	}
+
+	LARGE_INTEGER frequency;
+	::QueryPerformanceFrequency(&frequency);
+	m_performanceFrequency = frequency.QuadPart;
+
+	// Each worker owns a pipe instance, and serves one client at a time.
+	std::vector<HANDLE> pipeHandles;
+
+	for(size_t i = 0; i < workerCount; i++) {
+		HANDLE pipeHandle = ::CreateNamedPipe(pipeName,
+			PIPE_ACCESS_DUPLEX,
+			PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			PIPE_UNLIMITED_INSTANCES,
+			m_pipeBufferSize,
+			m_pipeBufferSize,
+			0,
+			NULL);
+
+		if(pipeHandle == INVALID_HANDLE_VALUE) {
+			break;
+		}
+
+		pipeHandles.push_back(pipeHandle);
+	}
+
+	CString metricsPipeName = pipeName;
+	metricsPipeName += L"_metrics";
+
+	HANDLE metricsPipeHandle = ::CreateNamedPipe(metricsPipeName,
+		PIPE_ACCESS_OUTBOUND,
+		PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+		1,
+		m_pipeBufferSize,
+		0,
+		0,
+		NULL);
+
+	if(pipeHandles.size() < workerCount || metricsPipeHandle == INVALID_HANDLE_VALUE) {
+		for(HANDLE pipeHandle : pipeHandles) {
+			::CloseHandle(pipeHandle);
+		}
+
+		if(metricsPipeHandle != INVALID_HANDLE_VALUE) {
+			::CloseHandle(metricsPipeHandle);
+		}
+
+		return false;
+	}
+
+	std::vector<std::thread> threads;
+
+	for(HANDLE pipeHandle : pipeHandles) {
+		threads.emplace_back(&RarServer::WorkerThread, this, pipeHandle);
+	}
+
+	threads.emplace_back(&RarServer::MetricsThread, this, metricsPipeHandle);
+
+	for(auto& thread : threads) {
+		thread.join();
+	}
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+bool RarServer::FileIdentityLess::operator()(const RarFile::FileIdentity& a,
+	const RarFile::FileIdentity& b) const
+{
+	if(a.volumeSerialNumber != b.volumeSerialNumber) {
+		return a.volumeSerialNumber < b.volumeSerialNumber;
+	}
+
+	if(a.fileIndexHigh != b.fileIndexHigh) {
+		return a.fileIndexHigh < b.fileIndexHigh;
+	}
+
+	if(a.fileIndexLow != b.fileIndexLow) {
+		return a.fileIndexLow < b.fileIndexLow;
+	}
+
+	if(a.size != b.size) {
+		return a.size < b.size;
+	}
+
+	if(a.lastWriteTime.dwHighDateTime != b.lastWriteTime.dwHighDateTime) {
+		return a.lastWriteTime.dwHighDateTime < b.lastWriteTime.dwHighDateTime;
+	}
+
+	return a.lastWriteTime.dwLowDateTime < b.lastWriteTime.dwLowDateTime;
+}
+
+void RarServer::WorkerThread(HANDLE pipeHandle)
+{
+	std::vector<BYTE> request(m_pipeBufferSize);
+
+	for(;;) {
+		if(!::ConnectNamedPipe(pipeHandle, NULL) &&
+			::GetLastError() != ERROR_PIPE_CONNECTED) {
+			::DisconnectNamedPipe(pipeHandle);
+			continue;
+		}
+
+		for(;;) {
+			DWORD requestSize;
+			if(!::ReadFile(pipeHandle, request.data(), m_pipeBufferSize, &requestSize, NULL)) {
+				break; // disconnected, or the message is too large
+			}
+
+			LARGE_INTEGER startCounter;
+			::QueryPerformanceCounter(&startCounter);
+
+			BYTE response[responseSize] = {};
+			RarFile::error err = RarFile::error::invalid_file;
+			command cmd = command::status;
+
+			if(requestSize >= 1 + sizeof(WORD)) {
+				cmd = static_cast<command>(request[0]);
+
+				WORD pathLength;
+				memcpy(&pathLength, &request[1], sizeof(WORD));
+
+				if(cmd >= command::status && cmd <= command::unlock &&
+					pathLength > 0 &&
+					requestSize == 1 + sizeof(WORD) + pathLength * sizeof(WCHAR)) {
+					CString fileName(reinterpret_cast<const WCHAR*>(&request[1 + sizeof(WORD)]), pathLength);
+
+					int rarVersion = 0;
+					bool sfx = false;
+					DWORD flags = 0;
+					err = HandleRequest(cmd, fileName, rarVersion, sfx, flags);
+
+					response[1] = static_cast<BYTE>(rarVersion);
+					response[2] = sfx ? 1 : 0;
+					memcpy(&response[3], &flags, sizeof(DWORD));
+				} else {
+					cmd = command::status;
+				}
+			}
+
+			response[0] = static_cast<BYTE>(err);
+
+			DWORD bytesWritten;
+			BOOL written = ::WriteFile(pipeHandle, response, responseSize, &bytesWritten, NULL);
+
+			LARGE_INTEGER endCounter;
+			::QueryPerformanceCounter(&endCounter);
+			RecordRequest(cmd, err, endCounter.QuadPart - startCounter.QuadPart);
+
+			if(!written) {
+				break;
+			}
+		}
+
+		::DisconnectNamedPipe(pipeHandle);
+	}
+}
+
+void RarServer::MetricsThread(HANDLE pipeHandle)
+{
+	for(;;) {
+		if(!::ConnectNamedPipe(pipeHandle, NULL) &&
+			::GetLastError() != ERROR_PIPE_CONNECTED) {
+			::DisconnectNamedPipe(pipeHandle);
+			continue;
+		}
+
+		CStringA metrics = FormatMetrics();
+
+		DWORD bytesWritten;
+		if(::WriteFile(pipeHandle, metrics.GetString(), metrics.GetLength(), &bytesWritten, NULL)) {
+			::FlushFileBuffers(pipeHandle);
+		}
+
+		::DisconnectNamedPipe(pipeHandle);
+	}
+}
+
+RarFile::error RarServer::HandleRequest(command cmd, const TCHAR* fileName,
+	int& rarVersion, bool& sfx, DWORD& flags)
+{
+	// Only the identity is needed for the cache lookup, the file data is
+	// not read unless the archive is not cached.
+	CAtlFile fileHandle;
+	HRESULT hr = fileHandle.Create(fileName,
+		FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		OPEN_EXISTING);
+
+	if(FAILED(hr)) {
+		return RarFile::error::open_failed;
+	}
+
+	RarFile::FileIdentity identity;
+	if(!RarFile::FileIdentity::Query(fileHandle, identity)) {
+		return RarFile::error::open_failed;
+	}
+
+	fileHandle.Close();
+
+	std::shared_ptr<CacheEntry> entry = CacheLookup(identity);
+	if(entry) {
+		m_cacheHits++;
+	} else {
+		m_cacheMisses++;
+
+		entry = std::make_shared<CacheEntry>();
+		RarFile::error err = entry->session.Load(fileName);
+		if(err != RarFile::error::success) {
+			return err;
+		}
+
+		CacheInsert(entry->session.GetFileIdentity(), entry);
+	}
+
+	std::lock_guard<std::mutex> lock(entry->mutex);
+	RarSession& session = entry->session;
+
+	RarFile::error err = RarFile::error::success;
+
+	if(cmd == command::lock || cmd == command::unlock) {
+		RarFile::FileIdentity oldIdentity = session.GetFileIdentity();
+
+		err = session.SetLocked(cmd == command::lock);
+
+		// The modification time is changed by the write.
+		if(session.GetFileIdentity() != oldIdentity) {
+			CacheErase(oldIdentity);
+			CacheInsert(session.GetFileIdentity(), entry);
+		}
+
+		if(err == RarFile::error::file_changed) {
+			CacheErase(oldIdentity);
+		}
+	}
+
+	rarVersion = session.GetRarVersion();
+	sfx = session.IsSFX();
+
+	if(err == RarFile::error::success) {
+		err = session.GetFlags(flags);
+	}
+
+	return err;
+}
+
+std::shared_ptr<RarServer::CacheEntry> RarServer::CacheLookup(const RarFile::FileIdentity& identity)
+{
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+
+	auto it = m_cacheMap.find(identity);
+	if(it == m_cacheMap.end()) {
+		return nullptr;
+	}
+
+	m_cacheList.splice(m_cacheList.begin(), m_cacheList, it->second);
+	return it->second->second;
+}
+
+void RarServer::CacheInsert(const RarFile::FileIdentity& identity, std::shared_ptr<CacheEntry> entry)
+{
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+
+	auto it = m_cacheMap.find(identity);
+	if(it != m_cacheMap.end()) {
+		it->second->second = std::move(entry);
+		m_cacheList.splice(m_cacheList.begin(), m_cacheList, it->second);
+		return;
+	}
+
+	m_cacheList.emplace_front(identity, std::move(entry));
+	m_cacheMap[identity] = m_cacheList.begin();
+
+	if(m_cacheList.size() > m_cacheCapacity) {
+		m_cacheMap.erase(m_cacheList.back().first);
+		m_cacheList.pop_back();
+	}
+}
+
+void RarServer::CacheErase(const RarFile::FileIdentity& identity)
+{
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+
+	auto it = m_cacheMap.find(identity);
+	if(it != m_cacheMap.end()) {
+		m_cacheList.erase(it->second);
+		m_cacheMap.erase(it);
+	}
+}
+
+void RarServer::RecordRequest(command cmd, RarFile::error err, LONGLONG ticks)
+{
+	size_t commandIndex = static_cast<size_t>(cmd) - static_cast<size_t>(command::status);
+	size_t errorIndex = static_cast<size_t>(err);
+
+	m_requests[commandIndex][errorIndex]++;
+
+	ULONGLONG microseconds = static_cast<ULONGLONG>(ticks) * 1000000 / m_performanceFrequency;
+	m_latencySumMicroseconds[commandIndex] += microseconds;
+
+	size_t bucket = 0;
+	while(bucket < m_latencyBuckets && microseconds > latencyBucketBounds[bucket]) {
+		bucket++;
+	}
+
+	m_latency[commandIndex][bucket]++;
+}
+
+CStringA RarServer::FormatMetrics()
+{
+	CStringA text;
+	CStringA line;
+
+	text += "# HELP rar_unlocker_requests_total Number of handled requests.\n";
+	text += "# TYPE rar_unlocker_requests_total counter\n";
+
+	for(size_t i = 0; i < m_commandCount; i++) {
+		for(size_t j = 0; j < m_errorCount; j++) {
+			line.Format("rar_unlocker_requests_total{command=\"%s\",result=\"%s\"} %I64u\n",
+				commandNames[i], errorNames[j], m_requests[i][j].load());
+			text += line;
+		}
+	}
+
+	text += "# HELP rar_unlocker_request_duration_seconds Request handling latency.\n";
+	text += "# TYPE rar_unlocker_request_duration_seconds histogram\n";
+
+	for(size_t i = 0; i < m_commandCount; i++) {
+		ULONGLONG count = 0;
+
+		for(size_t j = 0; j < m_latencyBuckets + 1; j++) {
+			count += m_latency[i][j].load();
+
+			if(j < m_latencyBuckets) {
+				line.Format("rar_unlocker_request_duration_seconds_bucket{command=\"%s\",le=\"%g\"} %I64u\n",
+					commandNames[i], latencyBucketBounds[j] / 1000000.0, count);
+			} else {
+				line.Format("rar_unlocker_request_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %I64u\n",
+					commandNames[i], count);
+			}
+
+			text += line;
+		}
+
+		line.Format("rar_unlocker_request_duration_seconds_sum{command=\"%s\"} %g\n",
+			commandNames[i], m_latencySumMicroseconds[i].load() / 1000000.0);
+		text += line;
+
+		line.Format("rar_unlocker_request_duration_seconds_count{command=\"%s\"} %I64u\n",
+			commandNames[i], count);
+		text += line;
+	}
+
+	text += "# HELP rar_unlocker_cache_lookups_total Archive cache lookups.\n";
+	text += "# TYPE rar_unlocker_cache_lookups_total counter\n";
+
+	line.Format("rar_unlocker_cache_lookups_total{result=\"hit\"} %I64u\n", m_cacheHits.load());
+	text += line;
+	line.Format("rar_unlocker_cache_lookups_total{result=\"miss\"} %I64u\n", m_cacheMisses.load());
+	text += line;
+
+	return text;
+}
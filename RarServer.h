@@ -0,0 +1,74 @@
+#pragma once
+
+#include "RarSession.h"
+
+// Serves archive status and lock requests over a named pipe, so that the
+// clients don't have to start a process per archive. Parsed archives are
+// kept in an LRU cache keyed by the file identity.
+//
+// Request (a single pipe message):
+//   command (1): 1 - status, 2 - lock, 3 - unlock
+//   path length in characters (2), path (UTF-16)
+//
+// Response:
+//   error (1): RarFile::error
+//   RAR version (1), SFX (1), flags (4): RarFile::flags
+//
+// Request counts and latency histograms are served in the Prometheus text
+// format on a second pipe, with the "_metrics" suffix.
+class RarServer {
+public:
+	enum class command : BYTE {
+		status = 1,
+		lock = 2,
+		unlock = 3,
+	};
+
+	RarServer();
+	~RarServer() = default;
+
+	RarServer(const RarServer&) = delete;
+	RarServer& operator=(const RarServer&) = delete;
+
+	bool Run(const TCHAR* pipeName, size_t workerCount = 0);
+
+private:
+	struct CacheEntry {
+		std::mutex mutex;
+		RarSession session;
+	};
+
+	struct FileIdentityLess {
+		bool operator()(const RarFile::FileIdentity& a, const RarFile::FileIdentity& b) const;
+	};
+
+	typedef std::list<std::pair<RarFile::FileIdentity, std::shared_ptr<CacheEntry>>> CacheList;
+
+	void WorkerThread(HANDLE pipeHandle);
+	void MetricsThread(HANDLE pipeHandle);
+	RarFile::error HandleRequest(command cmd, const TCHAR* fileName,
+		int& rarVersion, bool& sfx, DWORD& flags);
+	std::shared_ptr<CacheEntry> CacheLookup(const RarFile::FileIdentity& identity);
+	void CacheInsert(const RarFile::FileIdentity& identity, std::shared_ptr<CacheEntry> entry);
+	void CacheErase(const RarFile::FileIdentity& identity);
+	void RecordRequest(command cmd, RarFile::error err, LONGLONG ticks);
+	CStringA FormatMetrics();
+
+	std::mutex m_cacheMutex;
+	CacheList m_cacheList; // most recently used first
+	std::map<RarFile::FileIdentity, CacheList::iterator, FileIdentityLess> m_cacheMap;
+
+	static const size_t m_commandCount = 3;
+	static const size_t m_errorCount = static_cast<size_t>(RarFile::error::write_failed) + 1;
+	static const size_t m_latencyBuckets = 9;
+
+	std::atomic<ULONGLONG> m_requests[m_commandCount][m_errorCount];
+	std::atomic<ULONGLONG> m_latency[m_commandCount][m_latencyBuckets + 1];
+	std::atomic<ULONGLONG> m_latencySumMicroseconds[m_commandCount];
+	std::atomic<ULONGLONG> m_cacheHits;
+	std::atomic<ULONGLONG> m_cacheMisses;
+	LONGLONG m_performanceFrequency;
+
+	static const size_t m_cacheCapacity = 4096;
+	static const DWORD m_pipeBufferSize = 0x10000;
+};
@@ -0,0 +1,379 @@
+#include "stdafx.h"
+#include "RarSession.h"
+#include "RarStats.h"
+
+RarFile::error RarSession::Load(const TCHAR* fileName)
+{
+	// On failure, the previously loaded archive stays loaded.
+	RarFile file;
+	RarFile::error err = file.Open(fileName);
+	if(err != RarFile::error::success) {
+		return err;
+	}
+
+	RarFile::MainHeader mainHeader;
+	RarFile::error mainHeaderError = file.GetMainHeader(mainHeader);
+	if(mainHeaderError == RarFile::error::invalid_file) {
+		return mainHeaderError;
+	}
+
+	if(mainHeaderError == RarFile::error::success) {
+		const BYTE* headerData = file.GetMainHeaderData();
+		m_mainHeaderData.assign(headerData, headerData + mainHeader.size);
+	} else {
+		m_mainHeaderData.clear();
+	}
+
+	m_fileName = fileName;
+	m_fileIdentity = file.GetFileIdentity();
+	m_rarVersion = file.GetRarVersion();
+	m_sfx = file.IsSFX();
+	m_mainHeaderError = mainHeaderError;
+	m_mainHeader = mainHeader;
+	m_loaded = true;
+
+	return RarFile::error::success;
+}
+
+int RarSession::GetRarVersion()
+{
+	assert(m_loaded);
+	return m_rarVersion;
+}
+
+bool RarSession::IsSFX()
+{
+	assert(m_loaded);
+	return m_sfx;
+}
+
+const RarFile::FileIdentity& RarSession::GetFileIdentity()
+{
+	assert(m_loaded);
+	return m_fileIdentity;
+}
+
+RarFile::error RarSession::GetFlags(DWORD& fileFlags)
+{
+	assert(m_loaded);
+
+	if(m_mainHeaderError != RarFile::error::success) {
+		return m_mainHeaderError;
+	}
+
+	fileFlags = m_mainHeader.flags;
+	return RarFile::error::success;
+}
+
+RarFile::error RarSession::GetLockPatch(bool locked, Patch& patch)
+{
+	assert(m_loaded);
+
+	if(m_mainHeaderError != RarFile::error::success) {
+		return m_mainHeaderError;
+	}
+
+	patch.offset = m_mainHeader.offset;
+
+	bool oldLocked = (m_mainHeader.flags & RarFile::locked) != 0;
+	if(oldLocked == locked) {
+		patch.originalData.clear();
+		patch.patchedData.clear();
+		return RarFile::error::success;
+	}
+
+	m_patchedHeaderData.assign(m_mainHeaderData.begin(), m_mainHeaderData.end());
+	RarFile::PatchLocked(m_mainHeader, m_patchedHeaderData.data(), locked);
+
+	// Only the CRC and the bytes up to the flag byte are modified.
+	size_t patchSize = m_mainHeader.flagOffset + 1;
+	patch.originalData.assign(m_mainHeaderData.begin(), m_mainHeaderData.begin() + patchSize);
+	patch.patchedData.assign(m_patchedHeaderData.begin(), m_patchedHeaderData.begin() + patchSize);
+
+	return RarFile::error::success;
+}
+
+RarFile::error RarSession::ApplyPatch(const Patch& patch)
+{
+	assert(m_loaded);
+
+	if(patch.patchedData.empty()) {
+		return RarFile::error::success;
+	}
+
+	assert(m_mainHeaderError == RarFile::error::success);
+	assert(patch.offset == m_mainHeader.offset);
+	assert(patch.patchedData.size() <= m_mainHeaderData.size());
+
+	CAtlFile fileHandle;
+	HRESULT hr = fileHandle.Create(m_fileName,
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ,
+		OPEN_EXISTING);
+
+	if(FAILED(hr)) {
+		return RarFile::error::open_failed;
+	}
+
+	RarFile::FileIdentity fileIdentity;
+	if(!RarFile::FileIdentity::Query(fileHandle, fileIdentity) ||
+		fileIdentity != m_fileIdentity) {
+		return RarFile::error::file_changed;
+	}
+
+	hr = WritePatch(fileHandle, patch);
+	if(FAILED(hr)) {
+		return RarFile::error::write_failed;
+	}
+
+	// Set the modification time explicitly, so that the recorded identity
+	// matches the file after the handle is closed.
+	FILETIME lastWriteTime;
+	::GetSystemTimeAsFileTime(&lastWriteTime);
+	if(::SetFileTime(fileHandle, NULL, NULL, &lastWriteTime)) {
+		fileIdentity.lastWriteTime = lastWriteTime;
+	} else {
+		RarFile::FileIdentity::Query(fileHandle, fileIdentity);
+	}
+
+	m_fileIdentity = fileIdentity;
+	std::copy(patch.patchedData.begin(), patch.patchedData.end(), m_mainHeaderData.begin());
+	m_mainHeader.flags ^= RarFile::locked;
+
+	return RarFile::error::success;
+}
+
+RarFile::error RarSession::SetLocked(bool locked)
+{
+	RarFile::error err = GetLockPatch(locked, m_patch);
+	if(err != RarFile::error::success) {
+		return err;
+	}
+
+	return ApplyPatch(m_patch);
+}
+
+RarFile::error RarSession::SaveLocked(const TCHAR* outputFileName, bool locked)
+{
+	Patch& patch = m_patch;
+	RarFile::error err = GetLockPatch(locked, patch);
+	if(err != RarFile::error::success) {
+		return err;
+	}
+
+	// Keep the source open without write sharing while it's being copied.
+	CAtlFile sourceHandle;
+	HRESULT hr = sourceHandle.Create(m_fileName,
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		OPEN_EXISTING);
+
+	if(FAILED(hr)) {
+		return RarFile::error::open_failed;
+	}
+
+	RarFile::FileIdentity fileIdentity;
+	if(!RarFile::FileIdentity::Query(sourceHandle, fileIdentity) ||
+		fileIdentity != m_fileIdentity) {
+		return RarFile::error::file_changed;
+	}
+
+	// The data is cloned when the file system supports block cloning
+	// (ReFS), so that the archive data is not read and written again.
+	// Otherwise, e.g. on NTFS or across volumes, it's copied.
+	bool copied;
+
+	{
+		RarStats::StageTimer timer(RarStats::stage::copy);
+		copied = CloneFile(sourceHandle, outputFileName) ||
+			::CopyFile(m_fileName, outputFileName, FALSE) != FALSE;
+	}
+
+	if(!copied) {
+		return RarFile::error::write_failed;
+	}
+
+	if(patch.patchedData.empty()) {
+		return RarFile::error::success;
+	}
+
+	// Don't leave an unpatched copy behind.
+	err = PatchCopy(outputFileName, patch);
+	if(err != RarFile::error::success) {
+		DeleteOutput(outputFileName);
+	}
+
+	return err;
+}
+
+void RarSession::Close()
+{
+	if(m_loaded) {
+		m_mainHeaderData.clear();
+		m_loaded = false;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+// Creates outputFileName with the clusters of the source file, which are
+// shared until either file is modified.
+bool RarSession::CloneFile(CAtlFile& sourceHandle, const TCHAR* outputFileName)
+{
+	// FSCTL_DUPLICATE_EXTENTS_TO_FILE and DUPLICATE_EXTENTS_DATA, which
+	// aren't declared when targeting Windows XP.
+	const DWORD duplicateExtentsToFile = CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 209, METHOD_BUFFERED, FILE_WRITE_DATA);
+	struct DuplicateExtentsData {
+		HANDLE fileHandle;
+		LARGE_INTEGER sourceFileOffset;
+		LARGE_INTEGER targetFileOffset;
+		LARGE_INTEGER byteCount;
+	};
+
+	// A multiple of any cluster size, below the 4 GB limit of a call.
+	const ULONGLONG maxCloneSize = 0x40000000;
+
+	BY_HANDLE_FILE_INFORMATION sourceInfo;
+	if(!::GetFileInformationByHandle(sourceHandle, &sourceInfo)) {
+		return false;
+	}
+
+	// The ranges must be cluster aligned, the last one is rounded up past
+	// the end of the file.
+	TCHAR volumePath[MAX_PATH];
+	DWORD sectorsPerCluster, bytesPerSector, freeClusters, totalClusters;
+	if(!::GetVolumePathName(outputFileName, volumePath, _countof(volumePath)) ||
+		!::GetDiskFreeSpace(volumePath, &sectorsPerCluster, &bytesPerSector, &freeClusters, &totalClusters)) {
+		return false;
+	}
+
+	ULONGLONG clusterSize = static_cast<ULONGLONG>(sectorsPerCluster) * bytesPerSector;
+	ULONGLONG size = (static_cast<ULONGLONG>(sourceInfo.nFileSizeHigh) << 32) | sourceInfo.nFileSizeLow;
+
+	bool cloned = false;
+
+	{
+		CAtlFile outputHandle;
+		HRESULT hr = outputHandle.Create(outputFileName,
+			GENERIC_READ | GENERIC_WRITE,
+			0,
+			CREATE_ALWAYS);
+
+		if(FAILED(hr)) {
+			return false;
+		}
+
+		DWORD bytesReturned;
+		bool prepared = true;
+
+		// The target of a sparse file must be sparse too.
+		if(sourceInfo.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) {
+			prepared = ::DeviceIoControl(outputHandle, FSCTL_SET_SPARSE, nullptr, 0,
+				nullptr, 0, &bytesReturned, nullptr) != FALSE;
+		}
+
+		if(prepared) {
+			prepared = SUCCEEDED(outputHandle.SetSize(size));
+		}
+
+		cloned = prepared;
+		for(ULONGLONG offset = 0; cloned && offset < size; offset += maxCloneSize) {
+			ULONGLONG cloneSize = size - offset;
+			if(cloneSize > maxCloneSize) {
+				cloneSize = maxCloneSize;
+			}
+
+			cloneSize = (cloneSize + clusterSize - 1) / clusterSize * clusterSize;
+
+			DuplicateExtentsData data;
+			data.fileHandle = sourceHandle;
+			data.sourceFileOffset.QuadPart = static_cast<LONGLONG>(offset);
+			data.targetFileOffset.QuadPart = static_cast<LONGLONG>(offset);
+			data.byteCount.QuadPart = static_cast<LONGLONG>(cloneSize);
+
+			cloned = ::DeviceIoControl(outputHandle, duplicateExtentsToFile, &data, sizeof(data),
+				nullptr, 0, &bytesReturned, nullptr) != FALSE;
+		}
+
+		// Keep the modification time, like CopyFile does.
+		if(cloned) {
+			::SetFileTime(outputHandle, NULL, NULL, &sourceInfo.ftLastWriteTime);
+		}
+	}
+
+	if(!cloned) {
+		::DeleteFile(outputFileName);
+	}
+
+	return cloned;
+}
+
+// CopyFile copies the attributes of the source, the read-only attribute
+// is cleared while the copy is patched.
+RarFile::error RarSession::PatchCopy(const TCHAR* outputFileName, const Patch& patch)
+{
+	DWORD attributes = ::GetFileAttributes(outputFileName);
+	if(attributes == INVALID_FILE_ATTRIBUTES) {
+		return RarFile::error::open_failed;
+	}
+
+	bool readOnly = (attributes & FILE_ATTRIBUTE_READONLY) != 0;
+	if(readOnly && !::SetFileAttributes(outputFileName, attributes & ~FILE_ATTRIBUTE_READONLY)) {
+		return RarFile::error::write_failed;
+	}
+
+	{
+		CAtlFile outputHandle;
+		HRESULT hr = outputHandle.Create(outputFileName,
+			GENERIC_READ | GENERIC_WRITE,
+			0,
+			OPEN_EXISTING);
+
+		if(FAILED(hr)) {
+			return RarFile::error::open_failed;
+		}
+
+		hr = WritePatch(outputHandle, patch);
+		if(FAILED(hr)) {
+			return RarFile::error::write_failed;
+		}
+	}
+
+	if(readOnly) {
+		::SetFileAttributes(outputFileName, attributes);
+	}
+
+	return RarFile::error::success;
+}
+
+// The copy may still be read-only. If it can't be deleted, it's truncated,
+// so that it can't be mistaken for a patched archive.
+void RarSession::DeleteOutput(const TCHAR* outputFileName)
+{
+	DWORD attributes = ::GetFileAttributes(outputFileName);
+	if(attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_READONLY)) {
+		::SetFileAttributes(outputFileName, attributes & ~FILE_ATTRIBUTE_READONLY);
+	}
+
+	if(!::DeleteFile(outputFileName)) {
+		CAtlFile outputHandle;
+		outputHandle.Create(outputFileName,
+			GENERIC_WRITE,
+			0,
+			TRUNCATE_EXISTING);
+	}
+}
+
+HRESULT RarSession::WritePatch(CAtlFile& fileHandle, const Patch& patch)
+{
+	RarStats::StageTimer timer(RarStats::stage::write);
+
+	HRESULT hr = fileHandle.Seek(patch.offset, FILE_BEGIN);
+	if(FAILED(hr)) {
+		return hr;
+	}
+
+	return fileHandle.Write(patch.patchedData.data(),
+		static_cast<DWORD>(patch.patchedData.size()));
+}
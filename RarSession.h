@@ -0,0 +1,53 @@
+#pragma once
+
+#include "RarFile.h"
+
+// Keeps the parsed state of an archive, so that it can be modified later
+// without opening and scanning it again. Before a change is written, the
+// file identity is compared with the one recorded when it was loaded.
+class RarSession {
+public:
+	// The bytes which change when the lock attribute is modified. Both
+	// vectors are empty if the archive already has the requested state.
+	struct Patch {
+		ULONGLONG offset;
+		std::vector<BYTE> originalData;
+		std::vector<BYTE> patchedData;
+	};
+
+	RarSession() = default;
+	~RarSession() = default;
+
+	RarSession(const RarSession&) = delete;
+	RarSession& operator=(const RarSession&) = delete;
+
+	RarFile::error Load(const TCHAR* fileName);
+	int GetRarVersion();
+	bool IsSFX();
+	const RarFile::FileIdentity& GetFileIdentity();
+	RarFile::error GetFlags(DWORD& fileFlags);
+	RarFile::error GetLockPatch(bool locked, Patch& patch);
+	// Writes a patch returned by GetLockPatch, e.g. after it was journaled.
+	RarFile::error ApplyPatch(const Patch& patch);
+	RarFile::error SetLocked(bool locked);
+	RarFile::error SaveLocked(const TCHAR* outputFileName, bool locked);
+	void Close();
+
+private:
+	static bool CloneFile(CAtlFile& sourceHandle, const TCHAR* outputFileName);
+	static RarFile::error PatchCopy(const TCHAR* outputFileName, const Patch& patch);
+	static void DeleteOutput(const TCHAR* outputFileName);
+	static HRESULT WritePatch(CAtlFile& fileHandle, const Patch& patch);
+
+	bool m_loaded = false;
+	CString m_fileName;
+	RarFile::FileIdentity m_fileIdentity;
+	int m_rarVersion;
+	bool m_sfx;
+	RarFile::error m_mainHeaderError;
+	RarFile::MainHeader m_mainHeader;
+	std::vector<BYTE> m_mainHeaderData;
+	// Reused, so that a session which is loaded again doesn't allocate.
+	std::vector<BYTE> m_patchedHeaderData;
+	Patch m_patch;
+};
@@ -0,0 +1,366 @@
+#include "stdafx.h"
+#include "RarStats.h"
+
+#pragma comment(lib, "psapi.lib")
+
+namespace
+{
+	const size_t stageCount = static_cast<size_t>(RarStats::stage::count);
+
+	const WCHAR* stageNames[stageCount] = {
+		L"Locate",
+		L"Classify",
+		L"Open",
+		L"Map",
+		L"Read",
+		L"Find signature",
+		L"Parse header",
+		L"CRC",
+		L"Hash",
+		L"Write",
+		L"Copy",
+	};
+
+	std::atomic<UINT> timingSampleRate(0);
+	LONGLONG performanceFrequency;
+}
+
+// Only the owning thread updates the counters, relaxed atomics make it safe
+// to read them while a snapshot is taken.
+struct RarStats::ThreadCounters {
+	std::atomic<ULONGLONG> calls[stageCount];
+	std::atomic<ULONGLONG> histogram[stageCount][m_histogramBuckets];
+	std::atomic<ULONGLONG> bytesScanned;
+	std::atomic<ULONGLONG> bytesReadUnbuffered;
+	UINT sampleCounter;
+
+	static void Increment(std::atomic<ULONGLONG>& counter, ULONGLONG value = 1) {
+		counter.store(counter.load(std::memory_order_relaxed) + value,
+			std::memory_order_relaxed);
+	}
+
+	// Moves the counts to total, the caller holds the pool mutex.
+	void MoveTo(ThreadCounters& total) {
+		for(size_t i = 0; i < stageCount; i++) {
+			Increment(total.calls[i], calls[i].exchange(0, std::memory_order_relaxed));
+
+			for(size_t j = 0; j < m_histogramBuckets; j++) {
+				Increment(total.histogram[i][j], histogram[i][j].exchange(0, std::memory_order_relaxed));
+			}
+		}
+
+		Increment(total.bytesScanned, bytesScanned.exchange(0, std::memory_order_relaxed));
+		Increment(total.bytesReadUnbuffered, bytesReadUnbuffered.exchange(0, std::memory_order_relaxed));
+		sampleCounter = 0;
+	}
+};
+
+// The counters of the running threads, the unused counters of the threads
+// which exited, and the total of the threads which exited.
+struct RarStats::ThreadCountersPool {
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ThreadCounters>> list;
+	std::vector<ThreadCounters*> unused;
+	ThreadCounters exited = {};
+};
+
+struct RarStats::ThreadCountersOwner {
+	ThreadCounters* counters = nullptr;
+
+	~ThreadCountersOwner() {
+		if(counters) {
+			ReleaseThreadCounters(counters);
+		}
+	}
+};
+
+std::atomic<LONGLONG> RarStats::m_systemCacheBaseline(-1);
+// Never destroyed, since a thread can exit after the static objects are.
+RarStats::ThreadCountersPool* RarStats::m_threadCountersPool = new RarStats::ThreadCountersPool;
+std::mutex RarStats::m_devicesMutex;
+std::vector<RarStats::DeviceConcurrency> RarStats::m_devices;
+thread_local RarStats::ThreadCountersOwner RarStats::m_threadCounters;
+
+RarStats::StageTimer::StageTimer(stage s) : m_stage(s), m_start(0)
+{
+	UINT sampleRate = timingSampleRate.load(std::memory_order_relaxed);
+	if(sampleRate == 0) {
+		return;
+	}
+
+	ThreadCounters& counters = GetThreadCounters();
+	ThreadCounters::Increment(counters.calls[static_cast<size_t>(s)]);
+
+	if(++counters.sampleCounter >= sampleRate) {
+		counters.sampleCounter = 0;
+
+		LARGE_INTEGER counter;
+		::QueryPerformanceCounter(&counter);
+		m_start = counter.QuadPart;
+	}
+}
+
+RarStats::StageTimer::~StageTimer()
+{
+	if(m_start == 0) {
+		return;
+	}
+
+	LARGE_INTEGER counter;
+	::QueryPerformanceCounter(&counter);
+
+	ULONGLONG ticks = static_cast<ULONGLONG>(counter.QuadPart - m_start);
+	ULONGLONG nanoseconds = static_cast<ULONGLONG>(
+		static_cast<double>(ticks) * 1000000000.0 / performanceFrequency);
+
+	ThreadCounters& counters = GetThreadCounters();
+	ThreadCounters::Increment(counters.histogram[static_cast<size_t>(m_stage)][GetHistogramBucket(nanoseconds)]);
+}
+
+void RarStats::EnableTiming(UINT sampleRate /*= 1*/)
+{
+	assert(sampleRate > 0);
+
+	LARGE_INTEGER frequency;
+	::QueryPerformanceFrequency(&frequency);
+	performanceFrequency = frequency.QuadPart;
+
+	timingSampleRate = sampleRate;
+}
+
+void RarStats::DisableTiming()
+{
+	timingSampleRate = 0;
+}
+
+void RarStats::AddBytesScanned(ULONGLONG bytes)
+{
+	if(timingSampleRate.load(std::memory_order_relaxed) == 0) {
+		return;
+	}
+
+	ThreadCounters::Increment(GetThreadCounters().bytesScanned, bytes);
+}
+
+void RarStats::AddBytesReadUnbuffered(ULONGLONG bytes)
+{
+	if(timingSampleRate.load(std::memory_order_relaxed) == 0) {
+		return;
+	}
+
+	ThreadCounters::Increment(GetThreadCounters().bytesReadUnbuffered, bytes);
+}
+
+void RarStats::StartSystemCacheMeasurement()
+{
+	ULONGLONG size;
+	if(GetSystemCacheSize(size)) {
+		m_systemCacheBaseline = static_cast<LONGLONG>(size);
+	}
+}
+
+void RarStats::AddDeviceConcurrency(const DeviceConcurrency& concurrency)
+{
+	std::lock_guard<std::mutex> lock(m_devicesMutex);
+	m_devices.push_back(concurrency);
+}
+
+void RarStats::GetSnapshot(Snapshot& snapshot)
+{
+	std::vector<ULONGLONG> histogram(stageCount * m_histogramBuckets);
+
+	snapshot = Snapshot{};
+
+	{
+		ThreadCountersPool& pool = *m_threadCountersPool;
+		std::lock_guard<std::mutex> lock(pool.mutex);
+
+		auto addCounters = [&](const ThreadCounters* counters) {
+			for(size_t i = 0; i < stageCount; i++) {
+				snapshot.stages[i].calls += counters->calls[i].load(std::memory_order_relaxed);
+
+				for(size_t j = 0; j < m_histogramBuckets; j++) {
+					histogram[i * m_histogramBuckets + j] +=
+						counters->histogram[i][j].load(std::memory_order_relaxed);
+				}
+			}
+
+			snapshot.bytesScanned += counters->bytesScanned.load(std::memory_order_relaxed);
+			snapshot.bytesReadUnbuffered += counters->bytesReadUnbuffered.load(std::memory_order_relaxed);
+		};
+
+		// The unused counters are zero.
+		for(const auto& counters : pool.list) {
+			addCounters(counters.get());
+		}
+
+		addCounters(&pool.exited);
+	}
+
+	LONGLONG systemCacheBaseline = m_systemCacheBaseline;
+	ULONGLONG systemCacheSize;
+	if(systemCacheBaseline >= 0 && GetSystemCacheSize(systemCacheSize)) {
+		snapshot.systemCacheMeasured = true;
+		snapshot.systemCacheGrowth = static_cast<LONGLONG>(systemCacheSize) - systemCacheBaseline;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_devicesMutex);
+		snapshot.devices = m_devices;
+	}
+
+	for(size_t i = 0; i < stageCount; i++) {
+		const ULONGLONG* stageHistogram = &histogram[i * m_histogramBuckets];
+		StageSnapshot& stageSnapshot = snapshot.stages[i];
+
+		for(size_t j = 0; j < m_histogramBuckets; j++) {
+			stageSnapshot.samples += stageHistogram[j];
+		}
+
+		if(stageSnapshot.samples == 0) {
+			continue;
+		}
+
+		ULONGLONG p50Rank = (stageSnapshot.samples * 50 + 99) / 100;
+		ULONGLONG p99Rank = (stageSnapshot.samples * 99 + 99) / 100;
+		ULONGLONG accumulated = 0;
+
+		for(size_t j = 0; j < m_histogramBuckets; j++) {
+			ULONGLONG before = accumulated;
+			accumulated += stageHistogram[j];
+
+			if(before < p50Rank && accumulated >= p50Rank) {
+				stageSnapshot.p50 = GetHistogramBucketValue(j);
+			}
+
+			if(before < p99Rank && accumulated >= p99Rank) {
+				stageSnapshot.p99 = GetHistogramBucketValue(j);
+				break;
+			}
+		}
+	}
+}
+
+CString RarStats::FormatSnapshot(const Snapshot& snapshot)
+{
+	CString text;
+
+	for(size_t i = 0; i < stageCount; i++) {
+		const StageSnapshot& stageSnapshot = snapshot.stages[i];
+
+		CString line;
+		if(stageSnapshot.samples > 0) {
+			line.Format(L"%s: %I64u calls, p50 %.1f us, p99 %.1f us\n",
+				stageNames[i], stageSnapshot.calls,
+				stageSnapshot.p50 / 1000.0, stageSnapshot.p99 / 1000.0);
+		} else {
+			line.Format(L"%s: %I64u calls\n", stageNames[i], stageSnapshot.calls);
+		}
+
+		text += line;
+	}
+
+	CString line;
+	line.Format(L"Bytes scanned: %I64u", snapshot.bytesScanned);
+	text += line;
+
+	if(snapshot.bytesReadUnbuffered > 0) {
+		line.Format(L"\nBytes read without the file cache: %I64u", snapshot.bytesReadUnbuffered);
+		text += line;
+	}
+
+	// Per thousand opened files.
+	if(snapshot.systemCacheMeasured) {
+		ULONGLONG files = snapshot.stages[static_cast<size_t>(stage::open)].calls;
+		line.Format(L"\nSystem file cache growth: %I64d KB", snapshot.systemCacheGrowth / 1024);
+		text += line;
+
+		if(files > 0) {
+			line.Format(L" (%.1f KB per 1000 files)",
+				snapshot.systemCacheGrowth / 1024.0 * 1000.0 / files);
+			text += line;
+		}
+	}
+
+	for(const auto& device : snapshot.devices) {
+		line.Format(L"\n%s: %u archives in flight (peak %u), %I64u archives, %.0f per second, %.1f us each",
+			device.device.GetString(), device.limit, device.peakLimit, device.archives,
+			device.archivesPerSecond, device.latency);
+		text += line;
+	}
+
+	return text;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+RarStats::ThreadCounters& RarStats::GetThreadCounters()
+{
+	ThreadCountersOwner& owner = m_threadCounters;
+	if(!owner.counters) {
+		ThreadCountersPool& pool = *m_threadCountersPool;
+		std::lock_guard<std::mutex> lock(pool.mutex);
+
+		if(!pool.unused.empty()) {
+			owner.counters = pool.unused.back();
+			pool.unused.pop_back();
+		} else {
+			std::unique_ptr<ThreadCounters> counters(new ThreadCounters{});
+			owner.counters = counters.get();
+			pool.list.push_back(std::move(counters));
+		}
+	}
+
+	return *owner.counters;
+}
+
+// Called when the thread which used the counters exits.
+void RarStats::ReleaseThreadCounters(ThreadCounters* counters)
+{
+	ThreadCountersPool& pool = *m_threadCountersPool;
+	std::lock_guard<std::mutex> lock(pool.mutex);
+
+	counters->MoveTo(pool.exited);
+	pool.unused.push_back(counters);
+}
+
+// Four buckets per power of two, the error is at most 25%.
+size_t RarStats::GetHistogramBucket(ULONGLONG value)
+{
+	if(value < 4) {
+		return static_cast<size_t>(value);
+	}
+
+	size_t msb = 0;
+	for(ULONGLONG v = value; v > 1; v >>= 1) {
+		msb++;
+	}
+
+	size_t sub = static_cast<size_t>(value >> (msb - 2)) & 3;
+	return 4 * (msb - 1) + sub;
+}
+
+ULONGLONG RarStats::GetHistogramBucketValue(size_t bucket)
+{
+	if(bucket < 4) {
+		return bucket;
+	}
+
+	size_t msb = bucket / 4 + 1;
+	size_t sub = bucket % 4;
+	return static_cast<ULONGLONG>(4 + sub) << (msb - 2);
+}
+
+// The system cache working set, which holds the file data read through the
+// cache or mapped by any process.
+bool RarStats::GetSystemCacheSize(ULONGLONG& size)
+{
+	PERFORMANCE_INFORMATION info;
+	if(!::GetPerformanceInfo(&info, sizeof(info))) {
+		return false;
+	}
+
+	size = static_cast<ULONGLONG>(info.SystemCache) * info.PageSize;
+	return true;
+}
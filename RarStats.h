@@ -0,0 +1,94 @@
+#pragma once
+
+// Instrumentation of the archive processing stages. Nothing is recorded
+// until timing is enabled, so that threads don't allocate counters when
+// the statistics aren't shown. Then calls are counted per thread and
+// merged when a snapshot is taken, and one of every sampleRate calls is
+// timed. The counters of a thread are added to a total when it exits and
+// reused by the next thread.
+class RarStats {
+public:
+	enum class stage {
+		locate,
+		classify,
+		open,
+		map,
+		read,
+		find_signature,
+		parse_header,
+		crc,
+		hash,
+		write,
+		copy,
+		count
+	};
+
+	struct StageSnapshot {
+		ULONGLONG calls;
+		ULONGLONG samples;
+		ULONGLONG p50; // nanoseconds
+		ULONGLONG p99; // nanoseconds
+	};
+
+	// The concurrency chosen for a device by RarScheduler::RunAdaptive.
+	struct DeviceConcurrency {
+		CString device;
+		unsigned int limit; // at the end of the run
+		unsigned int peakLimit;
+		ULONGLONG archives;
+		double archivesPerSecond;
+		double latency; // microseconds per archive, at the end of the run
+	};
+
+	struct Snapshot {
+		StageSnapshot stages[static_cast<size_t>(stage::count)];
+		ULONGLONG bytesScanned;
+		ULONGLONG bytesReadUnbuffered;
+		bool systemCacheMeasured;
+		LONGLONG systemCacheGrowth; // bytes, since StartSystemCacheMeasurement
+		std::vector<DeviceConcurrency> devices;
+	};
+
+	class StageTimer {
+	public:
+		explicit StageTimer(stage s);
+		~StageTimer();
+
+		StageTimer(const StageTimer&) = delete;
+		StageTimer& operator=(const StageTimer&) = delete;
+
+	private:
+		stage m_stage;
+		LONGLONG m_start;
+	};
+
+	static void EnableTiming(UINT sampleRate = 1);
+	static void DisableTiming();
+	static void AddBytesScanned(ULONGLONG bytes);
+	static void AddBytesReadUnbuffered(ULONGLONG bytes);
+	// Records the size of the system file cache, the growth is included in
+	// later snapshots. It's system wide, so other processes affect it too.
+	static void StartSystemCacheMeasurement();
+	static void AddDeviceConcurrency(const DeviceConcurrency& concurrency);
+	static void GetSnapshot(Snapshot& snapshot);
+	static CString FormatSnapshot(const Snapshot& snapshot);
+
+private:
+	struct ThreadCounters;
+	struct ThreadCountersPool;
+	struct ThreadCountersOwner;
+
+	static ThreadCounters& GetThreadCounters();
+	static void ReleaseThreadCounters(ThreadCounters* counters);
+	static size_t GetHistogramBucket(ULONGLONG value);
+	static bool GetSystemCacheSize(ULONGLONG& size);
+	static ULONGLONG GetHistogramBucketValue(size_t bucket);
+
+	static const size_t m_histogramBuckets = 252;
+
+	static std::atomic<LONGLONG> m_systemCacheBaseline; // -1 if not measured
+	static ThreadCountersPool* m_threadCountersPool;
+	static std::mutex m_devicesMutex;
+	static std::vector<DeviceConcurrency> m_devices;
+	static thread_local ThreadCountersOwner m_threadCounters;
+};
@@ -0,0 +1,211 @@
+#include "stdafx.h"
+#include "RarStatsReport.h"
+#include "RarClassifier.h"
+#include "RarListing.h"
+#include "RarScheduler.h"
+
+namespace
+{
+	void CollectArchive(const CString& fileName, bool fastReject,
+		RarStatsReport::ArchiveStats& archive, RarStatsReport::Totals& totals)
+	{
+		archive.fileName = fileName;
+		archive.solid = false;
+		archive.files = 0;
+		archive.directories = 0;
+		archive.packedSize = 0;
+		archive.unpackedSize = 0;
+		archive.bytesRead = 0;
+
+		std::vector<RarListing::Entry> entries;
+		RarListing::Stats stats;
+		if(fastReject && RarClassifier::Classify(fileName) == RarClassifier::result::not_archive) {
+			archive.error = RarFile::error::invalid_file;
+		} else {
+			archive.error = RarListing::List(fileName, entries, stats);
+		}
+
+		totals.archives++;
+
+		if(archive.error != RarFile::error::success) {
+			totals.failedArchives++;
+			return;
+		}
+
+		archive.solid = (stats.archiveFlags & RarFile::solid) != 0;
+		archive.bytesRead = stats.bytesRead;
+
+		for(const auto& entry : entries) {
+			if(entry.directory) {
+				archive.directories++;
+				continue;
+			}
+
+			archive.files++;
+			archive.packedSize += entry.packedSize;
+			archive.unpackedSize += entry.size;
+
+			totals.methods[entry.compressionMethod]++;
+			if(entry.compressionMethod != 0) {
+				totals.dictionarySizes[entry.dictionarySize]++;
+			}
+		}
+
+		if(archive.solid) {
+			totals.solidArchives++;
+		}
+
+		totals.files += archive.files;
+		totals.directories += archive.directories;
+		totals.packedSize += archive.packedSize;
+		totals.unpackedSize += archive.unpackedSize;
+		totals.bytesRead += archive.bytesRead;
+	}
+
+	CString FormatSize(ULONGLONG size)
+	{
+		const WCHAR* units[] = { L"B", L"KB", L"MB", L"GB", L"TB", L"PB" };
+		size_t unit = 0;
+		while(size >= 1024 && size % 1024 == 0 && unit < _countof(units) - 1) {
+			size /= 1024;
+			unit++;
+		}
+
+		CString str;
+		str.Format(L"%I64u %s", size, units[unit]);
+		return str;
+	}
+}
+
+RarStatsReport::Totals::Totals()
+	: archives(0), failedArchives(0), solidArchives(0), files(0), directories(0),
+	packedSize(0), unpackedSize(0), bytesRead(0), methods()
+{
+}
+
+void RarStatsReport::Totals::Merge(const Totals& other)
+{
+	archives += other.archives;
+	failedArchives += other.failedArchives;
+	solidArchives += other.solidArchives;
+	files += other.files;
+	directories += other.directories;
+	packedSize += other.packedSize;
+	unpackedSize += other.unpackedSize;
+	bytesRead += other.bytesRead;
+
+	for(int i = 0; i < methodCount; i++) {
+		methods[i] += other.methods[i];
+	}
+
+	for(const auto& entry : other.dictionarySizes) {
+		dictionarySizes[entry.first] += entry.second;
+	}
+}
+
+void RarStatsReport::Collect(const std::vector<CString>& fileNames, unsigned int threadCount,
+	bool fastReject, bool extentOrder, std::vector<ArchiveStats>& archives, Totals& totals)
+{
+	archives.resize(fileNames.size());
+
+	std::vector<RarScheduler::Device> devices;
+	if(extentOrder) {
+		RarScheduler::Plan(fileNames, devices);
+	} else {
+		// A single device without a seek penalty, in the given order.
+		RarScheduler::Device device;
+		device.items.resize(fileNames.size());
+		for(size_t i = 0; i < device.items.size(); i++) {
+			device.items[i] = i;
+		}
+
+		device.seekPenalty = false;
+		devices.push_back(std::move(device));
+	}
+
+	// The archives are handed out one at a time, so that a few large
+	// archives don't leave the other threads idle.
+	std::vector<Totals> threadTotals(std::max<size_t>(threadCount, 1));
+	RarScheduler::Run(devices, threadCount, [&](size_t i, unsigned int thread) {
+		CollectArchive(fileNames[i], fastReject, archives[i], threadTotals[thread]);
+	});
+
+	totals = Totals();
+	for(const auto& partialTotals : threadTotals) {
+		totals.Merge(partialTotals);
+	}
+}
+
+// Tab-separated UTF-8 lines, one per archive: path, error code, solid,
+// files, directories, packed size, unpacked size, header bytes read.
+// The totals follow as comment lines.
+bool RarStatsReport::Write(const TCHAR* fileName, const std::vector<ArchiveStats>& archives,
+	const Totals& totals)
+{
+	CAtlFile file;
+	HRESULT hr = file.Create(fileName, GENERIC_WRITE, 0, CREATE_ALWAYS);
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	CStringA data;
+	for(const auto& archive : archives) {
+		CStringA line;
+		line.Format("\t%d\t%d\t%Iu\t%Iu\t%I64u\t%I64u\t%I64u\r\n",
+			static_cast<int>(archive.error), archive.solid ? 1 : 0, archive.files,
+			archive.directories, archive.packedSize, archive.unpackedSize, archive.bytesRead);
+
+		data += CW2A(archive.fileName, CP_UTF8);
+		data += line;
+	}
+
+	CString totalsText = FormatTotals(totals);
+	int position = 0;
+	CString totalsLine = totalsText.Tokenize(L"\n", position);
+	while(position != -1) {
+		data += "# ";
+		data += CW2A(totalsLine, CP_UTF8);
+		data += "\r\n";
+		totalsLine = totalsText.Tokenize(L"\n", position);
+	}
+
+	hr = file.Write(data.GetString(), data.GetLength());
+	if(FAILED(hr)) {
+		return false;
+	}
+
+	return true;
+}
+
+CString RarStatsReport::FormatTotals(const Totals& totals)
+{
+	CString str;
+	str.Format(L"Archives: %Iu (%Iu solid, %Iu could not be read)\n"
+		L"Files: %Iu, directories: %Iu\n"
+		L"Packed size: %I64u, unpacked size: %I64u\n"
+		L"Header bytes read: %I64u\n",
+		totals.archives, totals.solidArchives, totals.failedArchives,
+		totals.files, totals.directories,
+		totals.packedSize, totals.unpackedSize,
+		totals.bytesRead);
+
+	const WCHAR* methodNames[methodCount] = {
+		L"stored", L"fastest", L"fast", L"normal", L"good", L"best"
+	};
+
+	str += L"Compression methods:";
+	for(int i = 0; i < methodCount; i++) {
+		CString method;
+		method.Format(L" %s %Iu", methodNames[i], totals.methods[i]);
+		str += method;
+	}
+
+	str += L"\nDictionary sizes:";
+	for(const auto& entry : totals.dictionarySizes) {
+		CString dictionary;
+		dictionary.Format(L" %s %Iu", FormatSize(entry.first).GetString(), entry.second);
+		str += dictionary;
+	}
+
+	return str;
+}
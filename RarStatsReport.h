@@ -0,0 +1,47 @@
+#pragma once
+
+#include "RarFile.h"
+
+// Collects content statistics of many archives from their headers only,
+// using several threads. Each thread aggregates into its own totals, which
+// are merged when all the archives were processed.
+class RarStatsReport {
+public:
+	static const int methodCount = 6;
+
+	struct ArchiveStats {
+		CString fileName;
+		RarFile::error error;
+		bool solid;
+		size_t files;
+		size_t directories;
+		ULONGLONG packedSize;
+		ULONGLONG unpackedSize;
+		ULONGLONG bytesRead; // header bytes read after the main header
+	};
+
+	struct Totals {
+		size_t archives;
+		size_t failedArchives;
+		size_t solidArchives;
+		size_t files;
+		size_t directories;
+		ULONGLONG packedSize;
+		ULONGLONG unpackedSize;
+		ULONGLONG bytesRead;
+		size_t methods[methodCount]; // file count per compression method
+		std::map<ULONGLONG, size_t> dictionarySizes; // file count per size, compressed files only
+
+		Totals();
+		void Merge(const Totals& other);
+	};
+
+	// With fastReject, the files which RarClassifier rejects aren't opened.
+	// With extentOrder, the archives are read in their order on disk, see
+	// RarScheduler.
+	static void Collect(const std::vector<CString>& fileNames, unsigned int threadCount,
+		bool fastReject, bool extentOrder, std::vector<ArchiveStats>& archives, Totals& totals);
+	static bool Write(const TCHAR* fileName, const std::vector<ArchiveStats>& archives,
+		const Totals& totals);
+	static CString FormatTotals(const Totals& totals);
+};
@@ -0,0 +1,467 @@
+#include "stdafx.h"
+#include "RarTarStream.h"
+#include "RarClassifier.h"
+
+RarTarStream::error RarTarStream::GetStatus(HANDLE input, HANDLE output,
+	std::vector<RarBatch::Result>& results)
+{
+	m_input = input;
+	m_output = output;
+	return Process(false, false, results);
+}
+
+RarTarStream::error RarTarStream::SetLocked(HANDLE input, HANDLE output, bool locked,
+	std::vector<RarBatch::Result>& results)
+{
+	m_input = input;
+	m_output = output;
+	return Process(true, locked, results);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+RarTarStream::error RarTarStream::Process(bool modify, bool locked,
+	std::vector<RarBatch::Result>& results)
+{
+	results.clear();
+
+	// Set by the metadata members which precede a member.
+	CString longName;
+	CString paxPath;
+	bool hasPaxSize = false;
+	ULONGLONG paxSize = 0;
+
+	for(;;) {
+		BYTE header[m_blockSize];
+		size_t bytesRead;
+		error err = Read(header, m_blockSize, bytesRead);
+		if(err != error::success) {
+			return err;
+		}
+
+		if(bytesRead == 0) {
+			return error::success; // no end of archive blocks
+		}
+
+		if(bytesRead < m_blockSize) {
+			return error::invalid_stream;
+		}
+
+		err = Write(header, m_blockSize);
+		if(err != error::success) {
+			return err;
+		}
+
+		// The end of archive blocks are copied with anything which follows.
+		if(std::all_of(header, header + m_blockSize, [](BYTE b) { return b == 0; })) {
+			return CopyToEnd();
+		}
+
+		ULONGLONG size;
+		if(!VerifyChecksum(header) || !ParseNumber(header + 124, 12, size)) {
+			return error::invalid_stream;
+		}
+
+		char type = static_cast<char>(header[156]);
+		bool metadata = type == 'L' || type == 'K' || type == 'x' || type == 'g';
+
+		if(!metadata && hasPaxSize) {
+			size = paxSize;
+		}
+
+		ULONGLONG padding = (m_blockSize - size % m_blockSize) % m_blockSize;
+
+		if((type == 'L' || type == 'x') && size <= m_maxMetadataSize) {
+			std::vector<BYTE> data(static_cast<size_t>(size));
+			err = ReadExact(data.data(), data.size());
+			if(err == error::success) {
+				err = Write(data.data(), data.size());
+			}
+
+			if(err != error::success) {
+				return err;
+			}
+
+			if(type == 'L') {
+				const char* name = reinterpret_cast<const char*>(data.data());
+				longName = DecodeName(name, strnlen(name, data.size()));
+			} else {
+				ParsePaxRecords(data, paxPath, hasPaxSize, paxSize);
+			}
+		} else if(type == '0' || type == '\0' || type == '7') {
+			CString name = GetName(header);
+			if(!longName.IsEmpty()) {
+				name = longName;
+			}
+
+			if(!paxPath.IsEmpty()) {
+				name = paxPath;
+			}
+
+			err = ProcessMember(name, size, modify, locked, results);
+		} else {
+			err = Copy(size);
+		}
+
+		if(err == error::success) {
+			err = Copy(padding);
+		}
+
+		if(err != error::success) {
+			return err;
+		}
+
+		if(!metadata) {
+			longName.Empty();
+			paxPath.Empty();
+			hasPaxSize = false;
+		}
+	}
+}
+
+RarTarStream::error RarTarStream::ProcessMember(const CString& name, ULONGLONG size,
+	bool modify, bool locked, std::vector<RarBatch::Result>& results)
+{
+	m_buffer.clear();
+	m_bufferOffset = 0;
+
+	error err = FillBuffer(static_cast<size_t>(std::min<ULONGLONG>(size, m_prefixSize)));
+	if(err != error::success) {
+		return err;
+	}
+
+	ULONGLONG archiveOffset;
+	if(RarClassifier::LocateArchive(m_buffer.data(), m_buffer.size(), archiveOffset) &&
+		archiveOffset < size) {
+		// The executable image of an SFX archive is copied through.
+		if(archiveOffset > m_bufferOffset + m_buffer.size()) {
+			err = FlushBuffer();
+			if(err == error::success) {
+				err = Copy(archiveOffset - m_bufferOffset);
+			}
+
+			if(err != error::success) {
+				return err;
+			}
+
+			m_bufferOffset = archiveOffset;
+		}
+
+		ULONGLONG windowEnd = std::min<ULONGLONG>(size, archiveOffset + m_windowSize);
+		err = FillBuffer(static_cast<size_t>(windowEnd - m_bufferOffset));
+		if(err != error::success) {
+			return err;
+		}
+
+		InspectArchive(name, m_buffer.data() + static_cast<size_t>(archiveOffset - m_bufferOffset),
+			static_cast<size_t>(windowEnd - archiveOffset), modify, locked, results);
+	}
+
+	ULONGLONG copiedSize = m_bufferOffset + m_buffer.size();
+
+	err = FlushBuffer();
+	if(err != error::success) {
+		return err;
+	}
+
+	return Copy(size - copiedSize);
+}
+
+void RarTarStream::InspectArchive(const CString& name, BYTE* data, size_t size,
+	bool modify, bool locked, std::vector<RarBatch::Result>& results)
+{
+	// Without a signature, e.g. an executable which isn't an SFX archive,
+	// the member isn't reported.
+	RarFile archive;
+	if(archive.OpenBuffer(data, size, modify, size) != RarFile::error::success) {
+		return;
+	}
+
+	RarBatch::Result result;
+	result.fileName = name;
+	result.rarVersion = archive.GetRarVersion();
+	result.flags = 0;
+	result.modified = false;
+
+	result.error = archive.GetFlags(result.flags);
+	if(result.error == RarFile::error::success && modify) {
+		bool oldLocked = (result.flags & RarFile::locked) != 0;
+		result.error = archive.SetLocked(locked);
+		if(result.error == RarFile::error::success) {
+			result.modified = oldLocked != locked;
+			archive.GetFlags(result.flags);
+		}
+	}
+
+	results.push_back(result);
+}
+
+// Reads until the buffer is full or the stream ends. The end of a pipe is
+// reported as an error by ReadFile.
+RarTarStream::error RarTarStream::Read(void* buffer, size_t size, size_t& bytesRead)
+{
+	bytesRead = 0;
+
+	while(bytesRead < size) {
+		DWORD chunkRead;
+		if(!::ReadFile(m_input, static_cast<BYTE*>(buffer) + bytesRead,
+			static_cast<DWORD>(size - bytesRead), &chunkRead, NULL)) {
+			if(::GetLastError() == ERROR_BROKEN_PIPE) {
+				break;
+			}
+
+			return error::read_failed;
+		}
+
+		if(chunkRead == 0) {
+			break;
+		}
+
+		bytesRead += chunkRead;
+	}
+
+	return error::success;
+}
+
+RarTarStream::error RarTarStream::ReadExact(void* buffer, size_t size)
+{
+	size_t bytesRead;
+	error err = Read(buffer, size, bytesRead);
+	if(err != error::success) {
+		return err;
+	}
+
+	return bytesRead == size ? error::success : error::invalid_stream; // truncated
+}
+
+RarTarStream::error RarTarStream::Write(const void* buffer, size_t size)
+{
+	if(!m_output) {
+		return error::success;
+	}
+
+	size_t bytesWritten = 0;
+
+	while(bytesWritten < size) {
+		DWORD chunkWritten;
+		if(!::WriteFile(m_output, static_cast<const BYTE*>(buffer) + bytesWritten,
+			static_cast<DWORD>(size - bytesWritten), &chunkWritten, NULL)) {
+			return error::write_failed;
+		}
+
+		bytesWritten += chunkWritten;
+	}
+
+	return error::success;
+}
+
+RarTarStream::error RarTarStream::Copy(ULONGLONG size)
+{
+	if(size == 0) {
+		return error::success;
+	}
+
+	m_copyBuffer.resize(m_copySize);
+
+	while(size > 0) {
+		size_t chunkSize = static_cast<size_t>(std::min<ULONGLONG>(size, m_copySize));
+		error err = ReadExact(m_copyBuffer.data(), chunkSize);
+		if(err == error::success) {
+			err = Write(m_copyBuffer.data(), chunkSize);
+		}
+
+		if(err != error::success) {
+			return err;
+		}
+
+		size -= chunkSize;
+	}
+
+	return error::success;
+}
+
+RarTarStream::error RarTarStream::CopyToEnd()
+{
+	m_copyBuffer.resize(m_copySize);
+
+	for(;;) {
+		size_t bytesRead;
+		error err = Read(m_copyBuffer.data(), m_copySize, bytesRead);
+		if(err == error::success) {
+			err = Write(m_copyBuffer.data(), bytesRead);
+		}
+
+		if(err != error::success || bytesRead < m_copySize) {
+			return err;
+		}
+	}
+}
+
+// Extends the buffer to size bytes from m_bufferOffset.
+RarTarStream::error RarTarStream::FillBuffer(size_t size)
+{
+	size_t oldSize = m_buffer.size();
+	if(size <= oldSize) {
+		return error::success;
+	}
+
+	m_buffer.resize(size);
+	return ReadExact(m_buffer.data() + oldSize, size - oldSize);
+}
+
+RarTarStream::error RarTarStream::FlushBuffer()
+{
+	error err = Write(m_buffer.data(), m_buffer.size());
+	if(err != error::success) {
+		return err;
+	}
+
+	m_bufferOffset += m_buffer.size();
+	m_buffer.clear();
+	return error::success;
+}
+
+// The checksum is the sum of the header bytes, with the checksum field
+// taken as spaces. Some old implementations summed signed bytes.
+bool RarTarStream::VerifyChecksum(const BYTE* header)
+{
+	ULONGLONG storedSum;
+	if(!ParseNumber(header + 148, 8, storedSum)) {
+		return false;
+	}
+
+	ULONGLONG sum = 0;
+	LONGLONG signedSum = 0;
+	for(size_t i = 0; i < m_blockSize; i++) {
+		BYTE b = (i >= 148 && i < 156) ? ' ' : header[i];
+		sum += b;
+		signedSum += static_cast<signed char>(b);
+	}
+
+	return storedSum == sum || storedSum == static_cast<ULONGLONG>(signedSum);
+}
+
+// Octal digits, padded with spaces or nulls, or a big-endian binary value
+// after a byte with the high bit set (GNU and star, for large sizes).
+bool RarTarStream::ParseNumber(const BYTE* field, size_t size, ULONGLONG& value)
+{
+	value = 0;
+
+	if(field[0] & 0x80) {
+		if(field[0] != 0x80) {
+			return false; // negative, or too large
+		}
+
+		for(size_t i = 1; i < size; i++) {
+			if(value >> 56) {
+				return false;
+			}
+
+			value = (value << 8) | field[i];
+		}
+
+		return true;
+	}
+
+	size_t i = 0;
+	while(i < size && field[i] == ' ') {
+		i++;
+	}
+
+	for(; i < size && field[i] >= '0' && field[i] <= '7'; i++) {
+		if(value >> 61) {
+			return false;
+		}
+
+		value = (value << 3) | (field[i] - '0');
+	}
+
+	for(; i < size; i++) {
+		if(field[i] != ' ' && field[i] != '\0') {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// The name field, after the prefix field of a ustar header.
+CString RarTarStream::GetName(const BYTE* header)
+{
+	const char* name = reinterpret_cast<const char*>(header);
+	CString result = DecodeName(name, strnlen(name, 100));
+
+	if(memcmp(header + 257, "ustar", 5) == 0) {
+		const char* prefix = reinterpret_cast<const char*>(header + 345);
+		size_t prefixLength = strnlen(prefix, 155);
+		if(prefixLength > 0) {
+			result = DecodeName(prefix, prefixLength) + L"/" + result;
+		}
+	}
+
+	return result;
+}
+
+// pax names are UTF-8, other names are usually UTF-8 too.
+CString RarTarStream::DecodeName(const char* name, size_t length)
+{
+	CString result;
+	int wideLength = ::MultiByteToWideChar(CP_UTF8, 0, name, static_cast<int>(length), NULL, 0);
+	if(wideLength > 0) {
+		::MultiByteToWideChar(CP_UTF8, 0, name, static_cast<int>(length),
+			result.GetBuffer(wideLength), wideLength);
+		result.ReleaseBuffer(wideLength);
+	}
+
+	return result;
+}
+
+// Records of the form "length key=value\n", where length includes the
+// whole record.
+void RarTarStream::ParsePaxRecords(const std::vector<BYTE>& data, CString& path,
+	bool& hasSize, ULONGLONG& size)
+{
+	const char* p = reinterpret_cast<const char*>(data.data());
+	const char* end = p + data.size();
+
+	while(p < end) {
+		size_t length = 0;
+		const char* q = p;
+		for(; q < end && *q >= '0' && *q <= '9'; q++) {
+			length = length * 10 + (*q - '0');
+		}
+
+		if(q == p || q >= end || *q != ' ' || length > static_cast<size_t>(end - p) ||
+			length < static_cast<size_t>(q - p) + 2 || p[length - 1] != '\n') {
+			return; // malformed, the remaining records are ignored
+		}
+
+		const char* key = q + 1;
+		const char* recordEnd = p + length - 1;
+		const char* separator = std::find(key, recordEnd, '=');
+		if(separator != recordEnd) {
+			const char* value = separator + 1;
+			size_t keyLength = separator - key;
+			size_t valueLength = recordEnd - value;
+
+			if(keyLength == 4 && memcmp(key, "path", 4) == 0) {
+				path = DecodeName(value, valueLength);
+			} else if(keyLength == 4 && memcmp(key, "size", 4) == 0) {
+				ULONGLONG recordSize = 0;
+				bool valid = valueLength > 0;
+				for(size_t i = 0; i < valueLength && valid; i++) {
+					valid = value[i] >= '0' && value[i] <= '9' && recordSize <= (~0ULL - 9) / 10;
+					recordSize = recordSize * 10 + (value[i] - '0');
+				}
+
+				if(valid) {
+					hasSize = true;
+					size = recordSize;
+				}
+			}
+		}
+
+		p += length;
+	}
+}
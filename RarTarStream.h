@@ -0,0 +1,71 @@
+#pragma once
+
+#include "RarBatch.h"
+
+// Processes the RAR archives inside a tar stream in a single pass, without
+// unpacking it. The stream is read sequentially, e.g. from a pipe, and can
+// be written to an output stream as it's read, with the lock attribute of
+// the archives changed.
+//
+// Only the tar headers and the beginning of each member are buffered. A
+// member is located as an archive by RarClassifier::LocateArchive from its
+// first bytes, which for an SFX executable hold the PE headers. The bytes
+// up to the archive are copied through, and a window which starts at the
+// archive is parsed by RarFile, which patches the main header in place.
+// The rest of the member is copied through.
+//
+// ustar, GNU long names and pax path and size records are understood, other
+// member types are copied unchanged. Members which aren't archives aren't
+// reported, the archives are reported by their path in the tar stream.
+class RarTarStream {
+public:
+	enum class error {
+		success,
+		read_failed,
+		write_failed,
+		invalid_stream
+	};
+
+	RarTarStream() = default;
+	~RarTarStream() = default;
+
+	RarTarStream(const RarTarStream&) = delete;
+	RarTarStream& operator=(const RarTarStream&) = delete;
+
+	// The stream is written unchanged to output unless it's NULL.
+	error GetStatus(HANDLE input, HANDLE output, std::vector<RarBatch::Result>& results);
+	error SetLocked(HANDLE input, HANDLE output, bool locked, std::vector<RarBatch::Result>& results);
+
+private:
+	error Process(bool modify, bool locked, std::vector<RarBatch::Result>& results);
+	error ProcessMember(const CString& name, ULONGLONG size, bool modify, bool locked,
+		std::vector<RarBatch::Result>& results);
+	void InspectArchive(const CString& name, BYTE* data, size_t size, bool modify, bool locked,
+		std::vector<RarBatch::Result>& results);
+	error Read(void* buffer, size_t size, size_t& bytesRead);
+	error ReadExact(void* buffer, size_t size);
+	error Write(const void* buffer, size_t size);
+	error Copy(ULONGLONG size);
+	error CopyToEnd();
+	error FillBuffer(size_t size);
+	error FlushBuffer();
+	static bool VerifyChecksum(const BYTE* header);
+	static bool ParseNumber(const BYTE* field, size_t size, ULONGLONG& value);
+	static CString GetName(const BYTE* header);
+	static CString DecodeName(const char* name, size_t length);
+	static void ParsePaxRecords(const std::vector<BYTE>& data, CString& path,
+		bool& hasSize, ULONGLONG& size);
+
+	HANDLE m_input;
+	HANDLE m_output;
+	// The buffered bytes of the current member, from m_bufferOffset.
+	std::vector<BYTE> m_buffer;
+	ULONGLONG m_bufferOffset;
+	std::vector<BYTE> m_copyBuffer;
+
+	static const size_t m_blockSize = 512;
+	static const size_t m_prefixSize = 0x1000; // for RarClassifier::LocateArchive
+	static const size_t m_windowSize = 0x10000; // from the archive, for the main header
+	static const size_t m_maxMetadataSize = 0x100000; // of long names and pax records
+	static const size_t m_copySize = 0x100000;
+};
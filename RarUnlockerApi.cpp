@@ -0,0 +1,281 @@
+#include "stdafx.h"
+#include "RarUnlockerApi.h"
+#include "RarScheduler.h"
+#include "RarSession.h"
+
+struct rar_unlocker_archive {
+	// Archives opened by path are kept as a session, which doesn't hold
+	// the file. Handles and buffers are kept open.
+	RarSession session;
+	RarFile file;
+	bool openedByPath;
+	bool writable;
+};
+
+namespace
+{
+	// Nothing may be thrown across the C interface. Allocation failures
+	// throw std::bad_alloc, or CAtlException for CString.
+	template<typename Function>
+	int Guarded(Function function)
+	{
+		try {
+			return function();
+		} catch(...) {
+			return RAR_UNLOCKER_OUT_OF_MEMORY;
+		}
+	}
+
+	template<typename Archive>
+	void GetStatus(Archive& archive, rar_unlocker_status& status)
+	{
+		status.version = archive.GetRarVersion();
+		status.sfx = archive.IsSFX() ? 1 : 0;
+
+		DWORD flags;
+		RarFile::error err = archive.GetFlags(flags);
+		status.error = static_cast<int>(err);
+		status.flags = err == RarFile::error::success ? flags : 0;
+	}
+
+	int OpenFile(std::unique_ptr<rar_unlocker_archive>& newArchive, int flags,
+		rar_unlocker_archive** archive, const std::function<RarFile::error(RarFile& file, bool writable)>& open)
+	{
+		bool writable = (flags & RAR_UNLOCKER_OPEN_WRITABLE) != 0;
+
+		RarFile::error err = open(newArchive->file, writable);
+		if(err != RarFile::error::success) {
+			return static_cast<int>(err);
+		}
+
+		newArchive->openedByPath = false;
+		newArchive->writable = writable;
+		*archive = newArchive.release();
+		return RAR_UNLOCKER_SUCCESS;
+	}
+
+	// Runs work(index) for each index on up to threadCount threads.
+	void RunBatch(size_t count, unsigned int threadCount, const std::function<void(size_t index)>& work)
+	{
+		if(threadCount == 0) {
+			threadCount = std::thread::hardware_concurrency();
+		}
+
+		// The paths aren't located on disk, the caller chooses their order.
+		std::vector<RarScheduler::Device> devices(1);
+		devices[0].items.resize(count);
+		for(size_t i = 0; i < count; i++) {
+			devices[0].items[i] = i;
+		}
+
+		devices[0].seekPenalty = false;
+
+		RarScheduler::Run(devices, threadCount, [&work](size_t item, unsigned int thread) {
+			work(item);
+		});
+	}
+
+	bool ValidPaths(const wchar_t* const* paths, size_t count)
+	{
+		if(count == 0) {
+			return true;
+		}
+
+		if(!paths) {
+			return false;
+		}
+
+		for(size_t i = 0; i < count; i++) {
+			if(!paths[i]) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+}
+
+int RAR_UNLOCKER_CALL rar_unlocker_api_version(void)
+{
+	return RAR_UNLOCKER_API_VERSION;
+}
+
+const char* RAR_UNLOCKER_CALL rar_unlocker_error_message(int error)
+{
+	switch(error) {
+	case RAR_UNLOCKER_SUCCESS:
+		return "Success";
+
+	case RAR_UNLOCKER_OPEN_FAILED:
+		return "Could not open file";
+
+	case RAR_UNLOCKER_INVALID_FILE:
+		return "Not a valid RAR archive";
+
+	case RAR_UNLOCKER_ENCRYPTED_ARCHIVE:
+		return "The archive headers are encrypted";
+
+	case RAR_UNLOCKER_FILE_CHANGED:
+		return "The file was changed since it was opened";
+
+	case RAR_UNLOCKER_WRITE_FAILED:
+		return "Could not write to file";
+
+	case RAR_UNLOCKER_INVALID_ARGUMENT:
+		return "Invalid argument";
+
+	case RAR_UNLOCKER_OUT_OF_MEMORY:
+		return "Not enough memory or system resources";
+	}
+
+	return "Unknown error";
+}
+
+int RAR_UNLOCKER_CALL rar_unlocker_open_path(const wchar_t* path,
+	int flags, rar_unlocker_archive** archive)
+{
+	if(!path || !archive) {
+		return RAR_UNLOCKER_INVALID_ARGUMENT;
+	}
+
+	*archive = nullptr;
+
+	return Guarded([&]() {
+		std::unique_ptr<rar_unlocker_archive> newArchive(new rar_unlocker_archive);
+
+		RarFile::error err = newArchive->session.Load(path);
+		if(err != RarFile::error::success) {
+			return static_cast<int>(err);
+		}
+
+		newArchive->openedByPath = true;
+		newArchive->writable = true;
+		*archive = newArchive.release();
+		return RAR_UNLOCKER_SUCCESS;
+	});
+}
+
+int RAR_UNLOCKER_CALL rar_unlocker_open_handle(void* handle,
+	int flags, rar_unlocker_archive** archive)
+{
+	if(!handle || handle == INVALID_HANDLE_VALUE || !archive) {
+		return RAR_UNLOCKER_INVALID_ARGUMENT;
+	}
+
+	*archive = nullptr;
+
+	return Guarded([&]() {
+		std::unique_ptr<rar_unlocker_archive> newArchive(new rar_unlocker_archive);
+		return OpenFile(newArchive, flags, archive, [handle](RarFile& file, bool writable) {
+			return file.OpenHandle(handle, writable);
+		});
+	});
+}
+
+int RAR_UNLOCKER_CALL rar_unlocker_open_buffer(void* data, size_t size,
+	int flags, rar_unlocker_archive** archive)
+{
+	if((!data && size != 0) || !archive) {
+		return RAR_UNLOCKER_INVALID_ARGUMENT;
+	}
+
+	*archive = nullptr;
+
+	return Guarded([&]() {
+		std::unique_ptr<rar_unlocker_archive> newArchive(new rar_unlocker_archive);
+		return OpenFile(newArchive, flags, archive, [data, size](RarFile& file, bool writable) {
+			return file.OpenBuffer(static_cast<BYTE*>(data), size, writable);
+		});
+	});
+}
+
+int RAR_UNLOCKER_CALL rar_unlocker_get_status(rar_unlocker_archive* archive,
+	rar_unlocker_status* status)
+{
+	if(!archive || !status) {
+		return RAR_UNLOCKER_INVALID_ARGUMENT;
+	}
+
+	if(archive->openedByPath) {
+		GetStatus(archive->session, *status);
+	} else {
+		GetStatus(archive->file, *status);
+	}
+
+	return RAR_UNLOCKER_SUCCESS;
+}
+
+int RAR_UNLOCKER_CALL rar_unlocker_set_locked(rar_unlocker_archive* archive,
+	int locked)
+{
+	if(!archive || !archive->writable) {
+		return RAR_UNLOCKER_INVALID_ARGUMENT;
+	}
+
+	return Guarded([&]() {
+		RarFile::error err = archive->openedByPath ?
+			archive->session.SetLocked(locked != 0) :
+			archive->file.SetLocked(locked != 0);
+		return static_cast<int>(err);
+	});
+}
+
+void RAR_UNLOCKER_CALL rar_unlocker_close(rar_unlocker_archive* archive)
+{
+	delete archive;
+}
+
+int RAR_UNLOCKER_CALL rar_unlocker_get_status_batch(const wchar_t* const* paths,
+	size_t count, unsigned int thread_count, rar_unlocker_status* statuses)
+{
+	if(!ValidPaths(paths, count) || (!statuses && count != 0)) {
+		return RAR_UNLOCKER_INVALID_ARGUMENT;
+	}
+
+	return Guarded([&]() {
+		RunBatch(count, thread_count, [paths, statuses](size_t i) {
+			rar_unlocker_status& status = statuses[i];
+			status = rar_unlocker_status();
+
+			int result = Guarded([&]() {
+				RarSession session;
+				RarFile::error err = session.Load(paths[i]);
+				if(err == RarFile::error::success) {
+					GetStatus(session, status);
+				}
+
+				return static_cast<int>(err);
+			});
+
+			if(result != RAR_UNLOCKER_SUCCESS) {
+				status.error = result;
+			}
+		});
+
+		return RAR_UNLOCKER_SUCCESS;
+	});
+}
+
+int RAR_UNLOCKER_CALL rar_unlocker_set_locked_batch(const wchar_t* const* paths,
+	size_t count, int locked, unsigned int thread_count, int* errors)
+{
+	if(!ValidPaths(paths, count) || (!errors && count != 0)) {
+		return RAR_UNLOCKER_INVALID_ARGUMENT;
+	}
+
+	return Guarded([&]() {
+		RunBatch(count, thread_count, [paths, locked, errors](size_t i) {
+			errors[i] = Guarded([&]() {
+				RarSession session;
+				RarFile::error err = session.Load(paths[i]);
+				if(err == RarFile::error::success) {
+					err = session.SetLocked(locked != 0);
+				}
+
+				return static_cast<int>(err);
+			});
+		});
+
+		return RAR_UNLOCKER_SUCCESS;
+	});
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+/*
+ * C interface of the RAR Unlocker library, rar_unlocker.dll, for use from
+ * other languages without starting rar_unlocker.exe for each archive.
+ *
+ * The interface only grows: functions, structures and error codes aren't
+ * changed once released, new ones are added with a new
+ * RAR_UNLOCKER_API_VERSION. Functions don't show any UI, and report
+ * failures with the error codes below. All the functions can be called
+ * from several threads, but an archive handle must not be used by more
+ * than one thread at a time.
+ *
+ * The library requires Windows Vista or newer: it uses thread-local
+ * variables, which Windows XP doesn't support in a DLL loaded with
+ * LoadLibrary.
+ */
+
+#include <stddef.h>
+#include <wchar.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef RAR_UNLOCKER_API_EXPORTS
+#define RAR_UNLOCKER_API __declspec(dllexport)
+#else
+#define RAR_UNLOCKER_API __declspec(dllimport)
+#endif
+
+#define RAR_UNLOCKER_CALL __cdecl
+
+#define RAR_UNLOCKER_API_VERSION 1
+
+/* Error codes, the first ones have the values of RarFile::error. */
+#define RAR_UNLOCKER_SUCCESS 0
+#define RAR_UNLOCKER_OPEN_FAILED 1
+#define RAR_UNLOCKER_INVALID_FILE 2
+#define RAR_UNLOCKER_ENCRYPTED_ARCHIVE 3
+#define RAR_UNLOCKER_FILE_CHANGED 4
+#define RAR_UNLOCKER_WRITE_FAILED 5
+#define RAR_UNLOCKER_INVALID_ARGUMENT 6
+#define RAR_UNLOCKER_OUT_OF_MEMORY 7
+
+/* Archive flags, the values of RarFile::flags. */
+#define RAR_UNLOCKER_MULTIVOLUME 0x01
+#define RAR_UNLOCKER_FIRST_VOLUME 0x02
+#define RAR_UNLOCKER_SOLID 0x04
+#define RAR_UNLOCKER_RECOVERY_RECORD 0x08
+#define RAR_UNLOCKER_LOCKED 0x10
+#define RAR_UNLOCKER_ENCRYPTED_HEADERS 0x20
+
+/* Open flags. */
+#define RAR_UNLOCKER_OPEN_WRITABLE 0x01
+
+typedef struct rar_unlocker_archive rar_unlocker_archive;
+
+typedef struct rar_unlocker_status {
+	/* The error of opening the archive, or of reading its main header. */
+	int error;
+	/* 4 or 5, 0 if the archive couldn't be opened. */
+	int version;
+	/* Non-zero for an archive which follows an SFX module. */
+	int sfx;
+	/* RAR_UNLOCKER_* archive flags, 0 if error isn't RAR_UNLOCKER_SUCCESS. */
+	unsigned int flags;
+} rar_unlocker_status;
+
+/* Returns RAR_UNLOCKER_API_VERSION of the library. */
+RAR_UNLOCKER_API int RAR_UNLOCKER_CALL rar_unlocker_api_version(void);
+
+/* Returns a static English description of an error code. */
+RAR_UNLOCKER_API const char* RAR_UNLOCKER_CALL rar_unlocker_error_message(int error);
+
+/*
+ * Opens an archive by path. Only the main header is kept, the file isn't
+ * held open, and rar_unlocker_set_locked makes sure that the file wasn't
+ * changed since. RAR_UNLOCKER_OPEN_WRITABLE isn't needed.
+ */
+RAR_UNLOCKER_API int RAR_UNLOCKER_CALL rar_unlocker_open_path(const wchar_t* path,
+	int flags, rar_unlocker_archive** archive);
+
+/*
+ * Opens an archive from a file handle, opened with GENERIC_READ, and with
+ * GENERIC_WRITE for RAR_UNLOCKER_OPEN_WRITABLE. The handle can be closed
+ * after the call. A C runtime file descriptor must be converted with
+ * _get_osfhandle by the caller, since each runtime has its own table.
+ */
+RAR_UNLOCKER_API int RAR_UNLOCKER_CALL rar_unlocker_open_handle(void* handle,
+	int flags, rar_unlocker_archive** archive);
+
+/*
+ * Opens an archive which is in memory. The data must stay valid until the
+ * archive is closed. With RAR_UNLOCKER_OPEN_WRITABLE, rar_unlocker_set_locked
+ * patches the data in place.
+ */
+RAR_UNLOCKER_API int RAR_UNLOCKER_CALL rar_unlocker_open_buffer(void* data, size_t size,
+	int flags, rar_unlocker_archive** archive);
+
+RAR_UNLOCKER_API int RAR_UNLOCKER_CALL rar_unlocker_get_status(rar_unlocker_archive* archive,
+	rar_unlocker_status* status);
+
+RAR_UNLOCKER_API int RAR_UNLOCKER_CALL rar_unlocker_set_locked(rar_unlocker_archive* archive,
+	int locked);
+
+/* Accepts NULL. */
+RAR_UNLOCKER_API void RAR_UNLOCKER_CALL rar_unlocker_close(rar_unlocker_archive* archive);
+
+/*
+ * Batch versions of the calls above for many paths, on up to thread_count
+ * threads, 0 for one per processor. The result of each path is written to
+ * the element of the same index, the return value is only about the
+ * arguments.
+ */
+RAR_UNLOCKER_API int RAR_UNLOCKER_CALL rar_unlocker_get_status_batch(const wchar_t* const* paths,
+	size_t count, unsigned int thread_count, rar_unlocker_status* statuses);
+
+RAR_UNLOCKER_API int RAR_UNLOCKER_CALL rar_unlocker_set_locked_batch(const wchar_t* const* paths,
+	size_t count, int locked, unsigned int thread_count, int* errors);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,226 @@
+"""Python binding of rar_unlocker.dll, the C interface in RarUnlockerApi.h.
+
+Archives are checked and modified in-process, without starting
+rar_unlocker.exe for each archive. The library is loaded with ctypes.CDLL,
+which releases the GIL for the duration of each call, so that other Python
+threads keep running while an archive is read. The batch functions check
+many archives in a single call, on the library's own threads.
+
+The library is looked up in RAR_UNLOCKER_DLL, then next to this module,
+then on the DLL search path.
+"""
+
+import collections
+import ctypes
+import os
+
+__all__ = [
+    "SUCCESS", "OPEN_FAILED", "INVALID_FILE", "ENCRYPTED_ARCHIVE",
+    "FILE_CHANGED", "WRITE_FAILED", "INVALID_ARGUMENT", "OUT_OF_MEMORY",
+    "MULTIVOLUME", "FIRST_VOLUME", "SOLID", "RECOVERY_RECORD", "LOCKED",
+    "ENCRYPTED_HEADERS", "RarUnlockerError", "Status", "Archive",
+    "error_message", "get_status_batch", "set_locked_batch",
+]
+
+API_VERSION = 1
+
+# Error codes.
+SUCCESS = 0
+OPEN_FAILED = 1
+INVALID_FILE = 2
+ENCRYPTED_ARCHIVE = 3
+FILE_CHANGED = 4
+WRITE_FAILED = 5
+INVALID_ARGUMENT = 6
+OUT_OF_MEMORY = 7
+
+# Archive flags.
+MULTIVOLUME = 0x01
+FIRST_VOLUME = 0x02
+SOLID = 0x04
+RECOVERY_RECORD = 0x08
+LOCKED = 0x10
+ENCRYPTED_HEADERS = 0x20
+
+_OPEN_WRITABLE = 0x01
+
+
+class _Status(ctypes.Structure):
+    _fields_ = [
+        ("error", ctypes.c_int),
+        ("version", ctypes.c_int),
+        ("sfx", ctypes.c_int),
+        ("flags", ctypes.c_uint),
+    ]
+
+
+def _load_library():
+    path = os.environ.get("RAR_UNLOCKER_DLL")
+    if not path:
+        path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "rar_unlocker.dll")
+        if not os.path.exists(path):
+            path = "rar_unlocker.dll"
+
+    lib = ctypes.CDLL(path)
+
+    lib.rar_unlocker_api_version.argtypes = []
+    lib.rar_unlocker_api_version.restype = ctypes.c_int
+    lib.rar_unlocker_error_message.argtypes = [ctypes.c_int]
+    lib.rar_unlocker_error_message.restype = ctypes.c_char_p
+    lib.rar_unlocker_open_path.argtypes = [ctypes.c_wchar_p, ctypes.c_int, ctypes.POINTER(ctypes.c_void_p)]
+    lib.rar_unlocker_open_path.restype = ctypes.c_int
+    lib.rar_unlocker_open_handle.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.POINTER(ctypes.c_void_p)]
+    lib.rar_unlocker_open_handle.restype = ctypes.c_int
+    lib.rar_unlocker_open_buffer.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_int,
+                                             ctypes.POINTER(ctypes.c_void_p)]
+    lib.rar_unlocker_open_buffer.restype = ctypes.c_int
+    lib.rar_unlocker_get_status.argtypes = [ctypes.c_void_p, ctypes.POINTER(_Status)]
+    lib.rar_unlocker_get_status.restype = ctypes.c_int
+    lib.rar_unlocker_set_locked.argtypes = [ctypes.c_void_p, ctypes.c_int]
+    lib.rar_unlocker_set_locked.restype = ctypes.c_int
+    lib.rar_unlocker_close.argtypes = [ctypes.c_void_p]
+    lib.rar_unlocker_close.restype = None
+    lib.rar_unlocker_get_status_batch.argtypes = [ctypes.POINTER(ctypes.c_wchar_p), ctypes.c_size_t,
+                                                  ctypes.c_uint, ctypes.POINTER(_Status)]
+    lib.rar_unlocker_get_status_batch.restype = ctypes.c_int
+    lib.rar_unlocker_set_locked_batch.argtypes = [ctypes.POINTER(ctypes.c_wchar_p), ctypes.c_size_t,
+                                                  ctypes.c_int, ctypes.c_uint, ctypes.POINTER(ctypes.c_int)]
+    lib.rar_unlocker_set_locked_batch.restype = ctypes.c_int
+
+    version = lib.rar_unlocker_api_version()
+    if version < API_VERSION:
+        raise ImportError("%s has API version %d, %d is required" % (path, version, API_VERSION))
+
+    return lib
+
+
+_lib = _load_library()
+
+
+def error_message(error):
+    return _lib.rar_unlocker_error_message(error).decode("ascii")
+
+
+class RarUnlockerError(Exception):
+    def __init__(self, error):
+        super().__init__(error_message(error))
+        self.error = error
+
+
+def _check(error):
+    if error != SUCCESS:
+        raise RarUnlockerError(error)
+
+
+class Status(collections.namedtuple("Status", ["error", "version", "sfx", "flags"])):
+    """The result of checking an archive. error is the error of opening the
+    archive or of reading its main header, flags are 0 unless it's SUCCESS.
+    """
+
+    __slots__ = ()
+
+    @property
+    def locked(self):
+        return bool(self.flags & LOCKED)
+
+    @classmethod
+    def _from_struct(cls, status):
+        return cls(status.error, status.version, bool(status.sfx), status.flags)
+
+
+class Archive:
+    """An open archive, use one of the open_* class methods. An archive must
+    not be used by more than one thread at a time.
+    """
+
+    def __init__(self, handle, buffer=None):
+        self._handle = handle
+        self._buffer = buffer  # kept alive while the library uses it
+
+    @classmethod
+    def open_path(cls, path):
+        """Only the main header is kept, and set_locked makes sure that the
+        file wasn't changed since it was opened."""
+        handle = ctypes.c_void_p()
+        _check(_lib.rar_unlocker_open_path(os.fspath(path), 0, ctypes.byref(handle)))
+        return cls(handle)
+
+    @classmethod
+    def open_handle(cls, os_handle, writable=False):
+        """Opens a Windows file handle, which can be closed afterwards."""
+        handle = ctypes.c_void_p()
+        flags = _OPEN_WRITABLE if writable else 0
+        _check(_lib.rar_unlocker_open_handle(os_handle, flags, ctypes.byref(handle)))
+        return cls(handle)
+
+    @classmethod
+    def open_fd(cls, fd, writable=False):
+        """Opens a file descriptor of this Python's C runtime."""
+        import msvcrt
+        return cls.open_handle(msvcrt.get_osfhandle(fd), writable)
+
+    @classmethod
+    def open_buffer(cls, data):
+        """Opens an archive in memory. With a writable buffer, e.g. a
+        bytearray, set_locked patches the data in place."""
+        view = memoryview(data)
+        writable = not view.readonly
+        if writable:
+            buffer = (ctypes.c_char * view.nbytes).from_buffer(view)
+        else:
+            buffer = ctypes.create_string_buffer(view.tobytes(), view.nbytes)
+
+        handle = ctypes.c_void_p()
+        flags = _OPEN_WRITABLE if writable else 0
+        _check(_lib.rar_unlocker_open_buffer(buffer, view.nbytes, flags, ctypes.byref(handle)))
+        return cls(handle, buffer)
+
+    def status(self):
+        status = _Status()
+        _check(_lib.rar_unlocker_get_status(self._get_handle(), ctypes.byref(status)))
+        return Status._from_struct(status)
+
+    def set_locked(self, locked):
+        _check(_lib.rar_unlocker_set_locked(self._get_handle(), 1 if locked else 0))
+
+    def close(self):
+        if self._handle is not None:
+            _lib.rar_unlocker_close(self._handle)
+            self._handle = None
+            self._buffer = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def __del__(self):
+        self.close()
+
+    def _get_handle(self):
+        if self._handle is None:
+            raise ValueError("The archive is closed")
+        return self._handle
+
+
+def _path_array(paths):
+    paths = [os.fspath(path) for path in paths]
+    return (ctypes.c_wchar_p * len(paths))(*paths), len(paths)
+
+
+def get_status_batch(paths, thread_count=0):
+    """Returns a Status for each path, thread_count 0 uses a thread per
+    processor."""
+    array, count = _path_array(paths)
+    statuses = (_Status * count)()
+    _check(_lib.rar_unlocker_get_status_batch(array, count, thread_count, statuses))
+    return [Status._from_struct(status) for status in statuses]
+
+
+def set_locked_batch(paths, locked, thread_count=0):
+    """Returns an error code for each path."""
+    array, count = _path_array(paths)
+    errors = (ctypes.c_int * count)()
+    _check(_lib.rar_unlocker_set_locked_batch(array, count, 1 if locked else 0, thread_count, errors))
+    return list(errors)
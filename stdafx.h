@@ -45,13 +45,29 @@ extern CAppModule _Module;
 // Windows
 
 #include <shellapi.h>
+#include <psapi.h>
+#include <winioctl.h>
 
 //////////////////////////////////////////////////////////////////////////
 // STL
 
 #include <cassert>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <algorithm>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #if defined _M_IX86
   #pragma comment(linker, "/manifestdependency:\"type='win32' name='Microsoft.Windows.Common-Controls' version='6.0.0.0' processorArchitecture='x86' publicKeyToken='6595b64144ccf1df' language='*'\"")
@@ -0,0 +1,158 @@
+/*-
+*  XXH64 by Yann Collet, from the xxHash specification:
+*  https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+*
+*  The input is processed in 32 byte stripes, each of the four lanes of a
+*  stripe goes into its own accumulator. The tail which doesn't fill a
+*  stripe is mixed in when the digest is taken.
+*/
+
+#include "stdafx.h"
+#include "xxhash64.h"
+
+namespace
+{
+	const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+	const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+	const uint64_t prime3 = 0x165667B19E3779F9ULL;
+	const uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+	const uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+	const size_t stripeSize = 32;
+
+	inline uint64_t RotateLeft(uint64_t value, int bits)
+	{
+		return (value << bits) | (value >> (64 - bits));
+	}
+
+	// The input is little endian, like all the supported targets.
+	inline uint64_t Read64(const unsigned char *p)
+	{
+		uint64_t value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	inline uint32_t Read32(const unsigned char *p)
+	{
+		uint32_t value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+}
+
+XXHash64::XXHash64(uint64_t seed /*= 0*/)
+{
+	m_seed = seed;
+	m_state[0] = seed + prime1 + prime2;
+	m_state[1] = seed + prime2;
+	m_state[2] = seed;
+	m_state[3] = seed - prime1;
+}
+
+void XXHash64::Update(const void *buf, size_t size)
+{
+	const unsigned char *p = static_cast<const unsigned char *>(buf);
+	const unsigned char *end = p + size;
+
+	m_totalSize += size;
+
+	if(m_stripeSize > 0) {
+		size_t copySize = std::min(stripeSize - m_stripeSize, size);
+		memcpy(m_stripe + m_stripeSize, p, copySize);
+		m_stripeSize += copySize;
+		p += copySize;
+
+		if(m_stripeSize < stripeSize) {
+			return;
+		}
+
+		for(int i = 0; i < 4; i++) {
+			m_state[i] = Round(m_state[i], Read64(m_stripe + i * 8));
+		}
+
+		m_stripeSize = 0;
+	}
+
+	uint64_t v1 = m_state[0];
+	uint64_t v2 = m_state[1];
+	uint64_t v3 = m_state[2];
+	uint64_t v4 = m_state[3];
+
+	while(static_cast<size_t>(end - p) >= stripeSize) {
+		v1 = Round(v1, Read64(p));
+		v2 = Round(v2, Read64(p + 8));
+		v3 = Round(v3, Read64(p + 16));
+		v4 = Round(v4, Read64(p + 24));
+		p += stripeSize;
+	}
+
+	m_state[0] = v1;
+	m_state[1] = v2;
+	m_state[2] = v3;
+	m_state[3] = v4;
+
+	m_stripeSize = end - p;
+	memcpy(m_stripe, p, m_stripeSize);
+}
+
+uint64_t XXHash64::Digest() const
+{
+	uint64_t hash;
+
+	if(m_totalSize >= stripeSize) {
+		hash = RotateLeft(m_state[0], 1) + RotateLeft(m_state[1], 7) +
+			RotateLeft(m_state[2], 12) + RotateLeft(m_state[3], 18);
+
+		for(int i = 0; i < 4; i++) {
+			hash = MergeRound(hash, m_state[i]);
+		}
+	} else {
+		hash = m_seed + prime5;
+	}
+
+	hash += m_totalSize;
+
+	const unsigned char *p = m_stripe;
+	const unsigned char *end = m_stripe + m_stripeSize;
+
+	for(; end - p >= 8; p += 8) {
+		hash ^= Round(0, Read64(p));
+		hash = RotateLeft(hash, 27) * prime1 + prime4;
+	}
+
+	if(end - p >= 4) {
+		hash ^= Read32(p) * prime1;
+		hash = RotateLeft(hash, 23) * prime2 + prime3;
+		p += 4;
+	}
+
+	for(; p < end; p++) {
+		hash ^= *p * prime5;
+		hash = RotateLeft(hash, 11) * prime1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= prime2;
+	hash ^= hash >> 29;
+	hash *= prime3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private functions.
+
+uint64_t XXHash64::Round(uint64_t acc, uint64_t input)
+{
+	acc += input * prime2;
+	acc = RotateLeft(acc, 31);
+	return acc * prime1;
+}
+
+uint64_t XXHash64::MergeRound(uint64_t acc, uint64_t value)
+{
+	acc ^= Round(0, value);
+	return acc * prime1 + prime4;
+}
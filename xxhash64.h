@@ -0,0 +1,21 @@
+#pragma once
+
+// Streaming XXH64, a fast non-cryptographic 64-bit hash. The data can be
+// passed in pieces of any size, the digest is the same as of the whole.
+class XXHash64 {
+public:
+	explicit XXHash64(uint64_t seed = 0);
+
+	void Update(const void *buf, size_t size);
+	uint64_t Digest() const;
+
+private:
+	static uint64_t Round(uint64_t acc, uint64_t input);
+	static uint64_t MergeRound(uint64_t acc, uint64_t value);
+
+	uint64_t m_seed;
+	uint64_t m_state[4];
+	uint64_t m_totalSize = 0;
+	unsigned char m_stripe[32]; // the bytes which don't fill a stripe yet
+	size_t m_stripeSize = 0;
+};